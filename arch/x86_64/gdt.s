@@ -9,12 +9,11 @@ global tss_flush
 gdt_flush:
     lgdt [rdi]
     
-    ; reload data segment registers
+    ; reload data segment registers, loading FS or GS would
+    ; clear the GS base that points at the per-CPU area
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov ss, ax
     
     ; reload code segment using far return
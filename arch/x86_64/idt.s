@@ -70,6 +70,9 @@ ISR_NOERRCODE 29  ; reserved
 ISR_ERRCODE   30  ; security exception
 ISR_NOERRCODE 31  ; reserved
 
+; local APIC spurious interrupt, needs no EOI
+ISR_NOERRCODE 255
+
 ; IRQ handlers (32-47)
 IRQ 0, 32   ; PIT timer
 IRQ 1, 33   ; keyboard
@@ -90,6 +93,12 @@ IRQ 15, 47  ; secondary ATA
 
 ; common ISR stub
 isr_common_stub:
+    ; from ring 3 the GS base is the user's, swap in this CPU's area
+    test qword [rsp + 24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
+    
     ; save all registers
     push rax
     push rbx
@@ -131,10 +140,21 @@ isr_common_stub:
     ; remove error code and interrupt number
     add rsp, 16
     
+    ; returning to ring 3 gives the user's GS base back
+    test qword [rsp + 8], 3
+    jz .kernel_return
+    swapgs
+.kernel_return:
     iretq
 
 ; common IRQ stub
 irq_common_stub:
+    ; from ring 3 the GS base is the user's, swap in this CPU's area
+    test qword [rsp + 24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
+    
     ; save all registers
     push rax
     push rbx
@@ -176,4 +196,9 @@ irq_common_stub:
     ; remove error code and interrupt number
     add rsp, 16
     
+    ; returning to ring 3 gives the user's GS base back
+    test qword [rsp + 8], 3
+    jz .kernel_return
+    swapgs
+.kernel_return:
     iretq
\ No newline at end of file
@@ -3,7 +3,10 @@ section .text
 
 global syscall_entry
 extern syscall_handler
-extern gdt_set_kernel_stack
+
+; struct percpu offsets (percpu.h)
+PERCPU_SYSCALL_STACK equ 8
+PERCPU_USER_RSP equ 16
 
 ; Syscall entry point
 ; When userspace executes SYSCALL instruction:
@@ -20,18 +23,20 @@ extern gdt_set_kernel_stack
 ;   - Return via SYSRET
 
 syscall_entry:
+    ; GS base to this CPU's area, SFMASK has interrupts off until we're done
+    swapgs
+    
     ; Save user stack pointer
-    mov [rel user_rsp], rsp
+    mov [gs:PERCPU_USER_RSP], rsp
     
-    ; Switch to kernel stack
+    ; Switch to this CPU's syscall stack
     ; TODO: When we have per-process kernel stacks, use TSS.rsp0
-    ; For now, use a static kernel stack
-    mov rsp, kernel_syscall_stack_top
+    mov rsp, [gs:PERCPU_SYSCALL_STACK]
     
     ; Build a fake interrupt frame on kernel stack
     ; This makes it easier to debug and matches exception handling
-    push qword 0x20 | 3         ; User data segment (SS)
-    push qword [rel user_rsp]   ; User RSP
+    push qword 0x20 | 3             ; User data segment (SS)
+    push qword [gs:PERCPU_USER_RSP] ; User RSP
     push r11                     ; RFLAGS (saved by SYSCALL)
     push qword 0x18 | 3         ; User code segment (CS)
     push rcx                     ; Return RIP (saved by SYSCALL)
@@ -53,25 +58,32 @@ syscall_entry:
     push r14
     push r15
     
-    ; Arguments to syscall_handler:
+    ; Arguments to syscall_handler come from the saved registers,
+    ; shuffling them register to register would clobber them:
     ; rdi = syscall number (rax)
     ; rsi = arg1 (rdi)
     ; rdx = arg2 (rsi)
     ; rcx = arg3 (rdx)
     ; r8  = arg4 (r10)
     ; r9  = arg5 (r8)
+    ; [rsp] = arg6 (r9)
     
-    mov rdi, rax    ; syscall number
-    mov rsi, rdi    ; arg1 (original rdi)
-    mov rdx, rsi    ; arg2 (original rsi)
-    mov rcx, rdx    ; arg3 (original rdx)
-    mov r8, r10     ; arg4 (original r10)
-    mov r9, r8      ; arg5 (original r8)
+    mov rdi, [rsp + 112]    ; syscall number
+    mov rsi, [rsp + 72]     ; arg1 (original rdi)
+    mov rdx, [rsp + 80]     ; arg2 (original rsi)
+    mov rcx, [rsp + 88]     ; arg3 (original rdx)
+    mov r8, [rsp + 40]      ; arg4 (original r10)
+    mov r9, [rsp + 56]      ; arg5 (original r8)
+    mov rax, [rsp + 48]     ; arg6 (original r9)
     
     ; Align stack to 16 bytes (required by System V ABI)
     mov rbp, rsp
     and rsp, ~0xF
     
+    ; arg6 goes on the stack, padded so the call keeps the alignment
+    sub rsp, 8
+    push rax
+    
     ; Call C handler
     call syscall_handler
     
@@ -79,7 +91,7 @@ syscall_entry:
     mov rsp, rbp
     
     ; Return value in rax
-    mov [rsp], rax  ; Overwrite saved rax with return value
+    mov [rsp + 112], rax  ; Overwrite saved rax with return value
     
     ; Restore all registers
     pop r15
@@ -102,18 +114,12 @@ syscall_entry:
     add rsp, 8      ; Skip RIP (rcx already has it)
     add rsp, 8      ; Skip CS
     pop r11         ; Restore RFLAGS
-    pop rsp         ; Restore user stack
-    add rsp, 8      ; Skip SS
+    pop rsp         ; Restore user stack, SS is left behind
+    
+    ; user GS base back
+    swapgs
     
     ; Return to userspace
     ; RCX = return RIP (from SYSCALL)
     ; R11 = RFLAGS (from SYSCALL)
-    o64 sysret
-
-section .bss
-align 16
-    resb 8192  ; 8KB kernel stack for syscalls
-kernel_syscall_stack_top:
-
-align 8
-user_rsp: resq 1
\ No newline at end of file
+    o64 sysret
\ No newline at end of file
@@ -0,0 +1,103 @@
+; Application processor startup trampoline
+; smp_init copies this to TRAMPOLINE_BASE and patches the fields at the end,
+; so every address in it is taken relative to that copy
+
+TRAMPOLINE_BASE equ 0x8000
+%define TADDR(label) (TRAMPOLINE_BASE + (label) - trampoline_start)
+
+section .rodata
+
+global trampoline_start
+global trampoline_end
+global trampoline_cr3
+global trampoline_stack
+global trampoline_cpu
+extern ap_main
+
+[BITS 16]
+align 16
+trampoline_start:
+    ; the startup IPI leaves us in real mode at TRAMPOLINE_BASE:0
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    lgdt [TADDR(tramp_gdt.pointer)]
+
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp 0x08:TADDR(tramp_protected)
+
+[BITS 32]
+tramp_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; PAE
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+
+    ; the kernel PML4, it keeps the low identity map this code runs from
+    mov eax, [TADDR(trampoline_cr3)]
+    mov cr3, eax
+
+    ; long mode enable
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, 1 << 8
+    wrmsr
+
+    mov eax, cr0
+    or eax, 1 << 31
+    mov cr0, eax
+    jmp 0x18:TADDR(tramp_long)
+
+[BITS 64]
+tramp_long:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [TADDR(trampoline_stack)]
+    mov rdi, [TADDR(trampoline_cpu)]
+
+    ; into the higher half, ap_main never returns
+    mov rax, ap_main
+    call rax
+
+    cli
+.hang:
+    hlt
+    jmp .hang
+
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF ; 32-bit code (0x08)
+    dq 0x00CF92000000FFFF ; data (0x10)
+    dq 0x00AF9A000000FFFF ; 64-bit code (0x18)
+.pointer:
+    dw .pointer - tramp_gdt - 1
+    dd TADDR(tramp_gdt)
+
+; patched per CPU by smp_init
+align 8
+trampoline_cr3:
+    dq 0
+trampoline_stack:
+    dq 0
+trampoline_cpu:
+    dq 0
+
+trampoline_end:
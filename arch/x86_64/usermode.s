@@ -34,6 +34,10 @@ enter_usermode:
     mov ds, ax              ; Set DS (data segment)
     mov es, ax              ; Set ES (extra segment)
     mov fs, ax              ; Set FS
+    
+    ; Park this CPU's area in KERNEL_GS_BASE for the next entry, loading
+    ; GS afterwards only resets the user's base
+    swapgs
     mov gs, ax              ; Set GS
     
     ;
@@ -3,6 +3,7 @@
 #include <thuban/string.h>
 #include <thuban/stdio.h>
 #include <thuban/heap.h>
+#include <thuban/slab.h>
 #include <thuban/spinlock.h>
 #include <thuban/blkdev.h>
 
@@ -11,6 +12,7 @@ static vfs_inode_operations_t fat32_inode_ops;
 static vfs_superblock_operations_t fat32_sb_ops;
 static vfs_filesystem_t fat32_filesystem;
 static spinlock_t fat32_lock;
+static struct kmem_cache *fat32_inode_cache;
 
 uint32_t fat32_cluster_to_sector(fat32_fs_t *fs, uint32_t cluster)
 {
@@ -223,14 +225,14 @@ vfs_node_t *fat32_lookup(vfs_node_t *dir, const char *name)
     if (!fs || !dir_inode)
         return NULL;
     uint32_t cluster = dir_inode->first_cluster;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
         return NULL;
     while (cluster >= 2 && cluster < FAT32_EOC_MIN)
     {
         if (fat32_read_cluster(fs, cluster, cluster_buf) != 0)
         {
-            free(cluster_buf);
+            kmem_cache_free(fs->cluster_cache, cluster_buf);
             return NULL;
         }
         fat32_dir_entry_t *entries = (fat32_dir_entry_t *)cluster_buf;
@@ -239,7 +241,7 @@ vfs_node_t *fat32_lookup(vfs_node_t *dir, const char *name)
         {
             if (entries[i].name[0] == 0x00)
             {
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return NULL;
             }
             if ((uint8_t)entries[i].name[0] == 0xE5)
@@ -252,13 +254,12 @@ vfs_node_t *fat32_lookup(vfs_node_t *dir, const char *name)
             fat32_83_to_name(entries[i].name, entry_name);
             if (strcmp(entry_name, name) == 0)
             {
-                vfs_node_t *node = (vfs_node_t *)malloc(sizeof(vfs_node_t));
+                vfs_node_t *node = vfs_alloc_node();
                 if (!node)
                 {
-                    free(cluster_buf);
+                    kmem_cache_free(fs->cluster_cache, cluster_buf);
                     return NULL;
                 }
-                memset(node, 0, sizeof(vfs_node_t));
                 strncpy(node->name, entry_name, VFS_MAX_NAME - 1);
                 uint32_t first_cluster = ((uint32_t)entries[i].first_cluster_hi << 16) | entries[i].first_cluster_lo;
                 node->inode = first_cluster;
@@ -272,24 +273,24 @@ vfs_node_t *fat32_lookup(vfs_node_t *dir, const char *name)
                 node->fops = &fat32_file_ops;
                 node->iops = &fat32_inode_ops;
                 node->ctime = node->mtime = node->atime = fat32_decode_datetime(entries[i].create_date, entries[i].create_time);
-                fat32_inode_t *inode_data = (fat32_inode_t *)malloc(sizeof(fat32_inode_t));
+                fat32_inode_t *inode_data = (fat32_inode_t *)kmem_cache_alloc(fat32_inode_cache);
                 if (!inode_data)
                 {
                     free(node);
-                    free(cluster_buf);
+                    kmem_cache_free(fs->cluster_cache, cluster_buf);
                     return NULL;
                 }
                 inode_data->first_cluster = first_cluster;
                 inode_data->dir_cluster = cluster;
                 inode_data->dir_offset = i;
                 node->fs_data = inode_data;
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return node;
             }
         }
         cluster = fat32_get_next_cluster(fs, cluster);
     }
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     return NULL;
 }
 
@@ -314,7 +315,7 @@ int fat32_create(vfs_node_t *dir, const char *name, mode_t mode)
     uint32_t new_cluster = fat32_alloc_cluster(fs);
     if (new_cluster == 0)
         return -1;
-    uint8_t *zero_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *zero_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!zero_buf)
     {
         fat32_free_cluster(fs, new_cluster);
@@ -322,9 +323,9 @@ int fat32_create(vfs_node_t *dir, const char *name, mode_t mode)
     }
     memset(zero_buf, 0, fs->cluster_size);
     fat32_write_cluster(fs, new_cluster, zero_buf);
-    free(zero_buf);
+    kmem_cache_free(fs->cluster_cache, zero_buf);
     uint32_t cluster = dir_inode->first_cluster;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
     {
         fat32_free_cluster(fs, new_cluster);
@@ -334,7 +335,7 @@ int fat32_create(vfs_node_t *dir, const char *name, mode_t mode)
     {
         if (fat32_read_cluster(fs, cluster, cluster_buf) != 0)
         {
-            free(cluster_buf);
+            kmem_cache_free(fs->cluster_cache, cluster_buf);
             fat32_free_cluster(fs, new_cluster);
             return -1;
         }
@@ -358,11 +359,11 @@ int fat32_create(vfs_node_t *dir, const char *name, mode_t mode)
                 entries[i].write_date = fat32_encode_date(now);
                 if (fat32_write_cluster(fs, cluster, cluster_buf) != 0)
                 {
-                    free(cluster_buf);
+                    kmem_cache_free(fs->cluster_cache, cluster_buf);
                     fat32_free_cluster(fs, new_cluster);
                     return -1;
                 }
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return 0;
             }
         }
@@ -372,7 +373,7 @@ int fat32_create(vfs_node_t *dir, const char *name, mode_t mode)
             uint32_t new_dir_cluster = fat32_alloc_cluster(fs);
             if (new_dir_cluster == 0)
             {
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 fat32_free_cluster(fs, new_cluster);
                 return -1;
             }
@@ -386,7 +387,7 @@ int fat32_create(vfs_node_t *dir, const char *name, mode_t mode)
             cluster = next_cluster;
         }
     }
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     fat32_free_cluster(fs, new_cluster);
     return -1;
 }
@@ -413,7 +414,7 @@ int fat32_rmdir(vfs_node_t *dir, const char *name)
     }
     fat32_inode_t *target_inode = (fat32_inode_t *)target->fs_data;
     uint32_t target_cluster = target_inode->first_cluster;
-    uint8_t *check_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *check_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!check_buf)
     {
         free(target->fs_data);
@@ -437,7 +438,7 @@ int fat32_rmdir(vfs_node_t *dir, const char *name)
                 continue;
             if (entries[i].attr & FAT32_ATTR_VOLUME_ID)
                 continue;
-            free(check_buf);
+            kmem_cache_free(fs->cluster_cache, check_buf);
             free(target->fs_data);
             free(target);
             return -1;
@@ -445,19 +446,19 @@ int fat32_rmdir(vfs_node_t *dir, const char *name)
         scan = fat32_get_next_cluster(fs, scan);
     }
 scan_done:
-    free(check_buf);
+    kmem_cache_free(fs->cluster_cache, check_buf);
     fat32_free_chain(fs, target_cluster);
     free(target->fs_data);
     free(target);
     uint32_t cluster = dir_inode->first_cluster;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
         return -1;
     while (cluster >= 2 && cluster < FAT32_EOC_MIN)
     {
         if (fat32_read_cluster(fs, cluster, cluster_buf) != 0)
         {
-            free(cluster_buf);
+            kmem_cache_free(fs->cluster_cache, cluster_buf);
             return -1;
         }
         fat32_dir_entry_t *entries = (fat32_dir_entry_t *)cluster_buf;
@@ -466,7 +467,7 @@ int fat32_rmdir(vfs_node_t *dir, const char *name)
         {
             if (entries[i].name[0] == 0x00)
             {
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return -1;
             }
             if ((uint8_t)entries[i].name[0] == 0xE5)
@@ -479,13 +480,13 @@ int fat32_rmdir(vfs_node_t *dir, const char *name)
             {
                 entries[i].name[0] = (char)0xE5;
                 fat32_write_cluster(fs, cluster, cluster_buf);
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return 0;
             }
         }
         cluster = fat32_get_next_cluster(fs, cluster);
     }
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     return -1;
 }
 
@@ -498,14 +499,14 @@ int fat32_unlink(vfs_node_t *dir, const char *name)
     if (!fs || !dir_inode)
         return -1;
     uint32_t cluster = dir_inode->first_cluster;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
         return -1;
     while (cluster >= 2 && cluster < FAT32_EOC_MIN)
     {
         if (fat32_read_cluster(fs, cluster, cluster_buf) != 0)
         {
-            free(cluster_buf);
+            kmem_cache_free(fs->cluster_cache, cluster_buf);
             return -1;
         }
         fat32_dir_entry_t *entries = (fat32_dir_entry_t *)cluster_buf;
@@ -514,7 +515,7 @@ int fat32_unlink(vfs_node_t *dir, const char *name)
         {
             if (entries[i].name[0] == 0x00)
             {
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return -1;
             }
             if ((uint8_t)entries[i].name[0] == 0xE5)
@@ -533,16 +534,16 @@ int fat32_unlink(vfs_node_t *dir, const char *name)
                 entries[i].name[0] = (char)0xE5;
                 if (fat32_write_cluster(fs, cluster, cluster_buf) != 0)
                 {
-                    free(cluster_buf);
+                    kmem_cache_free(fs->cluster_cache, cluster_buf);
                     return -1;
                 }
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return 0;
             }
         }
         cluster = fat32_get_next_cluster(fs, cluster);
     }
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     return -1;
 }
 
@@ -562,7 +563,7 @@ ssize_t fat32_read(vfs_file_t *file, void *buf, size_t count, off_t offset)
         return 0;
     if (offset + count > node->size)
         count = node->size - offset;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
         return -1;
     size_t bytes_read = 0;
@@ -577,7 +578,7 @@ ssize_t fat32_read(vfs_file_t *file, void *buf, size_t count, off_t offset)
     {
         if (fat32_read_cluster(fs, cluster, cluster_buf) != 0)
         {
-            free(cluster_buf);
+            kmem_cache_free(fs->cluster_cache, cluster_buf);
             return bytes_read > 0 ? bytes_read : -1;
         }
         size_t to_read = fs->cluster_size - byte_offset;
@@ -588,7 +589,7 @@ ssize_t fat32_read(vfs_file_t *file, void *buf, size_t count, off_t offset)
         byte_offset = 0;
         cluster = fat32_get_next_cluster(fs, cluster);
     }
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     return bytes_read;
 }
 
@@ -597,12 +598,12 @@ static int fat32_update_dir_entry(fat32_fs_t *fs, vfs_node_t *node)
     fat32_inode_t *inode = (fat32_inode_t *)node->fs_data;
     if (!inode || inode->dir_cluster < 2)
         return -1;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
         return -1;
     if (fat32_read_cluster(fs, inode->dir_cluster, cluster_buf) != 0)
     {
-        free(cluster_buf);
+        kmem_cache_free(fs->cluster_cache, cluster_buf);
         return -1;
     }
     fat32_dir_entry_t *entries = (fat32_dir_entry_t *)cluster_buf;
@@ -612,10 +613,10 @@ static int fat32_update_dir_entry(fat32_fs_t *fs, vfs_node_t *node)
     entry->first_cluster_lo = inode->first_cluster & 0xFFFF;
     if (fat32_write_cluster(fs, inode->dir_cluster, cluster_buf) != 0)
     {
-        free(cluster_buf);
+        kmem_cache_free(fs->cluster_cache, cluster_buf);
         return -1;
     }
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     return 0;
 }
 
@@ -628,7 +629,7 @@ ssize_t fat32_write(vfs_file_t *file, const void *buf, size_t count, off_t offse
     fat32_inode_t *inode = (fat32_inode_t *)node->fs_data;
     if (!fs || !inode)
         return -1;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
         return -1;
     size_t bytes_written = 0;
@@ -643,7 +644,7 @@ ssize_t fat32_write(vfs_file_t *file, const void *buf, size_t count, off_t offse
             uint32_t new_cluster = fat32_alloc_cluster(fs);
             if (new_cluster == 0)
             {
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return bytes_written > 0 ? bytes_written : -1;
             }
             if (prev_cluster != 0)
@@ -669,7 +670,7 @@ ssize_t fat32_write(vfs_file_t *file, const void *buf, size_t count, off_t offse
             uint32_t new_cluster = fat32_alloc_cluster(fs);
             if (new_cluster == 0)
             {
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 break;
             }
             if (prev_cluster != 0)
@@ -695,7 +696,7 @@ ssize_t fat32_write(vfs_file_t *file, const void *buf, size_t count, off_t offse
         memcpy(cluster_buf + byte_offset, (const uint8_t *)buf + bytes_written, to_write);
         if (fat32_write_cluster(fs, cluster, cluster_buf) != 0)
         {
-            free(cluster_buf);
+            kmem_cache_free(fs->cluster_cache, cluster_buf);
             return bytes_written > 0 ? bytes_written : -1;
         }
         bytes_written += to_write;
@@ -708,7 +709,7 @@ ssize_t fat32_write(vfs_file_t *file, const void *buf, size_t count, off_t offse
         node->size = offset + bytes_written;
     }
     fat32_update_dir_entry(fs, node);
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     return bytes_written;
 }
 
@@ -722,7 +723,7 @@ int fat32_readdir(vfs_file_t *file, struct dirent *dirent, size_t count)
     if (!fs || !dir_inode)
         return -1;
     uint32_t cluster = dir_inode->first_cluster;
-    uint8_t *cluster_buf = (uint8_t *)malloc(fs->cluster_size);
+    uint8_t *cluster_buf = (uint8_t *)kmem_cache_alloc(fs->cluster_cache);
     if (!cluster_buf)
         return -1;
     int entry_index = (int)(file->offset / sizeof(fat32_dir_entry_t));
@@ -732,7 +733,7 @@ int fat32_readdir(vfs_file_t *file, struct dirent *dirent, size_t count)
     {
         if (fat32_read_cluster(fs, cluster, cluster_buf) != 0)
         {
-            free(cluster_buf);
+            kmem_cache_free(fs->cluster_cache, cluster_buf);
             return entries_read;
         }
         fat32_dir_entry_t *entries = (fat32_dir_entry_t *)cluster_buf;
@@ -741,7 +742,7 @@ int fat32_readdir(vfs_file_t *file, struct dirent *dirent, size_t count)
         {
             if (entries[i].name[0] == 0x00)
             {
-                free(cluster_buf);
+                kmem_cache_free(fs->cluster_cache, cluster_buf);
                 return entries_read;
             }
             if ((uint8_t)entries[i].name[0] == 0xE5)
@@ -776,7 +777,7 @@ int fat32_readdir(vfs_file_t *file, struct dirent *dirent, size_t count)
         }
         cluster = fat32_get_next_cluster(fs, cluster);
     }
-    free(cluster_buf);
+    kmem_cache_free(fs->cluster_cache, cluster_buf);
     return entries_read;
 }
 
@@ -820,9 +821,16 @@ vfs_superblock_t *fat32_mount(const char *dev, uint32_t flags)
     fs->fat_cache = NULL;
     fs->fat_cache_size = 0;
     fs->fat_dirty = 0;
+    fs->cluster_cache = kmem_cache_create("fat32_cluster", fs->cluster_size, 0, KMEM_HWCACHE_ALIGN, NULL);
+    if (!fs->cluster_cache)
+    {
+        free(fs);
+        return NULL;
+    }
     vfs_superblock_t *sb = (vfs_superblock_t *)malloc(sizeof(vfs_superblock_t));
     if (!sb)
     {
+        kmem_cache_destroy(fs->cluster_cache);
         free(fs);
         return NULL;
     }
@@ -832,14 +840,14 @@ vfs_superblock_t *fat32_mount(const char *dev, uint32_t flags)
     sb->total_blocks = fs->total_clusters;
     sb->s_ops = &fat32_sb_ops;
     sb->fs_data = fs;
-    vfs_node_t *root = (vfs_node_t *)malloc(sizeof(vfs_node_t));
+    vfs_node_t *root = vfs_alloc_node();
     if (!root)
     {
+        kmem_cache_destroy(fs->cluster_cache);
         free(fs);
         free(sb);
         return NULL;
     }
-    memset(root, 0, sizeof(vfs_node_t));
     strcpy(root->name, "/");
     root->inode = fs->root_cluster;
     root->mode = S_IFDIR | 0755;
@@ -848,10 +856,11 @@ vfs_superblock_t *fat32_mount(const char *dev, uint32_t flags)
     root->sb = sb;
     root->fops = &fat32_file_ops;
     root->iops = &fat32_inode_ops;
-    fat32_inode_t *root_inode = (fat32_inode_t *)malloc(sizeof(fat32_inode_t));
+    fat32_inode_t *root_inode = (fat32_inode_t *)kmem_cache_alloc(fat32_inode_cache);
     if (!root_inode)
     {
         free(root);
+        kmem_cache_destroy(fs->cluster_cache);
         free(fs);
         free(sb);
         return NULL;
@@ -873,6 +882,7 @@ void fat32_unmount(vfs_superblock_t *sb)
     {
         if (fs->fat_cache)
             free(fs->fat_cache);
+        kmem_cache_destroy(fs->cluster_cache);
         free(fs);
     }
     if (sb->root)
@@ -887,6 +897,9 @@ void fat32_unmount(vfs_superblock_t *sb)
 int fat32_init(void)
 {
     spin_lock_init(&fat32_lock, "fat32");
+    fat32_inode_cache = kmem_cache_create("fat32_inode", sizeof(fat32_inode_t), 0, 0, NULL);
+    if (!fat32_inode_cache)
+        return -1;
     fat32_file_ops.open = fat32_open;
     fat32_file_ops.close = fat32_close;
     fat32_file_ops.read = fat32_read;
@@ -7,18 +7,31 @@
 #include <thuban/string.h>
 #include <thuban/stdio.h>
 #include <thuban/heap.h>
+#include <thuban/slab.h>
 #include <thuban/spinlock.h>
+#include <thuban/rwlock.h>
+#include <thuban/seqlock.h>
 
 static vfs_mount_t *mount_list = NULL;
 static vfs_filesystem_t *fs_list = NULL;
 static vfs_file_t *fd_table[VFS_MAX_OPEN_FILES];
 static vfs_node_t *current_working_dir = NULL;
 static spinlock_t vfs_lock;
+/* Read on every path lookup, written on mount and unmount */
+static rwlock_t mount_lock;
+/* Filesystems are static and never freed, so lookups needn't lock */
+static seqlock_t fs_lock;
+static struct kmem_cache *vfs_node_cache;
+static struct kmem_cache *vfs_file_cache;
 static int vfs_system_init_complete = 0;
 
 void vfs_init(void)
 {
     spin_lock_init(&vfs_lock, "vfs");
+    rwlock_init(&mount_lock, "vfs_mount");
+    seqlock_init(&fs_lock, "vfs_fs");
+    vfs_node_cache = kmem_cache_create("vfs_node", sizeof(vfs_node_t), 0, KMEM_HWCACHE_ALIGN, NULL);
+    vfs_file_cache = kmem_cache_create("vfs_file", sizeof(vfs_file_t), 0, 0, NULL);
     for (int i = 0; i < VFS_MAX_OPEN_FILES; i++)
         fd_table[i] = NULL;
     mount_list = NULL;
@@ -27,55 +40,67 @@ void vfs_init(void)
     vfs_system_init_complete = 0;
 }
 
+/* Zeroed node from the node cache, released with free() like any other node */
+vfs_node_t *vfs_alloc_node(void)
+{
+    vfs_node_t *node = kmem_cache_alloc(vfs_node_cache);
+    if (node)
+        memset(node, 0, sizeof(vfs_node_t));
+    return node;
+}
+
 int vfs_register_filesystem(vfs_filesystem_t *fs)
 {
     if (!fs || !fs->name || !fs->mount)
         return -1;
-    spin_lock(&vfs_lock);
+    write_seqlock(&fs_lock);
     vfs_filesystem_t *existing = fs_list;
     while (existing)
     {
         if (strcmp(existing->name, fs->name) == 0)
         {
-            spin_unlock(&vfs_lock);
+            write_sequnlock(&fs_lock);
             return -1;
         }
         existing = existing->next;
     }
     fs->next = fs_list;
     fs_list = fs;
-    spin_unlock(&vfs_lock);
+    write_sequnlock(&fs_lock);
     return 0;
 }
 
 int vfs_unregister_filesystem(const char *name)
 {
-    spin_lock(&vfs_lock);
+    write_seqlock(&fs_lock);
     vfs_filesystem_t **curr = &fs_list;
     while (*curr)
     {
         if (strcmp((*curr)->name, name) == 0)
         {
+            /* A reader still on the entry follows its next pointer out */
             *curr = (*curr)->next;
-            spin_unlock(&vfs_lock);
+            write_sequnlock(&fs_lock);
             return 0;
         }
         curr = &(*curr)->next;
     }
-    spin_unlock(&vfs_lock);
+    write_sequnlock(&fs_lock);
     return -1;
 }
 
 static vfs_filesystem_t *vfs_find_filesystem(const char *name)
 {
-    vfs_filesystem_t *fs = fs_list;
-    while (fs)
+    vfs_filesystem_t *fs;
+    uint32_t seq;
+    do
     {
-        if (strcmp(fs->name, name) == 0)
-            return fs;
-        fs = fs->next;
-    }
-    return NULL;
+        seq = read_seqbegin(&fs_lock);
+        fs = fs_list;
+        while (fs && strcmp(fs->name, name) != 0)
+            fs = fs->next;
+    } while (read_seqretry(&fs_lock, seq));
+    return fs;
 }
 
 int vfs_mount(const char *dev, const char *mountpoint, const char *fstype, uint32_t flags)
@@ -107,10 +132,10 @@ int vfs_mount(const char *dev, const char *mountpoint, const char *fstype, uint3
     mount->sb = sb;
     mount->root = sb->root;
     sb->mount = mount;
-    spin_lock(&vfs_lock);
+    uint64_t irq = write_lock_irqsave(&mount_lock);
     mount->next = mount_list;
     mount_list = mount;
-    spin_unlock(&vfs_lock);
+    write_unlock_irqrestore(&mount_lock, irq);
     if (strcmp(mountpoint, "/") == 0 && current_working_dir == NULL)
         current_working_dir = sb->root;
     return 0;
@@ -118,7 +143,7 @@ int vfs_mount(const char *dev, const char *mountpoint, const char *fstype, uint3
 
 int vfs_unmount(const char *mountpoint)
 {
-    spin_lock(&vfs_lock);
+    uint64_t irq = write_lock_irqsave(&mount_lock);
     vfs_mount_t **curr = &mount_list;
     while (*curr)
     {
@@ -126,7 +151,7 @@ int vfs_unmount(const char *mountpoint)
         {
             vfs_mount_t *mount = *curr;
             *curr = mount->next;
-            spin_unlock(&vfs_lock);
+            write_unlock_irqrestore(&mount_lock, irq);
             vfs_filesystem_t *fs = vfs_find_filesystem(mount->sb->fs_type);
             if (fs && fs->unmount)
                 fs->unmount(mount->sb);
@@ -136,7 +161,7 @@ int vfs_unmount(const char *mountpoint)
         }
         curr = &(*curr)->next;
     }
-    spin_unlock(&vfs_lock);
+    write_unlock_irqrestore(&mount_lock, irq);
     return -1;
 }
 
@@ -144,6 +169,7 @@ static vfs_mount_t *vfs_find_mount(const char *path)
 {
     vfs_mount_t *best = NULL;
     size_t best_len = 0;
+    uint64_t irq = read_lock_irqsave(&mount_lock);
     vfs_mount_t *mount = mount_list;
     while (mount)
     {
@@ -158,6 +184,7 @@ static vfs_mount_t *vfs_find_mount(const char *path)
         }
         mount = mount->next;
     }
+    read_unlock_irqrestore(&mount_lock, irq);
     return best;
 }
 
@@ -351,14 +378,37 @@ void vfs_free_fd(int fd)
     if (fd < 0 || fd >= VFS_MAX_OPEN_FILES)
         return;
     spin_lock(&vfs_lock);
-    if (fd_table[fd])
-    {
-        fd_table[fd]->refcount--;
-        if (fd_table[fd]->refcount == 0)
-            free(fd_table[fd]);
-        fd_table[fd] = NULL;
-    }
+    vfs_file_t *file = fd_table[fd];
+    fd_table[fd] = NULL;
     spin_unlock(&vfs_lock);
+    if (file)
+        vfs_file_put(file);
+}
+
+/* Extra reference on an open file, so it outlives close() on its descriptor */
+vfs_file_t *vfs_file_get(int fd)
+{
+    if (fd < 0 || fd >= VFS_MAX_OPEN_FILES)
+        return NULL;
+    spin_lock(&vfs_lock);
+    vfs_file_t *file = fd_table[fd];
+    if (file)
+        file->refcount++;
+    spin_unlock(&vfs_lock);
+    return file;
+}
+
+/* Drop a reference, the last one closes the file */
+void vfs_file_put(vfs_file_t *file)
+{
+    spin_lock(&vfs_lock);
+    int last = --file->refcount == 0;
+    spin_unlock(&vfs_lock);
+    if (!last)
+        return;
+    if (file->node->fops && file->node->fops->close)
+        file->node->fops->close(file->node, file);
+    kmem_cache_free(vfs_file_cache, file);
 }
 
 vfs_file_t *vfs_get_file(int fd)
@@ -416,7 +466,7 @@ int vfs_open(const char *path, int flags, mode_t mode)
     }
     if (vfs_check_permission(node, flags) != 0)
         return -EACCES;
-    vfs_file_t *file = malloc(sizeof(vfs_file_t));
+    vfs_file_t *file = kmem_cache_alloc(vfs_file_cache);
     if (!file)
         return -1;
     file->node = node;
@@ -430,7 +480,7 @@ int vfs_open(const char *path, int flags, mode_t mode)
     {
         if (node->fops->open(node, file) != 0)
         {
-            free(file);
+            kmem_cache_free(vfs_file_cache, file);
             return -1;
         }
     }
@@ -439,7 +489,7 @@ int vfs_open(const char *path, int flags, mode_t mode)
     {
         if (node->fops && node->fops->close)
             node->fops->close(node, file);
-        free(file);
+        kmem_cache_free(vfs_file_cache, file);
         return -1;
     }
     return fd;
@@ -450,8 +500,6 @@ int vfs_close(int fd)
     vfs_file_t *file = vfs_get_file(fd);
     if (!file)
         return -1;
-    if (file->node->fops && file->node->fops->close)
-        file->node->fops->close(file->node, file);
     vfs_free_fd(fd);
     return 0;
 }
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * ACPI table discovery for Thuban
+ */
+
+#ifndef THUBAN_ACPI_H
+#define THUBAN_ACPI_H
+
+#include <stdint.h>
+
+struct multiboot_info;
+
+struct acpi_rsdp
+{
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;  // covers the first 20 bytes
+    char oem_id[6];
+    uint8_t revision; // 0 for ACPI 1.0, 2 and up has the fields below
+    uint32_t rsdt_addr;
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum; // covers the whole structure
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header
+{
+    char signature[4];
+    uint32_t length; // header included
+    uint8_t revision;
+    uint8_t checksum; // whole table sums to zero
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// MADT ("APIC"), followed by variable length interrupt controller entries
+struct acpi_madt
+{
+    struct acpi_sdt_header header;
+    uint32_t lapic_addr; // physical base of every CPU's local APIC
+    uint32_t flags;
+} __attribute__((packed));
+
+#define ACPI_MADT_PCAT_COMPAT 0x01 // dual 8259 PICs are present
+
+// MADT entry types
+#define ACPI_MADT_LAPIC 0
+#define ACPI_MADT_IOAPIC 1
+#define ACPI_MADT_ISO 2
+#define ACPI_MADT_LAPIC_NMI 4
+#define ACPI_MADT_LAPIC_OVERRIDE 5
+#define ACPI_MADT_X2APIC 9
+
+struct acpi_madt_entry
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct acpi_madt_lapic
+{
+    struct acpi_madt_entry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_lapic_override
+{
+    struct acpi_madt_entry entry;
+    uint16_t reserved;
+    uint64_t lapic_addr;
+} __attribute__((packed));
+
+#define ACPI_MADT_LAPIC_ENABLED 0x01        // the CPU is usable now
+#define ACPI_MADT_LAPIC_ONLINE_CAPABLE 0x02 // the CPU can be brought up later
+
+// find the RSDP and root table, 0 on success
+int acpi_init(struct multiboot_info *mbi);
+
+// get a table by its 4 character signature, NULL if absent or corrupt
+void *acpi_find_table(const char *signature);
+
+#endif
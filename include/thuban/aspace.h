@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Address spaces for Thuban
+ */
+
+#ifndef THUBAN_ASPACE_H
+#define THUBAN_ASPACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <thuban/vmarea.h>
+
+// user ranges from vmm_alloc_user come from here, clear of the boot identity map
+#define USER_ALLOC_START 0x0000100000000000ULL
+#define USER_ALLOC_END 0x00007FFFFFFFF000ULL
+
+// PCID 0 is the kernel space and any space that didn't get a tag of its own
+#define PCID_COUNT 4096
+
+// CR0 bit making supervisor writes honour read-only pages
+#define CR0_WP (1ULL << 16)
+
+// CR4 bits
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
+// CR3 bit telling the CPU to keep the new PCID's translations
+#define CR3_NOFLUSH (1ULL << 63)
+
+struct vmm_region;
+
+/*
+ * A PML4 whose lower half is private and whose upper half points at the
+ * same PDPTs as every other space, so kernel mappings appear everywhere
+ */
+struct address_space
+{
+    uint64_t *pml4;
+    uint64_t pml4_phys;
+    uint16_t pcid;
+    uint8_t stale;              // the PCID may still tag another space's translations
+    struct vmm_region *regions; // demand regions, sorted by start
+    struct va_space user_va;    // free ranges of the user half
+};
+
+extern struct address_space kernel_space;
+
+// set up the kernel space, PCID and global pages (after the slab allocator)
+void aspace_init(void);
+
+// enable global pages, write protection and PCID on the executing CPU
+void aspace_cpu_init(void);
+
+// create an empty user address space
+struct address_space *aspace_create(void);
+
+// create a copy of a space that shares every frame copy-on-write
+struct address_space *aspace_fork(struct address_space *src);
+
+// free a space, its user mappings and the frames behind them
+void aspace_destroy(struct address_space *as);
+
+// load a space into CR3
+void aspace_switch(struct address_space *as);
+
+// get the space loaded on this CPU
+struct address_space *aspace_current(void);
+
+// check if CR3 switches are PCID tagged
+int aspace_pcid_enabled(void);
+
+#endif
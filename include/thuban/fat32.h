@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <thuban/vfs.h>
 #include <thuban/blkdev.h>
+#include <thuban/slab.h>
 
 typedef struct __attribute__((packed))
 {
@@ -95,6 +96,7 @@ typedef struct
     uint32_t *fat_cache;
     uint32_t fat_cache_size;
     int fat_dirty;
+    struct kmem_cache *cluster_cache;
 } fat32_fs_t;
 
 typedef struct
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Page cache for memory-mapped files
+ */
+
+#ifndef THUBAN_FILEMAP_H
+#define THUBAN_FILEMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <thuban/vfs.h>
+
+// buckets in the (file, index) hash of cached pages
+#define FILEMAP_BUCKETS 256
+
+struct filemap_page;
+
+/*
+ * Cached pages of one file, shared by every mapping of it
+ * so clean pages are read from disk once however often mapped
+ */
+struct vm_file
+{
+    vfs_superblock_t *sb;
+    ino_t inode;
+    vfs_file_t *file;             // open file used for page I/O
+    uint32_t refcount;            // mappings using the cache
+    size_t nr_pages;              // pages cached
+    struct filemap_page *pages;   // every cached page of the file
+    struct vm_file *next;
+};
+
+// initialize the page cache (after the slab allocator)
+void filemap_init(void);
+
+// get the page cache of the file open on fd, taking a reference
+struct vm_file *filemap_open(int fd);
+
+// take another reference on a page cache
+void filemap_get(struct vm_file *vmf);
+
+// drop a reference, the last one writes back dirty pages and frees the cache
+void filemap_put(struct vm_file *vmf);
+
+// get the frame caching a page of the file, reading it in on a miss (0 on failure)
+uint64_t filemap_get_page(struct vm_file *vmf, uint64_t index);
+
+// write back dirty pages with index in [first, last]
+int filemap_sync(struct vm_file *vmf, uint64_t first, uint64_t last);
+
+// carry a dirty bit from a page table entry over to a cached frame
+void filemap_dirty_pte(uint64_t entry);
+
+#endif
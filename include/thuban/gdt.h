@@ -53,7 +53,10 @@ struct tss_entry
 // initialize GDT
 void gdt_init(void);
 
-// set kernel stack for ring 0
+// initialize and load the GDT and TSS of the executing CPU
+void gdt_init_cpu(unsigned int cpu);
+
+// set the executing CPU's kernel stack for ring 0
 void gdt_set_kernel_stack(uint64_t stack);
 
 // external assembly functions
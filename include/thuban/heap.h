@@ -28,5 +28,6 @@ void free(void *ptr);
 uint64_t heap_get_total(void);
 uint64_t heap_get_used(void);
 uint64_t heap_get_free(void);
+void heap_get_realloc_stats(uint64_t *in_place, uint64_t *copied);
 
 #endif
\ No newline at end of file
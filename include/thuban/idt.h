@@ -44,6 +44,9 @@ struct interrupt_frame
 // initialize IDT
 void idt_init(void);
 
+// load the IDT on a CPU brought up after idt_init
+void idt_load(void);
+
 // set IDT gate
 void idt_set_gate(uint8_t num, uint64_t handler, uint16_t selector, uint8_t type_attr);
 
@@ -59,6 +59,7 @@ extern void isr28(void);
 extern void isr29(void);
 extern void isr30(void);
 extern void isr31(void);
+extern void isr255(void);
 
 // IRQ handlers (declared in idt.s)
 extern void irq0(void);
@@ -102,4 +103,27 @@ static inline void interrupts_disable(void)
     asm volatile("cli");
 }
 
+// save RFLAGS and disable interrupts
+static inline uint64_t interrupts_save(void)
+{
+    uint64_t flags;
+    asm volatile("pushfq\n"
+                 "pop %0\n"
+                 "cli"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+// restore interrupt state saved by interrupts_save
+static inline void interrupts_restore(uint64_t flags)
+{
+    asm volatile("push %0\n"
+                 "popfq"
+                 :
+                 : "r"(flags)
+                 : "memory", "cc");
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Local APIC for Thuban
+ */
+
+#ifndef THUBAN_LAPIC_H
+#define THUBAN_LAPIC_H
+
+#include <stdint.h>
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1ULL << 11) // global enable, cleared means the APIC is off until reset
+#define APIC_BASE_BSP (1ULL << 8)     // set on the processor the firmware booted
+
+// register offsets from the MMIO base
+#define LAPIC_ID 0x20
+#define LAPIC_VERSION 0x30
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_ESR 0x280
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+
+#define LAPIC_SVR_ENABLE 0x100 // software enable
+
+// interrupt command register fields
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600
+#define LAPIC_ICR_PENDING 0x1000 // delivery status, the last IPI hasn't been accepted yet
+#define LAPIC_ICR_ASSERT 0x4000
+#define LAPIC_ICR_LEVEL 0x8000
+
+// spurious interrupts land here, the vector's low nibble must be all ones
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// map the local APIC registers, phys comes from the MADT
+int lapic_init(uint64_t phys);
+
+// enable the executing CPU's local APIC
+void lapic_enable(void);
+
+// get the executing CPU's APIC ID
+uint32_t lapic_id(void);
+
+// signal end of interrupt
+void lapic_eoi(void);
+
+// send INIT to a CPU
+void lapic_send_init(uint32_t apic_id);
+
+// send a startup IPI, the CPU starts in real mode at page << 12
+void lapic_send_startup(uint32_t apic_id, uint8_t page);
+
+#endif
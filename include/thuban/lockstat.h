@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Lock contention statistics for Thuban
+ *
+ * With CONFIG_LOCKSTAT every spinlock counts its acquisitions, how
+ * many of them had to wait, the TSC cycles spent waiting and the
+ * longest hold. Locks sharing a name share one class, so the locks
+ * of every address space add up under one line.
+ */
+
+#ifndef THUBAN_LOCKSTAT_H
+#define THUBAN_LOCKSTAT_H
+
+#include <stdint.h>
+
+// classes tracked, the last one collects every name past the limit
+#define LOCKSTAT_CLASSES 64
+
+// lines lockstat prints unless told otherwise
+#define LOCKSTAT_TOP 10
+
+// bytes of a lock name kept, longer names are cut short
+#define LOCKSTAT_NAME_LEN 32
+
+// lockstat_class states, a slot is only read once it is ready
+#define LOCKSTAT_FREE 0
+#define LOCKSTAT_CLAIMING 1
+#define LOCKSTAT_READY 2
+
+/*
+ * Counters shared by every lock of one name
+ */
+struct lockstat_class
+{
+    uint64_t state;               // LOCKSTAT_FREE, _CLAIMING or _READY
+    char name[LOCKSTAT_NAME_LEN]; // copied, the lock's own name may go away
+    uint64_t acquisitions;        // times taken
+    uint64_t contended;           // times a holder had to be waited for
+    uint64_t spin_cycles;         // TSC cycles spent waiting, all told
+    uint64_t max_spin;            // longest single wait
+    uint64_t max_hold;            // longest time held
+    uint64_t max_hold_rip;        // where the longest hold was taken
+};
+
+/*
+ * Read's the time stamp counter
+ */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+#ifdef CONFIG_LOCKSTAT
+// find or claim the class of a lock name
+struct lockstat_class *lockstat_class(const char *name);
+
+// count an acquisition that waited spin cycles (0 if it didn't)
+void lockstat_acquired(struct lockstat_class *class, uint64_t spin);
+
+// count a release after hold cycles, the lock was taken at rip
+void lockstat_released(struct lockstat_class *class, uint64_t hold, uint64_t rip);
+#endif
+
+// print the count most contended classes
+void lockstat_print(int count);
+
+// zero every class's counters
+void lockstat_reset(void);
+
+#endif
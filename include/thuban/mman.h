@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Memory mapping flags for Thuban
+ */
+
+#ifndef THUBAN_MMAN_H
+#define THUBAN_MMAN_H
+
+/* Page protection */
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+/* Mapping type */
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED ((void *)-1)
+
+/* msync flags, every sync is synchronous */
+#define MS_ASYNC 0x1
+#define MS_SYNC 0x4
+
+#endif
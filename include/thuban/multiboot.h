@@ -81,14 +81,36 @@ struct multiboot_tag_mmap
     struct multiboot_mmap_entry entries[0];
 };
 
+struct multiboot_tag_acpi
+{
+    uint32_t type;
+    uint32_t size;
+    uint8_t rsdp[0]; // copy of the ACPI RSDP, v1 or v2 by tag type
+};
+
+// maximum number of memory map entries kept from the bootloader
+#define MULTIBOOT_MAX_REGIONS 64
+
+struct multiboot_mem_region
+{
+    uint64_t base;
+    uint64_t len;
+    uint32_t type; // MULTIBOOT_MEMORY_*
+};
+
 struct multiboot_info
 {
     uint64_t total_mem;
     uint64_t available_mem;
     uint64_t kernel_start;
     uint64_t kernel_end;
+    uint64_t mbi_start; // physical range of the boot information itself
+    uint64_t mbi_end;
     const char *bootloader_name;
     const char *cmdline;
+    const void *acpi_rsdp; // NULL if the bootloader passed no ACPI tag
+    struct multiboot_mem_region regions[MULTIBOOT_MAX_REGIONS];
+    uint32_t region_count;
 };
 
 // parse multiboot info
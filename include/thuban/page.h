@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Page frame database for Thuban
+ */
+
+#ifndef THUBAN_PAGE_H
+#define THUBAN_PAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <thuban/pmm.h>
+
+// page flags
+#define PG_BUDDY 0x01    // heads a free block of page->order in the buddy lists
+#define PG_PCP 0x02      // parked in a per-CPU page cache
+#define PG_RESERVED 0x04 // never handed out (firmware, kernel image, metadata)
+#define PG_SLAB 0x08     // backs a slab, page->owner is the cache
+#define PG_DIRTY 0x10    // contents differ from backing storage
+#define PG_LOCKED 0x20   // under I/O or otherwise pinned by its owner
+
+/*
+ * Per-frame descriptor, one per PFN up to max_pfn
+ * Two descriptors share a cache line and the free-list links live here
+ * so no frame ever has to be mapped to be allocated or freed.
+ */
+struct page
+{
+    uint32_t flags;
+    uint32_t next; // buddy or per-CPU list link (pfn)
+    uint32_t prev;
+    uint8_t order; // block order while PG_BUDDY
+    int32_t refcount;
+    int32_t mapcount; // page table entries pointing at this frame
+    void *owner;      // slab cache or page cache that owns the frame
+} __attribute__((aligned(32)));
+
+extern struct page *page_map;
+
+// check a physical address has a descriptor
+int pfn_valid(uint64_t pfn);
+
+/*
+ * Get's the descriptor for a page frame number
+ */
+static inline struct page *pfn_to_page(uint64_t pfn)
+{
+    return &page_map[pfn];
+}
+
+/*
+ * Get's the page frame number of a descriptor
+ */
+static inline uint64_t page_to_pfn(struct page *page)
+{
+    return (uint64_t)(page - page_map);
+}
+
+/*
+ * Get's the descriptor for a physical address
+ */
+static inline struct page *phys_to_page(uint64_t phys)
+{
+    return pfn_to_page(phys / PAGE_SIZE);
+}
+
+/*
+ * Get's the physical address described by a descriptor
+ */
+static inline uint64_t page_to_phys(struct page *page)
+{
+    return page_to_pfn(page) * PAGE_SIZE;
+}
+
+// take an extra reference on an allocated frame
+void get_page(struct page *page);
+
+// drop a reference, freeing the frame when it was the last one
+void put_page(struct page *page);
+
+#endif
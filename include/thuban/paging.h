@@ -20,8 +20,56 @@
 #define PAGING_GLOBAL 0x100
 #define PAGING_NX (1ULL << 63)
 
-// initialize paging
-void paging_init(void);
+// physical address bits of an entry
+#define PAGING_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// page table levels, numbered from the leaf up
+#define PT_LEVEL_PTE 1   // 4KB entries
+#define PT_LEVEL_PDE 2   // 2MB entries
+#define PT_LEVEL_PDPTE 3 // 1GB entries
+
+// pt_walk flags
+#define PT_WALK_CREATE 0x01 // allocate missing tables
+#define PT_WALK_SPLIT 0x02  // break huge leaves down to the level asked for
+
+// lower canonical half, private to each address space
+#define USER_SPACE_END 0x0000800000000000ULL
+
+// PML4 slots from here up are the kernel half every address space shares
+#define PML4_KERNEL_START 256
+
+// boot.s maps the kernel image and the first 1GB of RAM here
+#define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
+#define KERNEL_VIRT_SIZE (1ULL << 30)
+
+// every RAM range of the memory map is mapped here once paging_init has run
+#define DIRECT_MAP_BASE 0xFFFF888000000000ULL
+#define DIRECT_MAP_SIZE (64ULL << 40)
+
+/*
+ * Page table walk that keeps the PDPT and PD it last went through, so
+ * consecutive addresses in the same 512GB and 1GB region only read
+ * the entries below them
+ */
+struct pt_walk
+{
+    uint64_t *pml4;
+    uint64_t *pdpt;
+    uint64_t pdpt_base; // start of the 512GB region pdpt covers
+    uint64_t *pd;
+    uint64_t pd_base; // start of the 1GB region pd covers
+};
+
+struct multiboot_info;
+
+// initialize paging, building the direct map from the memory map
+void paging_init(struct multiboot_info *mbi);
+
+// start a walk of the tables under pml4
+void pt_walk_init(struct pt_walk *walk, uint64_t *pml4);
+
+// get the entry for virt at level, or the huge leaf above it (reported in leaf)
+uint64_t *pt_walk(struct pt_walk *walk, uint64_t virt, int level, unsigned int flags, int *leaf);
 
 // map a page
 void paging_map(uint64_t virt, uint64_t phys, uint64_t flags);
@@ -35,4 +83,55 @@ uint64_t paging_get_phys(uint64_t virt);
 // invalidate TLB for address
 void paging_invalidate(uint64_t virt);
 
+// check if a physical range lies in RAM the direct map covers
+int paging_is_direct_mapped(uint64_t phys, uint64_t len);
+
+// get the end of the highest RAM range in the direct map, 0 before paging_init
+uint64_t paging_direct_map_end(void);
+
+/*
+ * Check's if an address lies in the user half
+ */
+static inline int is_user_addr(uint64_t addr)
+{
+    return addr < USER_SPACE_END;
+}
+
+/*
+ * Get's the size a leaf at a level maps
+ */
+static inline uint64_t pt_level_size(int level)
+{
+    return 1ULL << (12 + 9 * (level - 1));
+}
+
+/*
+ * Get's the direct map address of a physical address
+ */
+static inline void *phys_to_virt(uint64_t phys)
+{
+    return (void *)(phys + DIRECT_MAP_BASE);
+}
+
+/*
+ * Get's the physical address behind a kernel virtual address
+ * NOTE: Direct map and kernel image addresses are translated without a walk
+ */
+static inline uint64_t virt_to_phys(const void *virt)
+{
+    uint64_t addr = (uint64_t)virt;
+
+    if (addr >= DIRECT_MAP_BASE && addr < DIRECT_MAP_BASE + DIRECT_MAP_SIZE)
+    {
+        return addr - DIRECT_MAP_BASE;
+    }
+
+    if (addr >= KERNEL_VIRT_BASE && addr < KERNEL_VIRT_BASE + KERNEL_VIRT_SIZE)
+    {
+        return addr - KERNEL_VIRT_BASE;
+    }
+
+    return paging_get_phys(addr);
+}
+
 #endif
\ No newline at end of file
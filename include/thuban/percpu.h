@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Per-CPU data for Thuban
+ *
+ * In the kernel IA32_GS_BASE points at the executing CPU's struct
+ * percpu, and swapgs trades it with the user's on every ring change.
+ * The this_cpu accessors are one gs-relative instruction each, so a
+ * CPU's own fields need no lock or atomic as long as it stays on them.
+ */
+
+#ifndef THUBAN_PERCPU_H
+#define THUBAN_PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102 // the other GS base, swapgs exchanges the two
+
+struct address_space;
+
+/*
+ * One CPU's data
+ * NOTE: syscall.s reaches the first three fields by offset
+ */
+struct percpu
+{
+    struct percpu *self;        // 0, this area's own address
+    uint64_t syscall_stack_top; // 8, stack syscall_entry switches to
+    uint64_t user_rsp;          // 16, user stack while in a syscall
+    unsigned int cpu;           // index into per-CPU arrays
+    struct address_space *current_space;
+    uint64_t irq_count;     // interrupts taken
+    uint64_t syscall_count; // system calls taken
+} __attribute__((aligned(64)));
+
+#define __percpu_type(field) __typeof__(((struct percpu *)0)->field)
+#define __percpu_offset(field) offsetof(struct percpu, field)
+
+/*
+ * Read's a field of the executing CPU's area
+ */
+#define this_cpu_read(field)                                                                        \
+    ({                                                                                              \
+        __percpu_type(field) __val;                                                                 \
+        asm volatile("mov %%gs:%c1, %0" : "=r"(__val) : "i"(__percpu_offset(field)));               \
+        __val;                                                                                      \
+    })
+
+/*
+ * Write's a field of the executing CPU's area
+ */
+#define this_cpu_write(field, val)                                                                  \
+    do                                                                                              \
+    {                                                                                               \
+        __percpu_type(field) __val = (val);                                                         \
+        asm volatile("mov %1, %%gs:%c0" : : "i"(__percpu_offset(field)), "r"(__val) : "memory");    \
+    } while (0)
+
+/*
+ * Add's to a 32 or 64-bit field of the executing CPU's area
+ * NOTE: A single add can't be torn by an interrupt, so counters need no lock
+ */
+#define this_cpu_add(field, val)                                                                    \
+    do                                                                                              \
+    {                                                                                               \
+        switch (sizeof(__percpu_type(field)))                                                       \
+        {                                                                                           \
+        case 4:                                                                                     \
+            asm volatile("addl %1, %%gs:%c0"                                                        \
+                         :                                                                          \
+                         : "i"(__percpu_offset(field)), "ir"((uint32_t)(val)));                     \
+            break;                                                                                  \
+        case 8:                                                                                     \
+            asm volatile("addq %1, %%gs:%c0"                                                        \
+                         :                                                                          \
+                         : "i"(__percpu_offset(field)), "er"((uint64_t)(val)));                     \
+            break;                                                                                  \
+        }                                                                                           \
+    } while (0)
+
+#define this_cpu_inc(field) this_cpu_add(field, 1)
+
+// the executing CPU's area, for taking field addresses
+#define this_cpu_ptr() this_cpu_read(self)
+
+// set up a CPU's area and point its GS base at it, first thing on each CPU
+void percpu_init(unsigned int cpu);
+
+// get any CPU's area, its fields may change under the reader
+struct percpu *per_cpu(unsigned int cpu);
+
+#endif
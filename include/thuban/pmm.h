@@ -9,16 +9,52 @@
 #include <stdint.h>
 #include <stddef.h>
 
+struct multiboot_info;
+
 #define PAGE_SIZE 4096
 
-// initialize physical memory manager
-void pmm_init(uint64_t mem_size);
+// largest buddy block is 2^PMM_MAX_ORDER pages (4MB)
+#define PMM_MAX_ORDER 10
+
+// boot.s maps only the first 1GB of physical memory at the kernel base
+#define PMM_LOW_LIMIT (1ULL << 30)
+
+// allocation flags
+#define PMM_LOW 0x01  // frame must lie below PMM_LOW_LIMIT
+#define PMM_COLD 0x02 // caller doesn't need a cache-hot frame
+#define PMM_ZERO 0x04 // frame must be zero filled
+
+// per-CPU page cache counters
+struct pmm_pcp_stats
+{
+    uint64_t hits;    // single-frame allocations served without pmm_lock
+    uint64_t misses;  // allocations that found the CPU's list empty
+    uint64_t refills; // batches pulled from the buddy allocator
+    uint64_t drains;  // batches returned to the buddy allocator
+    uint64_t cached;  // frames currently parked in per-CPU lists
+};
+
+// pre-zeroed pool counters
+struct pmm_zero_stats
+{
+    uint64_t pooled; // zeroed frames ready to hand out
+    uint64_t hits;   // PMM_ZERO requests served from the pool
+    uint64_t misses; // PMM_ZERO requests that had to clear inline
+};
+
+// initialize physical memory manager from the multiboot memory map
+void pmm_init(struct multiboot_info *mbi);
 
 // allocate physical page
 void *pmm_alloc(void);
+void *pmm_alloc_flags(unsigned int flags);
 
-// allocate multiple contiguous pages
+// allocate multiple contiguous pages (at most 2^PMM_MAX_ORDER)
 void *pmm_alloc_pages(size_t count);
+void *pmm_alloc_pages_flags(size_t count, unsigned int flags);
+
+// refill the pre-zeroed pool, called from idle loops
+void pmm_zero_idle(void);
 
 // free physical page
 void pmm_free(void *page);
@@ -30,5 +66,8 @@ void pmm_free_pages(void *page, size_t count);
 uint64_t pmm_get_total_memory(void);
 uint64_t pmm_get_used_memory(void);
 uint64_t pmm_get_free_memory(void);
+uint64_t pmm_get_max_phys(void);
+void pmm_get_pcp_stats(struct pmm_pcp_stats *stats);
+void pmm_get_zero_stats(struct pmm_zero_stats *stats);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Reader-writer lock implementation for Thuban
+ *
+ * Any number of readers may hold the lock at once, a writer holds it
+ * alone. A waiting writer stops new readers from getting in, so a
+ * steady stream of lookups can't starve an update.
+ */
+
+#ifndef THUBAN_RWLOCK_H
+#define THUBAN_RWLOCK_H
+
+#include <stdint.h>
+#include <thuban/spinlock.h>
+
+#define RWLOCK_WRITER 0x80000000U  /* A writer holds the lock */
+#define RWLOCK_WAITING 0x40000000U /* A writer is waiting for readers to drain */
+#define RWLOCK_READERS 0x3FFFFFFFU /* Readers holding the lock */
+
+/*
+ * Reader-writer lock structure
+ * Every state change is one atomic update of count
+ */
+typedef struct rwlock
+{
+    volatile uint32_t count; /* Readers, RWLOCK_WRITER and RWLOCK_WAITING */
+    const char *name;        /* Lock name for debugging */
+} rwlock_t;
+
+/*
+ * Static initializer for reader-writer locks
+ * Usage: rwlock_t my_lock = RWLOCK_INIT_NAMED("my_lock");
+ */
+#define RWLOCK_INIT_NAMED(lock_name) \
+    {.count = 0, .name = lock_name}
+
+/*
+ * Initialize a reader-writer lock at runtime
+ *
+ * Parameters:
+ *   lock - Pointer to rwlock structure
+ *   name - Name for debugging (can be NULL)
+ */
+void rwlock_init(rwlock_t *lock, const char *name);
+
+/*
+ * Acquire a reader-writer lock shared
+ * Readers share the lock, so the saved flags go to the caller
+ *
+ * Parameters:
+ *   lock - Pointer to rwlock structure
+ *
+ * Returns:
+ *   RFLAGS from before interrupts were disabled
+ */
+uint64_t read_lock_irqsave(rwlock_t *lock);
+
+/*
+ * Release a shared hold on a reader-writer lock
+ *
+ * Parameters:
+ *   lock  - Pointer to rwlock structure
+ *   flags - Value read_lock_irqsave returned
+ */
+void read_unlock_irqrestore(rwlock_t *lock, uint64_t flags);
+
+/*
+ * Acquire a reader-writer lock exclusive
+ * Waits for every reader to leave, new readers wait behind us
+ *
+ * Parameters:
+ *   lock - Pointer to rwlock structure
+ *
+ * Returns:
+ *   RFLAGS from before interrupts were disabled
+ */
+uint64_t write_lock_irqsave(rwlock_t *lock);
+
+/*
+ * Release an exclusive hold on a reader-writer lock
+ *
+ * Parameters:
+ *   lock  - Pointer to rwlock structure
+ *   flags - Value write_lock_irqsave returned
+ */
+void write_unlock_irqrestore(rwlock_t *lock, uint64_t flags);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Sequence lock implementation for Thuban
+ *
+ * Readers take no lock at all: they note the sequence, read, and try
+ * again if a writer ran meanwhile. Only for data a reader can safely
+ * look at while it changes, e.g. lists whose entries are never freed.
+ */
+
+#ifndef THUBAN_SEQLOCK_H
+#define THUBAN_SEQLOCK_H
+
+#include <stdint.h>
+#include <thuban/spinlock.h>
+
+/*
+ * Sequence lock structure
+ * The sequence is odd while a write is in progress
+ */
+typedef struct seqlock
+{
+    volatile uint32_t sequence; /* Bumped on entry and exit of every write */
+    spinlock_t lock;            /* Serializes writers */
+} seqlock_t;
+
+/*
+ * Static initializer for sequence locks
+ * Usage: seqlock_t my_lock = SEQLOCK_INIT_NAMED("my_lock");
+ */
+#define SEQLOCK_INIT_NAMED(lock_name) \
+    {.sequence = 0, .lock = SPINLOCK_INIT_NAMED(lock_name)}
+
+/*
+ * Initialize a sequence lock at runtime
+ *
+ * Parameters:
+ *   lock - Pointer to seqlock structure
+ *   name - Name for debugging (can be NULL)
+ */
+void seqlock_init(seqlock_t *lock, const char *name);
+
+/*
+ * Start a read section
+ * Waits out a write in progress
+ *
+ * Parameters:
+ *   lock - Pointer to seqlock structure
+ *
+ * Returns:
+ *   Sequence to hand to read_seqretry
+ */
+static inline uint32_t read_seqbegin(const seqlock_t *lock)
+{
+    uint32_t seq;
+
+    while ((seq = lock->sequence) & 1)
+    {
+        asm volatile("pause");
+    }
+
+    /* The data must be read after the sequence */
+    asm volatile("" : : : "memory");
+    return seq;
+}
+
+/*
+ * End a read section
+ *
+ * Parameters:
+ *   lock  - Pointer to seqlock structure
+ *   start - Value read_seqbegin returned
+ *
+ * Returns:
+ *   1 if a writer ran and the read must be redone
+ *   0 if what was read is consistent
+ */
+static inline int read_seqretry(const seqlock_t *lock, uint32_t start)
+{
+    asm volatile("" : : : "memory");
+    return lock->sequence != start;
+}
+
+/*
+ * Start a write section
+ *
+ * Parameters:
+ *   lock - Pointer to seqlock structure
+ */
+void write_seqlock(seqlock_t *lock);
+
+/*
+ * End a write section
+ *
+ * Parameters:
+ *   lock - Pointer to seqlock structure
+ */
+void write_sequnlock(seqlock_t *lock);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Slab allocator for fixed-size kernel objects
+ */
+
+#ifndef THUBAN_SLAB_H
+#define THUBAN_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// cache flags
+#define KMEM_HWCACHE_ALIGN 0x01 // start every object on a cache line
+
+struct kmem_cache;
+
+// initialize the slab allocator (after the PMM)
+void slab_init(void);
+
+// create a cache of objects of one size, ctor runs once per object when its slab is built
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     unsigned int flags, void (*ctor)(void *obj));
+
+// destroy an empty cache
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+// allocate an object (constructed state is whatever the last user left)
+void *kmem_cache_alloc(struct kmem_cache *cache);
+
+// free an object
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// get the cache owning a pointer, NULL if it isn't a slab object
+struct kmem_cache *kmem_cache_of(const void *ptr);
+
+// get the object size of a cache
+size_t kmem_cache_size(struct kmem_cache *cache);
+
+// print per-cache usage
+void kmem_cache_list(void);
+
+#endif
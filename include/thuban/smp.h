@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Symmetric multiprocessing helpers for Thuban
+ */
+
+#ifndef THUBAN_SMP_H
+#define THUBAN_SMP_H
+
+#include <stdint.h>
+#include <thuban/percpu.h>
+
+// upper bound on CPUs the kernel keeps per-CPU state for
+#define MAX_CPUS 64
+
+// physical page the application processors start from, below 1MB for real mode
+#define TRAMPOLINE_BASE 0x8000
+
+struct multiboot_info;
+
+// CPUs running, the bootstrap processor is CPU 0
+extern unsigned int smp_num_cpus;
+
+// local APIC ID of each running CPU
+extern uint32_t cpu_apic_id[MAX_CPUS];
+
+// find the CPUs in the MADT and start every application processor
+void smp_init(struct multiboot_info *mbi);
+
+// where application processors enter the kernel from the trampoline
+void ap_main(uint64_t cpu);
+
+/*
+ * Get's the index of the executing CPU
+ */
+static inline unsigned int smp_processor_id(void)
+{
+    return this_cpu_read(cpu);
+}
+
+#endif
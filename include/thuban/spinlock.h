@@ -2,40 +2,84 @@
  * Copyright (c) 2026 Trollycat
  * Spinlock implementation for Thuban
  *
- * Single-core implementation:
- * Spinlocks protect critical sections by disabling interrupts.
- * In future SMP systems, this will use atomic operations.
+ * Ticket spinlocks:
+ * Each CPU takes a ticket with lock xadd and spins until the lock
+ * serves it, so waiters get the lock in arrival order. Interrupts
+ * stay disabled while a lock is held.
  */
 
 #ifndef THUBAN_SPINLOCK_H
 #define THUBAN_SPINLOCK_H
 
 #include <stdint.h>
+#include <thuban/lockstat.h>
 
 /*
  * Spinlock structure
- * For single-core: tracks interrupt state
- * For SMP: would contain atomic lock variable
+ * owner and next share one word so spin_trylock can take
+ * a ticket with a single cmpxchg
  */
 typedef struct spinlock
 {
-    uint64_t flags;   /* Saved interrupt flags */
-    int locked;       /* Lock state (0 = unlocked, 1 = locked) */
+    union
+    {
+        volatile uint32_t ticket; /* next << 16 | owner */
+        struct
+        {
+            volatile uint16_t owner; /* Ticket being served */
+            volatile uint16_t next;  /* Next ticket to hand out */
+        };
+    };
+    uint64_t flags;   /* Interrupt flags saved by spin_lock, only touched by the holder */
     const char *name; /* Lock name for debugging */
+#ifdef CONFIG_LOCKSTAT
+    struct lockstat_class *class; /* Statistics of locks with this name, set on first use */
+    uint64_t acquired_at;         /* TSC when the holder got the lock */
+    uint64_t acquired_rip;        /* Where the holder took it */
+#endif
 } spinlock_t;
 
 /*
  * Static initializer for spinlocks
  * Usage: spinlock_t my_lock = SPINLOCK_INIT;
  */
-#define SPINLOCK_INIT {.flags = 0, .locked = 0, .name = NULL}
+#define SPINLOCK_INIT {.ticket = 0, .flags = 0, .name = NULL}
 
 /*
  * Named static initializer for spinlocks
  * Usage: spinlock_t my_lock = SPINLOCK_INIT_NAMED("my_lock");
  */
 #define SPINLOCK_INIT_NAMED(lock_name) \
-    {.flags = 0, .locked = 0, .name = lock_name}
+    {.ticket = 0, .flags = 0, .name = lock_name}
+
+/*
+ * Save RFLAGS and disable interrupts
+ */
+static inline uint64_t save_flags_and_cli(void)
+{
+    uint64_t flags;
+    asm volatile(
+        "pushfq\n" /* Push RFLAGS onto stack */
+        "pop %0\n" /* Pop into flags variable */
+        "cli\n"    /* Disable interrupts */
+        : "=r"(flags)
+        :
+        : "memory");
+    return flags;
+}
+
+/*
+ * Restore RFLAGS (and interrupt state)
+ */
+static inline void restore_flags(uint64_t flags)
+{
+    asm volatile(
+        "push %0\n" /* Push flags onto stack */
+        "popfq\n"   /* Pop into RFLAGS */
+        :
+        : "r"(flags)
+        : "memory", "cc");
+}
 
 /*
  * Initialize a spinlock at runtime
@@ -48,8 +92,8 @@ void spin_lock_init(spinlock_t *lock, const char *name);
 
 /*
  * Acquire a spinlock
- * Disables interrupts and saves flags
- * Blocks until lock is available (spin-waits in SMP)
+ * Disables interrupts and spins until our ticket is served,
+ * the saved flags are kept in the lock for spin_unlock
  *
  * Parameters:
  *   lock - Pointer to spinlock structure
@@ -65,6 +109,27 @@ void spin_lock(spinlock_t *lock);
  */
 void spin_unlock(spinlock_t *lock);
 
+/*
+ * Acquire a spinlock, handing the saved interrupt flags to the caller
+ * Use when locks are not released in the reverse order they were taken
+ *
+ * Parameters:
+ *   lock - Pointer to spinlock structure
+ *
+ * Returns:
+ *   RFLAGS from before interrupts were disabled
+ */
+uint64_t spin_lock_irqsave(spinlock_t *lock);
+
+/*
+ * Release a spinlock taken with spin_lock_irqsave
+ *
+ * Parameters:
+ *   lock  - Pointer to spinlock structure
+ *   flags - Value spin_lock_irqsave returned
+ */
+void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags);
+
 /*
  * Try to acquire a spinlock without blocking
  *
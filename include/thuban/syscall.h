@@ -45,9 +45,15 @@ struct dirent;
 #define SYS_RMDIR 17
 #define SYS_GETDENTS 18
 #define SYS_UNLINK 19
+#define SYS_MMAP 20
+#define SYS_MUNMAP 21
+#define SYS_MSYNC 22
 
 #define SYSCALL_MAX 256
 
+/* Kernel stack each CPU runs syscalls on */
+#define SYSCALL_STACK_SIZE (16 * 1024)
+
 /* MSR (Model Specific Register) addresses for SYSCALL/SYSRET */
 #define MSR_STAR 0xC0000081   /* Segment selectors for syscall */
 #define MSR_LSTAR 0xC0000082  /* Syscall entry point (RIP) */
@@ -62,6 +68,12 @@ typedef int64_t (*syscall_handler_t)(uint64_t arg1, uint64_t arg2,
 /* Initialize syscall subsystem */
 void syscall_init(void);
 
+/* Set up SYSCALL/SYSRET on the executing CPU (syscall_init does the BSP) */
+void syscall_init_cpu(void);
+
+/* Allocate a CPU's syscall stack */
+int syscall_stack_alloc(unsigned int cpu);
+
 /* Register a syscall handler */
 void syscall_register(int num, syscall_handler_t handler);
 
@@ -101,6 +113,25 @@ static inline int64_t syscall(uint64_t num, uint64_t arg1, uint64_t arg2,
     return ret;
 }
 
+/* Userspace syscall wrapper taking a sixth argument in r9 */
+static inline int64_t syscall6(uint64_t num, uint64_t arg1, uint64_t arg2,
+                               uint64_t arg3, uint64_t arg4, uint64_t arg5,
+                               uint64_t arg6)
+{
+    int64_t ret;
+    register uint64_t r10 asm("r10") = arg4;
+    register uint64_t r8 asm("r8") = arg5;
+    register uint64_t r9 asm("r9") = arg6;
+
+    asm volatile(
+        "syscall"
+        : "=a"(ret)
+        : "a"(num), "D"(arg1), "S"(arg2), "d"(arg3), "r"(r10), "r"(r8), "r"(r9)
+        : "rcx", "r11", "memory");
+
+    return ret;
+}
+
 /* Userspace helper functions */
 static inline void sys_exit(int status)
 {
@@ -174,4 +205,22 @@ static inline int sys_unlink(const char *path)
     return syscall(SYS_UNLINK, (uint64_t)path, 0, 0, 0, 0);
 }
 
+/* Memory mapping syscall helpers */
+static inline void *sys_mmap(void *addr, size_t length, int prot, int flags,
+                             int fd, off_t offset)
+{
+    return (void *)syscall6(SYS_MMAP, (uint64_t)addr, length, prot, flags,
+                            fd, offset);
+}
+
+static inline int sys_munmap(void *addr, size_t length)
+{
+    return syscall(SYS_MUNMAP, (uint64_t)addr, length, 0, 0, 0);
+}
+
+static inline int sys_msync(void *addr, size_t length, int flags)
+{
+    return syscall(SYS_MSYNC, (uint64_t)addr, length, flags, 0, 0);
+}
+
 #endif
\ No newline at end of file
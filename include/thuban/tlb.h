@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Batched TLB invalidation for Thuban
+ */
+
+#ifndef THUBAN_TLB_H
+#define THUBAN_TLB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// frames held back per gather before a forced flush
+#define TLB_BATCH 64
+
+// past this many pages a full flush is cheaper than invlpg on each
+#define TLB_FLUSH_CEILING 32
+
+/*
+ * Unmapped range and the frames it freed, kept until the TLB is flushed
+ * so no CPU can still reach a frame once the PMM hands it out again
+ */
+struct tlb_gather
+{
+    uint64_t start; // lowest unmapped address
+    uint64_t end;   // one past the highest
+    size_t nr_frames;
+    uint64_t frames[TLB_BATCH]; // physical address | order
+};
+
+// start an empty gather
+void tlb_gather_init(struct tlb_gather *tlb);
+
+// record an unmapped page and the 2^order frames behind it (phys 0 keeps the frames)
+void tlb_remove_page(struct tlb_gather *tlb, uint64_t virt, uint64_t phys, unsigned int order);
+
+// flush the gathered range and free the frames, the gather can be reused
+void tlb_finish(struct tlb_gather *tlb);
+
+// invalidate a range on every CPU that may cache it
+void flush_tlb_range(uint64_t start, uint64_t end);
+
+// invalidate every translation, global ones included
+void flush_tlb_all(void);
+
+#endif
@@ -201,12 +201,15 @@ typedef struct vfs_filesystem
 } vfs_filesystem_t;
 
 void vfs_init(void);
+vfs_node_t *vfs_alloc_node(void);
 int vfs_register_filesystem(vfs_filesystem_t *fs);
 int vfs_mount(const char *dev, const char *mountpoint, const char *fstype, uint32_t flags);
 vfs_node_t *vfs_resolve_path(const char *path);
 vfs_node_t *vfs_resolve_path_from(vfs_node_t *start, const char *path);
 int vfs_open(const char *path, int flags, mode_t mode);
 int vfs_close(int fd);
+vfs_file_t *vfs_file_get(int fd);
+void vfs_file_put(vfs_file_t *file);
 ssize_t vfs_read(int fd, void *buf, size_t count);
 ssize_t vfs_write(int fd, const void *buf, size_t count);
 off_t vfs_lseek(int fd, off_t offset, int whence);
@@ -217,6 +220,7 @@ int vfs_mkdir(const char *path, mode_t mode);
 int vfs_rmdir(const char *path);
 int vfs_unlink(const char *path);
 int vfs_is_directory(vfs_node_t *node);
+int vfs_is_file(vfs_node_t *node);
 char *vfs_basename(const char *path);
 vfs_node_t *vfs_get_cwd(void);
 int vfs_set_cwd(vfs_node_t *node);
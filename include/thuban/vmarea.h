@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Virtual address range allocator for Thuban
+ */
+
+#ifndef THUBAN_VMAREA_H
+#define THUBAN_VMAREA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <thuban/spinlock.h>
+
+struct va_node;
+
+// a window of virtual address space handed out in page multiples
+struct va_space
+{
+    struct va_node *by_addr; // free ranges ordered by start
+    struct va_node *by_size; // free ranges ordered by size then start
+    uint64_t start;
+    uint64_t end;
+    uint64_t free_bytes;
+    uint64_t ranges; // free ranges in the trees
+    spinlock_t lock;
+};
+
+// initialize a space covering [start, end), needs the slab allocator
+int va_space_init(struct va_space *space, const char *name, uint64_t start, uint64_t end);
+
+// free the nodes of a space, outstanding ranges are simply forgotten
+void va_space_destroy(struct va_space *space);
+
+// make dst's free ranges the same as src's, both covering the same window
+int va_space_copy(struct va_space *dst, struct va_space *src);
+
+// allocate size bytes aligned to align (a power of two, at least a page), 0 on failure
+uint64_t va_alloc(struct va_space *space, size_t size, size_t align);
+
+// return a range, merging it with free neighbours
+int va_free(struct va_space *space, uint64_t start, size_t size);
+
+#endif
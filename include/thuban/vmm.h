@@ -13,6 +13,28 @@
 #define PAGE_PRESENT 0x01
 #define PAGE_WRITE 0x02
 #define PAGE_USER 0x04
+#define PAGE_HUGE 0x80 // PDE maps a 2MB page
+#define PAGE_COW 0x200 // read-only only because the frame is shared, a write copies it
+
+// vmm_alloc flags, never written to a page table entry
+#define VMM_DEMAND (1ULL << 52) // reserve only, frames arrive on first touch
+
+// page fault error code bits
+#define PF_PRESENT 0x01  // the page was present, so a protection violation
+#define PF_WRITE 0x02    // the access was a write
+#define PF_USER 0x04     // the access came from ring 3
+#define PF_RESERVED 0x08 // a reserved bit was set in an entry
+#define PF_FETCH 0x10    // the access was an instruction fetch
+
+#define HUGE_PAGE_SIZE 0x200000ULL
+#define HUGE_PAGE_PAGES 512
+
+// vmalloc range, mapped page by page from any free frames
+#define VMALLOC_START 0xFFFFC90000000000ULL
+#define VMALLOC_END 0xFFFFE90000000000ULL
+
+struct address_space;
+struct vm_file;
 
 // initialize virtual memory manager
 void vmm_init(void);
@@ -29,7 +51,58 @@ void *vmm_alloc(size_t pages, uint64_t flags);
 // free virtual pages
 void vmm_free(void *virt, size_t pages);
 
+// map a physical range outside the direct map (device registers, firmware tables)
+void *vmm_ioremap(uint64_t phys, size_t size, uint64_t flags);
+
+// unmap a range from vmm_ioremap, size as it was mapped
+void vmm_iounmap(void *virt, size_t size);
+
+// allocate user pages in an address space, backed on first touch
+void *vmm_alloc_user(struct address_space *as, size_t pages, uint64_t flags);
+
+// free user pages from vmm_alloc_user
+void vmm_free_user(struct address_space *as, void *virt, size_t pages);
+
+// map pages of a file from page pgoff (NULL for anonymous memory), shared writes reach the file
+void *vmm_mmap(struct address_space *as, size_t pages, uint64_t flags, struct vm_file *file, uint64_t pgoff,
+               int shared);
+
+// unmap a range of user pages, mapped by vmm_mmap or not
+int vmm_munmap(struct address_space *as, uint64_t virt, size_t pages);
+
+// write back dirty pages of shared file mappings in a range of user pages
+int vmm_msync(struct address_space *as, uint64_t virt, size_t pages);
+
+// share src's pages in a user range with dst copy-on-write
+int vmm_share_cow(struct address_space *dst, struct address_space *src, uint64_t start, size_t pages);
+
+// give dst src's demand regions and share all their pages copy-on-write
+int vmm_clone_user(struct address_space *dst, struct address_space *src);
+
+// forget every demand region of an address space
+void vmm_drop_regions(struct address_space *as);
+
+// allocate a large block backed by non-contiguous frames
+void *vmalloc(size_t size);
+
+// free a block from vmalloc
+void vfree(void *ptr);
+
+// get the usable size of a vmalloc block
+size_t vmalloc_size(const void *ptr);
+
+/*
+ * Check's if a pointer lies in the vmalloc range
+ */
+static inline int is_vmalloc_addr(const void *ptr)
+{
+    return (uint64_t)ptr >= VMALLOC_START && (uint64_t)ptr < VMALLOC_END;
+}
+
 // get physical address from virtual
 uint64_t vmm_get_phys(uint64_t virt);
 
+// resolve a page fault at addr, 0 when the access can be retried
+int vmm_handle_fault(uint64_t addr, uint64_t error);
+
 #endif
\ No newline at end of file
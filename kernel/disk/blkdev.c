@@ -6,13 +6,13 @@
 #include <thuban/blkdev.h>
 #include <thuban/stdio.h>
 #include <thuban/string.h>
-#include <thuban/spinlock.h>
+#include <thuban/rwlock.h>
 
 /* List of registered block devices */
 static struct block_device *blkdev_head = NULL;
 
-/* Spinlock to protect device list */
-static spinlock_t blkdev_lock = SPINLOCK_INIT_NAMED("blkdev");
+/* Reader-writer lock to protect device list, looked up on every mount and I/O path */
+static rwlock_t blkdev_lock = RWLOCK_INIT_NAMED("blkdev");
 
 /* Next major device number to assign */
 static uint32_t next_major = 1;
@@ -22,7 +22,7 @@ static uint32_t next_major = 1;
  */
 void blkdev_init(void)
 {
-    spin_lock_init(&blkdev_lock, "blkdev");
+    rwlock_init(&blkdev_lock, "blkdev");
     blkdev_head = NULL;
     next_major = 1;
 }
@@ -45,7 +45,7 @@ int blkdev_register(struct block_device *dev)
         return -1;
     }
 
-    spin_lock(&blkdev_lock);
+    uint64_t irq = write_lock_irqsave(&blkdev_lock);
 
     /* Check if device name already exists */
     struct block_device *curr = blkdev_head;
@@ -53,7 +53,7 @@ int blkdev_register(struct block_device *dev)
     {
         if (strcmp(curr->name, dev->name) == 0)
         {
-            spin_unlock(&blkdev_lock);
+            write_unlock_irqrestore(&blkdev_lock, irq);
             printf("[BLKDEV] Error: Device %s already registered\n", dev->name);
             return -1;
         }
@@ -79,7 +79,7 @@ int blkdev_register(struct block_device *dev)
     dev->next = blkdev_head;
     blkdev_head = dev;
 
-    spin_unlock(&blkdev_lock);
+    write_unlock_irqrestore(&blkdev_lock, irq);
 
     return 0;
 }
@@ -94,7 +94,7 @@ void blkdev_unregister(struct block_device *dev)
         return;
     }
 
-    spin_lock(&blkdev_lock);
+    uint64_t irq = write_lock_irqsave(&blkdev_lock);
 
     /* Find and remove from list */
     struct block_device **curr = &blkdev_head;
@@ -105,14 +105,14 @@ void blkdev_unregister(struct block_device *dev)
             *curr = dev->next;
             dev->next = NULL;
             dev->flags &= ~BLKDEV_FLAG_PRESENT;
-            spin_unlock(&blkdev_lock);
+            write_unlock_irqrestore(&blkdev_lock, irq);
             printf("[BLKDEV] Unregistered %s\n", dev->name);
             return;
         }
         curr = &(*curr)->next;
     }
 
-    spin_unlock(&blkdev_lock);
+    write_unlock_irqrestore(&blkdev_lock, irq);
     printf("[BLKDEV] Warning: Device %s not found for unregister\n", dev->name);
 }
 
@@ -126,20 +126,20 @@ struct block_device *blkdev_find(const char *name)
         return NULL;
     }
 
-    spin_lock(&blkdev_lock);
+    uint64_t irq = read_lock_irqsave(&blkdev_lock);
 
     struct block_device *curr = blkdev_head;
     while (curr)
     {
         if (strcmp(curr->name, name) == 0)
         {
-            spin_unlock(&blkdev_lock);
+            read_unlock_irqrestore(&blkdev_lock, irq);
             return curr;
         }
         curr = curr->next;
     }
 
-    spin_unlock(&blkdev_lock);
+    read_unlock_irqrestore(&blkdev_lock, irq);
     return NULL;
 }
 
@@ -262,12 +262,12 @@ int blkdev_flush(struct block_device *dev)
  */
 void blkdev_list(void)
 {
-    spin_lock(&blkdev_lock);
+    uint64_t irq = read_lock_irqsave(&blkdev_lock);
 
     if (!blkdev_head)
     {
         printf("No block devices registered\n");
-        spin_unlock(&blkdev_lock);
+        read_unlock_irqrestore(&blkdev_lock, irq);
         return;
     }
 
@@ -297,5 +297,5 @@ void blkdev_list(void)
         curr = curr->next;
     }
 
-    spin_unlock(&blkdev_lock);
+    read_unlock_irqrestore(&blkdev_lock, irq);
 }
\ No newline at end of file
@@ -145,6 +145,13 @@ static void bsod_print_registers(struct registers *regs)
     bsod_printf("RIP: 0x%016llx  CS:  0x%04llx", regs->rip, regs->cs);
     bsod_printf("RFLAGS: 0x%016llx  SS:  0x%04llx", regs->rflags, regs->ss);
     bsod_printf("Error Code: 0x%016llx", regs->err_code);
+
+    if (regs->int_no == 14)
+    {
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        bsod_printf("Fault Address (CR2): 0x%016llx", cr2);
+    }
 }
 
 /*
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * ACPI table discovery
+ */
+
+#include <thuban/acpi.h>
+#include <thuban/multiboot.h>
+#include <thuban/paging.h>
+#include <thuban/vmm.h>
+#include <thuban/stdio.h>
+#include <thuban/string.h>
+
+static struct acpi_sdt_header *root_table;
+static int root_is_xsdt;
+
+/*
+ * Sum's bytes, a valid ACPI structure sums to zero
+ */
+static uint8_t acpi_checksum(const void *data, uint32_t len)
+{
+    const uint8_t *bytes = data;
+    uint8_t sum = 0;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        sum += bytes[i];
+    }
+
+    return sum;
+}
+
+/*
+ * Get's a kernel address for a firmware range
+ * NOTE: Tables in RAM are reached through the direct map, anything the
+ * memory map doesn't call RAM is mapped on its own
+ */
+static void *acpi_map(uint64_t phys, uint32_t len)
+{
+    if (paging_is_direct_mapped(phys, len))
+    {
+        return phys_to_virt(phys);
+    }
+
+    return vmm_ioremap(phys, len, 0);
+}
+
+/*
+ * Release's a range from acpi_map
+ */
+static void acpi_unmap(void *virt, uint32_t len)
+{
+    uint64_t addr = (uint64_t)virt;
+
+    if (virt && (addr < DIRECT_MAP_BASE || addr >= DIRECT_MAP_BASE + DIRECT_MAP_SIZE))
+    {
+        vmm_iounmap(virt, len);
+    }
+}
+
+/*
+ * Map's a whole system description table if its signature matches
+ * NOTE: The header is mapped once to probe it, a table that fails its
+ * checksum or doesn't match leaves nothing mapped. A match stays mapped
+ */
+static struct acpi_sdt_header *acpi_map_table(uint64_t phys, const char *signature)
+{
+    struct acpi_sdt_header *header = acpi_map(phys, sizeof(struct acpi_sdt_header));
+
+    if (!header)
+    {
+        return NULL;
+    }
+
+    uint32_t length = header->length;
+    int match = !signature || memcmp(header->signature, signature, 4) == 0;
+
+    acpi_unmap(header, sizeof(struct acpi_sdt_header));
+
+    if (!match || length < sizeof(struct acpi_sdt_header))
+    {
+        return NULL;
+    }
+
+    header = acpi_map(phys, length);
+
+    if (header && acpi_checksum(header, length) != 0)
+    {
+        acpi_unmap(header, length);
+        return NULL;
+    }
+
+    return header;
+}
+
+/*
+ * Check's an RSDP candidate
+ */
+static int rsdp_valid(const struct acpi_rsdp *rsdp)
+{
+    if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || acpi_checksum(rsdp, 20) != 0)
+    {
+        return 0;
+    }
+
+    return rsdp->revision < 2 || acpi_checksum(rsdp, rsdp->length) == 0;
+}
+
+/*
+ * Scan's a physical range for the RSDP on 16 byte boundaries
+ * NOTE: Returns the physical address, 0 if there is none
+ */
+static uint64_t rsdp_scan(uint64_t start, uint64_t end)
+{
+    uint8_t *area = acpi_map(start, end - start);
+    uint64_t found = 0;
+
+    if (!area)
+    {
+        return 0;
+    }
+
+    for (uint64_t off = 0; off + sizeof(struct acpi_rsdp) <= end - start; off += 16)
+    {
+        if (rsdp_valid((const struct acpi_rsdp *)(area + off)))
+        {
+            found = start + off;
+            break;
+        }
+    }
+
+    acpi_unmap(area, end - start);
+    return found;
+}
+
+/*
+ * Find's the RSDP, from the bootloader or the BIOS areas
+ * NOTE: Returns the physical address, 0 if there is none
+ */
+static uint64_t rsdp_find(struct multiboot_info *mbi)
+{
+    if (mbi->acpi_rsdp)
+    {
+        uint64_t phys = (uint64_t)mbi->acpi_rsdp;
+        const struct acpi_rsdp *rsdp = acpi_map(phys, sizeof(struct acpi_rsdp));
+        int valid = rsdp && rsdp_valid(rsdp);
+
+        acpi_unmap((void *)rsdp, sizeof(struct acpi_rsdp));
+
+        if (valid)
+        {
+            return phys;
+        }
+    }
+
+    // the first KB of the EBDA, whose segment the BIOS data area holds at 0x40E
+    uint16_t *bda_ebda = acpi_map(0x40E, sizeof(uint16_t));
+    uint64_t ebda = bda_ebda ? (uint64_t)*bda_ebda << 4 : 0;
+    uint64_t rsdp = 0;
+
+    acpi_unmap(bda_ebda, sizeof(uint16_t));
+
+    if (ebda >= 0x80000 && ebda < 0xA0000)
+    {
+        rsdp = rsdp_scan(ebda, ebda + 1024);
+    }
+
+    return rsdp ? rsdp : rsdp_scan(0xE0000, 0x100000);
+}
+
+/*
+ * Initialize's ACPI table access
+ */
+int acpi_init(struct multiboot_info *mbi)
+{
+    uint64_t rsdp_phys = rsdp_find(mbi);
+
+    if (!rsdp_phys)
+    {
+        printf("[ACPI] No RSDP found\n");
+        return -1;
+    }
+
+    const struct acpi_rsdp *rsdp = acpi_map(rsdp_phys, sizeof(struct acpi_rsdp));
+
+    if (!rsdp)
+    {
+        return -1;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_addr)
+    {
+        root_table = acpi_map_table(rsdp->xsdt_addr, "XSDT");
+        root_is_xsdt = 1;
+    }
+
+    if (!root_table)
+    {
+        root_table = acpi_map_table(rsdp->rsdt_addr, "RSDT");
+        root_is_xsdt = 0;
+    }
+
+    uint8_t revision = rsdp->revision;
+    uint64_t root_phys = root_is_xsdt ? rsdp->xsdt_addr : (uint64_t)rsdp->rsdt_addr;
+
+    acpi_unmap((void *)rsdp, sizeof(struct acpi_rsdp));
+
+    if (!root_table)
+    {
+        printf("[ACPI] Root table is corrupt\n");
+        return -1;
+    }
+
+    printf("[ACPI] Revision %d, %s at 0x%llx\n", revision, root_is_xsdt ? "XSDT" : "RSDT", root_phys);
+    return 0;
+}
+
+/*
+ * Find's a table by signature
+ * NOTE: The XSDT holds 64-bit pointers, the RSDT 32-bit ones. A table
+ * found stays mapped for the kernel's lifetime
+ */
+void *acpi_find_table(const char *signature)
+{
+    if (!root_table)
+    {
+        return NULL;
+    }
+
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t count = (root_table->length - sizeof(struct acpi_sdt_header)) / entry_size;
+    uint8_t *entries = (uint8_t *)(root_table + 1);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t phys;
+
+        // entries follow a 36 byte header so 64-bit ones are misaligned
+        if (root_is_xsdt)
+        {
+            memcpy(&phys, entries + i * 8, 8);
+        }
+        else
+        {
+            phys = *(uint32_t *)(entries + i * 4);
+        }
+
+        struct acpi_sdt_header *table = acpi_map_table(phys, signature);
+
+        if (table)
+        {
+            return table;
+        }
+    }
+
+    return NULL;
+}
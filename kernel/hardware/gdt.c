@@ -4,19 +4,22 @@
  */
 
 #include <thuban/gdt.h>
+#include <thuban/smp.h>
 #include <thuban/stdio.h>
 #include <thuban/string.h>
 
 #define GDT_ENTRIES 7
 
-static struct gdt_entry gdt[GDT_ENTRIES];
-static struct gdt_ptr gdt_pointer;
-static struct tss_entry tss;
+// one GDT and TSS per CPU, ltr marks a TSS descriptor busy so none can be shared
+static struct gdt_entry gdts[MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr gdt_pointers[MAX_CPUS];
+static struct tss_entry tss_entries[MAX_CPUS];
 
 /*
  * Set's a GDT entry
  */
-static void gdt_set_gate(int num, uint64_t base, uint32_t limit, uint8_t access, uint8_t gran)
+static void gdt_set_gate(struct gdt_entry *gdt, int num, uint64_t base, uint32_t limit, uint8_t access,
+                         uint8_t gran)
 {
     gdt[num].base_low = (base & 0xFFFF);
     gdt[num].base_middle = (base >> 16) & 0xFF;
@@ -33,9 +36,10 @@ static void gdt_set_gate(int num, uint64_t base, uint32_t limit, uint8_t access,
  * Set's a TSS entry in GDT
  * NOTE: TSS is 16 bytes in 64-bit mode so we need two entries
  */
-static void gdt_set_tss(int num, uint64_t base, uint32_t limit, uint8_t access, uint8_t gran)
+static void gdt_set_tss(struct gdt_entry *gdt, int num, uint64_t base, uint32_t limit, uint8_t access,
+                        uint8_t gran)
 {
-    gdt_set_gate(num, base, limit, access, gran);
+    gdt_set_gate(gdt, num, base, limit, access, gran);
 
     // upper 8 bytes of TSS descriptor
     gdt[num + 1].limit_low = (base >> 32) & 0xFFFF;
@@ -47,51 +51,64 @@ static void gdt_set_tss(int num, uint64_t base, uint32_t limit, uint8_t access,
 }
 
 /*
- * Initialize's the GDT
+ * Initialize's the GDT and TSS of a CPU and loads them
+ * NOTE: Must run on the CPU itself
  */
-void gdt_init(void)
+void gdt_init_cpu(unsigned int cpu)
 {
-    gdt_pointer.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
-    gdt_pointer.base = (uint64_t)&gdt;
+    struct gdt_entry *gdt = gdts[cpu];
+    struct gdt_ptr *gdt_pointer = &gdt_pointers[cpu];
+    struct tss_entry *tss = &tss_entries[cpu];
+
+    gdt_pointer->limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    gdt_pointer->base = (uint64_t)gdt;
 
     // null descriptor (0x00)
-    gdt_set_gate(0, 0, 0, 0, 0);
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);
 
     // kernel code segment (0x08)
     // base=0, limit=0xFFFFFFFF, access=0x9A (present, ring 0, code, executable, readable)
     // granularity=0xA0 (64-bit, 4KB granularity)
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xA0);
+    gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xA0);
 
     // kernel data segment (0x10)
     // base=0, limit=0xFFFFFFFF, access=0x92 (present, ring 0, data, writable)
     // granularity=0xC0 (4KB granularity)
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xC0);
+    gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xC0);
 
     // user code segment (0x18)
     // base=0, limit=0xFFFFFFFF, access=0xFA (present, ring 3, code, executable, readable)
     // granularity=0xA0 (64-bit, 4KB granularity)
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xA0);
+    gdt_set_gate(gdt, 3, 0, 0xFFFFFFFF, 0xFA, 0xA0);
 
     // user data segment (0x20)
     // base=0, limit=0xFFFFFFFF, access=0xF2 (present, ring 3, data, writable)
     // granularity=0xC0 (4KB granularity)
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xC0);
+    gdt_set_gate(gdt, 4, 0, 0xFFFFFFFF, 0xF2, 0xC0);
 
     // TSS (0x28)
-    memset(&tss, 0, sizeof(struct tss_entry));
-    tss.iomap_base = sizeof(struct tss_entry);
+    memset(tss, 0, sizeof(struct tss_entry));
+    tss->iomap_base = sizeof(struct tss_entry);
 
-    gdt_set_tss(5, (uint64_t)&tss, sizeof(struct tss_entry), 0x89, 0x00);
+    gdt_set_tss(gdt, 5, (uint64_t)tss, sizeof(struct tss_entry), 0x89, 0x00);
 
-    gdt_flush((uint64_t)&gdt_pointer);
+    gdt_flush((uint64_t)gdt_pointer);
     tss_flush();
 }
 
+/*
+ * Initialize's the GDT of the bootstrap processor
+ */
+void gdt_init(void)
+{
+    gdt_init_cpu(0);
+}
+
 /*
  * Set's kernel stack pointer in TSS
  * NOTE: Used when switching from user mode to kernel mode
  */
 void gdt_set_kernel_stack(uint64_t stack)
 {
-    tss.rsp0 = stack;
+    tss_entries[smp_processor_id()].rsp0 = stack;
 }
\ No newline at end of file
@@ -88,5 +88,16 @@ void idt_init(void)
     idt_set_gate(46, (uint64_t)irq14, 0x08, IDT_GATE_INTERRUPT);
     idt_set_gate(47, (uint64_t)irq15, 0x08, IDT_GATE_INTERRUPT);
 
+    // local APIC spurious vector
+    idt_set_gate(255, (uint64_t)isr255, 0x08, IDT_GATE_INTERRUPT);
+
+    idt_flush((uint64_t)&idt_pointer);
+}
+
+/*
+ * Load's the shared IDT on the executing CPU
+ */
+void idt_load(void)
+{
     idt_flush((uint64_t)&idt_pointer);
 }
\ No newline at end of file
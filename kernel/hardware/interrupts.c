@@ -7,6 +7,8 @@
 #include <thuban/panic.h>
 #include <thuban/stdio.h>
 #include <thuban/io.h>
+#include <thuban/vmm.h>
+#include <thuban/percpu.h>
 
 static irq_handler_t irq_handlers[16] = {0};
 
@@ -128,6 +130,18 @@ static void pic_send_eoi(uint8_t irq)
  */
 void isr_handler(struct registers *regs)
 {
+    if (regs->int_no == 14)
+    {
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+
+        /* Demand paged memory being touched for the first time */
+        if (vmm_handle_fault(cr2, regs->err_code) == 0)
+        {
+            return;
+        }
+    }
+
     if (regs->int_no < 32)
     {
         /* CPU exception - trigger panic with BSOD */
@@ -145,6 +159,8 @@ void irq_handler(struct registers *regs)
 {
     int irq = regs->int_no - 32;
 
+    this_cpu_inc(irq_count);
+
     if (irq >= 0 && irq < 16)
     {
         if (irq_handlers[irq])
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Local APIC implementation
+ */
+
+#include <thuban/lapic.h>
+#include <thuban/paging.h>
+#include <thuban/pmm.h>
+#include <thuban/syscall.h>
+#include <thuban/vmm.h>
+#include <thuban/stdio.h>
+
+static volatile uint32_t *lapic_base;
+
+/*
+ * Read's a local APIC register
+ */
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic_base[reg / 4];
+}
+
+/*
+ * Write's a local APIC register
+ */
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic_base[reg / 4] = value;
+}
+
+/*
+ * Wait's for the last IPI to be accepted
+ */
+static void lapic_wait_icr(void)
+{
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+    {
+        asm volatile("pause");
+    }
+}
+
+/*
+ * Send's an IPI
+ * NOTE: Writing the low half is what sends it, so the destination goes first
+ */
+static void lapic_send_ipi(uint32_t apic_id, uint32_t command)
+{
+    lapic_wait_icr();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    lapic_wait_icr();
+}
+
+/*
+ * Initialize's the local APIC mapping
+ * NOTE: Every CPU's APIC answers at the same address, so one uncached
+ * mapping serves them all
+ */
+int lapic_init(uint64_t phys)
+{
+    lapic_base = vmm_ioremap(phys, PAGE_SIZE, PAGING_CACHE_DISABLE | PAGING_WRITETHROUGH);
+
+    if (!lapic_base)
+    {
+        printf("[LAPIC] Failed to map registers at 0x%llx\n", phys);
+        return -1;
+    }
+
+    lapic_enable();
+
+    printf("[LAPIC] BSP APIC ID %u, version 0x%x\n", lapic_id(), lapic_read(LAPIC_VERSION) & 0xFF);
+    return 0;
+}
+
+/*
+ * Enable's the executing CPU's local APIC
+ */
+void lapic_enable(void)
+{
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+
+    // accept every priority, the PIC still routes device interrupts
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    // the error status register latches on a write
+    lapic_write(LAPIC_ESR, 0);
+    lapic_read(LAPIC_ESR);
+}
+
+/*
+ * Get's the executing CPU's APIC ID
+ */
+uint32_t lapic_id(void)
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+/*
+ * Signal's end of interrupt
+ */
+void lapic_eoi(void)
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/*
+ * Send's INIT to a CPU
+ */
+void lapic_send_init(uint32_t apic_id)
+{
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+}
+
+/*
+ * Send's a startup IPI to a CPU
+ */
+void lapic_send_startup(uint32_t apic_id, uint8_t page)
+{
+    lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | page);
+}
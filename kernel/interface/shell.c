@@ -10,6 +10,9 @@
 #include <thuban/vga.h>
 #include <thuban/pmm.h>
 #include <thuban/heap.h>
+#include <thuban/slab.h>
+#include <thuban/lockstat.h>
+#include <thuban/smp.h>
 #include <thuban/module.h>
 #include <thuban/multiboot.h>
 #include <thuban/panic.h>
@@ -125,6 +128,8 @@ static void cmd_help(int argc, char **argv)
     printf("  help      - Display this help message\n");
     printf("  clear     - Clear the screen\n");
     printf("  meminfo   - Display memory information\n");
+    printf("  slabinfo  - Display slab cache usage\n");
+    printf("  lockstat [n|reset] - Display the most contended locks\n");
     printf("  sysinfo   - Display system information\n");
     printf("  drivers   - List all drivers\n");
     printf("  echo      - Echo arguments\n");
@@ -169,6 +174,24 @@ static void cmd_meminfo(int argc, char **argv)
     printf("  Used:  %llu MB (%llu KB)\n", used_mem / 1024 / 1024, used_mem / 1024);
     printf("  Free:  %llu MB (%llu KB)\n", free_mem / 1024 / 1024, free_mem / 1024);
 
+    struct pmm_pcp_stats pcp;
+    pmm_get_pcp_stats(&pcp);
+
+    printf("\nPer-CPU Page Cache:\n");
+    printf("  Hits:    %llu\n", pcp.hits);
+    printf("  Misses:  %llu\n", pcp.misses);
+    printf("  Refills: %llu\n", pcp.refills);
+    printf("  Drains:  %llu\n", pcp.drains);
+    printf("  Cached:  %llu pages\n", pcp.cached);
+
+    struct pmm_zero_stats zero;
+    pmm_get_zero_stats(&zero);
+
+    printf("\nZeroed Page Pool:\n");
+    printf("  Pooled:  %llu pages\n", zero.pooled);
+    printf("  Hits:    %llu\n", zero.hits);
+    printf("  Misses:  %llu\n", zero.misses);
+
     uint64_t heap_total = heap_get_total();
     uint64_t heap_used = heap_get_used();
     uint64_t heap_free = heap_get_free();
@@ -177,6 +200,56 @@ static void cmd_meminfo(int argc, char **argv)
     printf("  Total: %llu KB\n", heap_total / 1024);
     printf("  Used:  %llu KB\n", heap_used / 1024);
     printf("  Free:  %llu KB\n", heap_free / 1024);
+
+    uint64_t realloc_in_place, realloc_copied;
+    heap_get_realloc_stats(&realloc_in_place, &realloc_copied);
+
+    printf("  Realloc in place: %llu, copied: %llu\n", realloc_in_place, realloc_copied);
+}
+
+static void cmd_slabinfo(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    kmem_cache_list();
+}
+
+static void cmd_lockstat(int argc, char **argv)
+{
+    int count = LOCKSTAT_TOP;
+
+    if (argc > 1 && strcmp(argv[1], "reset") == 0)
+    {
+        lockstat_reset();
+        printf("Lock statistics reset\n");
+        return;
+    }
+
+    if (argc > 1)
+    {
+        const char *p = argv[1];
+
+        count = 0;
+        for (; *p >= '0' && *p <= '9'; p++)
+        {
+            count = count * 10 + (*p - '0');
+
+            // there are no more classes than this to print, and it can't overflow
+            if (count > LOCKSTAT_CLASSES)
+            {
+                count = LOCKSTAT_CLASSES;
+            }
+        }
+
+        // lockstat_print takes 0 as everything, so only a positive plain number counts
+        if (argc > 2 || *p != '\0' || count == 0)
+        {
+            printf("Usage: lockstat [n|reset]\n");
+            return;
+        }
+    }
+
+    lockstat_print(count);
 }
 
 static void cmd_sysinfo(int argc, char **argv)
@@ -185,6 +258,15 @@ static void cmd_sysinfo(int argc, char **argv)
     (void)argv;
     puts("[NAME]: Thuban");
     puts("[VERSION]: 0.3.0");
+    printf("[CPUS]: %u\n", smp_num_cpus);
+
+    for (unsigned int cpu = 0; cpu < smp_num_cpus; cpu++)
+    {
+        struct percpu *area = per_cpu(cpu);
+
+        printf("  CPU%u: APIC ID %u, %llu interrupts, %llu syscalls\n", cpu, cpu_apic_id[cpu],
+               area->irq_count, area->syscall_count);
+    }
 }
 
 static void cmd_drivers(int argc, char **argv)
@@ -737,6 +819,14 @@ static void execute_command(char *cmd)
     {
         cmd_meminfo(argc, args);
     }
+    else if (strcmp(args[0], "slabinfo") == 0)
+    {
+        cmd_slabinfo(argc, args);
+    }
+    else if (strcmp(args[0], "lockstat") == 0)
+    {
+        cmd_lockstat(argc, args);
+    }
     else if (strcmp(args[0], "sysinfo") == 0)
     {
         cmd_sysinfo(argc, args);
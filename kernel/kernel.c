@@ -8,15 +8,20 @@
 #include <thuban/pmm.h>
 #include <thuban/vmm.h>
 #include <thuban/paging.h>
+#include <thuban/aspace.h>
 #include <thuban/heap.h>
+#include <thuban/slab.h>
 #include <thuban/gdt.h>
 #include <thuban/idt.h>
 #include <thuban/interrupts.h>
 #include <thuban/shell.h>
 #include <thuban/module.h>
 #include <thuban/syscall.h>
+#include <thuban/smp.h>
+#include <thuban/percpu.h>
 #include <thuban/blkdev.h>
 #include <thuban/vfs.h>
+#include <thuban/filemap.h>
 #include <thuban/vga.h>
 #include <thuban/fat32.h>
 
@@ -86,11 +91,16 @@ static void create_directory_structure(void)
 
 void kmain(uint32_t multiboot_magic, void *multiboot_addr)
 {
+    // the allocators' per-CPU caches are found through GS from the start
+    percpu_init(0);
+
     multiboot_parse(multiboot_magic, multiboot_addr);
     struct multiboot_info *mbi = multiboot_get_info();
 
-    pmm_init(mbi->total_mem);
-    paging_init();
+    pmm_init(mbi);
+    paging_init(mbi);
+    slab_init();
+    aspace_init();
     vmm_init();
     heap_init();
     gdt_init();
@@ -100,7 +110,9 @@ void kmain(uint32_t multiboot_magic, void *multiboot_addr)
     module_init_builtin();
     interrupts_enable();
     syscall_init();
+    smp_init(mbi);
     vfs_init();
+    filemap_init();
     fat32_init();
 
     if (vfs_mount("hda", "/", "fat32", 0) == 0)
@@ -119,5 +131,8 @@ void kmain(uint32_t multiboot_magic, void *multiboot_addr)
     shell_init();
 
     while (1)
+    {
+        pmm_zero_idle();
         asm volatile("hlt");
+    }
 }
\ No newline at end of file
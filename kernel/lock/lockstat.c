@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Lock contention statistics implementation
+ * Counters are bumped from inside the lock paths, so nothing here may
+ * take a lock: classes are claimed and updated with atomics alone.
+ */
+
+#include <thuban/lockstat.h>
+#include <thuban/stdio.h>
+#include <thuban/string.h>
+
+#ifdef CONFIG_LOCKSTAT
+
+static struct lockstat_class classes[LOCKSTAT_CLASSES] = {
+    [LOCKSTAT_CLASSES - 1] = {.state = LOCKSTAT_READY, .name = "(other)"},
+};
+
+/*
+ * Add's to a counter other CPUs may be bumping too
+ */
+static inline void stat_add(uint64_t *counter, uint64_t value)
+{
+    asm volatile("lock addq %1, %0" : "+m"(*counter) : "r"(value) : "memory", "cc");
+}
+
+/*
+ * Replace's *ptr with new if it still holds old
+ */
+static inline int stat_cmpxchg(uint64_t *ptr, uint64_t old, uint64_t new)
+{
+    uint64_t seen;
+
+    asm volatile("lock cmpxchgq %2, %1"
+                 : "=a"(seen), "+m"(*ptr)
+                 : "r"(new), "0"(old)
+                 : "memory", "cc");
+
+    return seen == old;
+}
+
+/*
+ * Raise's a maximum
+ * Returns 1 if value became the new maximum
+ */
+static inline int stat_max(uint64_t *max, uint64_t value)
+{
+    for (;;)
+    {
+        uint64_t cur = *max;
+
+        if (value <= cur)
+        {
+            return 0;
+        }
+
+        if (stat_cmpxchg(max, cur, value))
+        {
+            return 1;
+        }
+    }
+}
+
+/*
+ * Find's or claim's the class of a lock name
+ * NOTE: Called once per lock, which caches the result. The name is
+ * copied since a lock may outlive it. A slot another CPU is still
+ * filling is passed over rather than waited on, which at worst gives
+ * a name a second class.
+ */
+struct lockstat_class *lockstat_class(const char *name)
+{
+    if (!name)
+    {
+        name = "(unnamed)";
+    }
+
+    for (int i = 0; i < LOCKSTAT_CLASSES - 1; i++)
+    {
+        struct lockstat_class *class = &classes[i];
+
+        if (class->state == LOCKSTAT_FREE && stat_cmpxchg(&class->state, LOCKSTAT_FREE, LOCKSTAT_CLAIMING))
+        {
+            strncpy(class->name, name, LOCKSTAT_NAME_LEN - 1);
+            class->name[LOCKSTAT_NAME_LEN - 1] = '\0';
+
+            // the name must be in place before anyone can match it
+            asm volatile("" ::: "memory");
+            class->state = LOCKSTAT_READY;
+            return class;
+        }
+
+        if (class->state == LOCKSTAT_READY && strncmp(class->name, name, LOCKSTAT_NAME_LEN - 1) == 0)
+        {
+            return class;
+        }
+    }
+
+    return &classes[LOCKSTAT_CLASSES - 1];
+}
+
+/*
+ * Count's an acquisition
+ */
+void lockstat_acquired(struct lockstat_class *class, uint64_t spin)
+{
+    stat_add(&class->acquisitions, 1);
+
+    if (spin)
+    {
+        stat_add(&class->contended, 1);
+        stat_add(&class->spin_cycles, spin);
+        stat_max(&class->max_spin, spin);
+    }
+}
+
+/*
+ * Count's a release
+ * NOTE: The RIP is stored after the maximum, so a racing release of
+ * another lock in the class can leave them a moment out of step
+ */
+void lockstat_released(struct lockstat_class *class, uint64_t hold, uint64_t rip)
+{
+    if (stat_max(&class->max_hold, hold))
+    {
+        class->max_hold_rip = rip;
+    }
+}
+
+/*
+ * Print's the most contended lock classes
+ * NOTE: Ordered by contended acquisitions, then by cycles spent waiting
+ */
+void lockstat_print(int count)
+{
+    int order[LOCKSTAT_CLASSES];
+    int used = 0;
+
+    for (int i = 0; i < LOCKSTAT_CLASSES; i++)
+    {
+        if (classes[i].acquisitions)
+        {
+            order[used++] = i;
+        }
+    }
+
+    for (int i = 0; i < used; i++)
+    {
+        int best = i;
+
+        for (int j = i + 1; j < used; j++)
+        {
+            struct lockstat_class *a = &classes[order[j]];
+            struct lockstat_class *b = &classes[order[best]];
+
+            if (a->contended > b->contended ||
+                (a->contended == b->contended && a->spin_cycles > b->spin_cycles))
+            {
+                best = j;
+            }
+        }
+
+        int tmp = order[i];
+        order[i] = order[best];
+        order[best] = tmp;
+    }
+
+    if (count <= 0 || count > used)
+    {
+        count = used;
+    }
+
+    printf("%-16s %-10s %-10s %-14s %-12s %-12s %s\n",
+           "Name", "Acquired", "Contended", "Spin cycles", "Max spin", "Max hold", "Hold RIP");
+    printf("--------------------------------------------------------------------------------------------\n");
+
+    for (int i = 0; i < count; i++)
+    {
+        struct lockstat_class *class = &classes[order[i]];
+
+        printf("%-16s %-10llu %-10llu %-14llu %-12llu %-12llu 0x%llx\n",
+               class->name,
+               class->acquisitions,
+               class->contended,
+               class->spin_cycles,
+               class->max_spin,
+               class->max_hold,
+               class->max_hold_rip);
+    }
+
+    printf("\n%d of %d lock classes shown, cycles are TSC cycles\n", count, used);
+}
+
+/*
+ * Zero's every class's counters
+ * NOTE: Names stay, locks keep pointing at their class
+ */
+void lockstat_reset(void)
+{
+    for (int i = 0; i < LOCKSTAT_CLASSES; i++)
+    {
+        classes[i].acquisitions = 0;
+        classes[i].contended = 0;
+        classes[i].spin_cycles = 0;
+        classes[i].max_spin = 0;
+        classes[i].max_hold = 0;
+        classes[i].max_hold_rip = 0;
+    }
+}
+
+#else
+
+void lockstat_print(int count)
+{
+    (void)count;
+    printf("Lock statistics are not compiled in, enable LOCKSTAT in Kconfig\n");
+}
+
+void lockstat_reset(void)
+{
+}
+
+#endif
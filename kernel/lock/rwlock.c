@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Reader-writer lock implementation
+ */
+
+#include <thuban/rwlock.h>
+
+/*
+ * Replace count if it still holds old
+ * Returns 1 if the swap happened
+ */
+static inline int rw_cmpxchg(rwlock_t *lock, uint32_t old, uint32_t new)
+{
+    uint32_t seen;
+
+    asm volatile("lock cmpxchgl %2, %1"
+                 : "=a"(seen), "+m"(lock->count)
+                 : "r"(new), "0"(old)
+                 : "memory", "cc");
+
+    return seen == old;
+}
+
+/*
+ * Initialize a reader-writer lock
+ */
+void rwlock_init(rwlock_t *lock, const char *name)
+{
+    lock->count = 0;
+    lock->name = name;
+}
+
+/*
+ * Acquire a reader-writer lock shared
+ */
+uint64_t read_lock_irqsave(rwlock_t *lock)
+{
+    uint64_t flags = save_flags_and_cli();
+
+    for (;;)
+    {
+        uint32_t count = lock->count;
+
+        /* Writers go first, held or waiting */
+        if (count & (RWLOCK_WRITER | RWLOCK_WAITING))
+        {
+            asm volatile("pause");
+            continue;
+        }
+
+        if (rw_cmpxchg(lock, count, count + 1))
+        {
+            return flags;
+        }
+    }
+}
+
+/*
+ * Release a shared hold on a reader-writer lock
+ */
+void read_unlock_irqrestore(rwlock_t *lock, uint64_t flags)
+{
+    asm volatile("lock decl %0" : "+m"(lock->count) : : "memory", "cc");
+    restore_flags(flags);
+}
+
+/*
+ * Acquire a reader-writer lock exclusive
+ * RWLOCK_WAITING is set again after another writer clears it on the
+ * way in, so readers stay held off while any writer is queued
+ */
+uint64_t write_lock_irqsave(rwlock_t *lock)
+{
+    uint64_t flags = save_flags_and_cli();
+
+    for (;;)
+    {
+        uint32_t count = lock->count;
+
+        if (!(count & ~RWLOCK_WAITING))
+        {
+            if (rw_cmpxchg(lock, count, RWLOCK_WRITER))
+            {
+                return flags;
+            }
+
+            continue;
+        }
+
+        if (!(count & RWLOCK_WAITING))
+        {
+            asm volatile("lock orl %1, %0" : "+m"(lock->count) : "r"(RWLOCK_WAITING) : "memory", "cc");
+        }
+
+        asm volatile("pause");
+    }
+}
+
+/*
+ * Release an exclusive hold on a reader-writer lock
+ * Another writer may be setting RWLOCK_WAITING, so only our bit is cleared
+ */
+void write_unlock_irqrestore(rwlock_t *lock, uint64_t flags)
+{
+    asm volatile("lock andl %1, %0" : "+m"(lock->count) : "r"(~RWLOCK_WRITER) : "memory", "cc");
+    restore_flags(flags);
+}
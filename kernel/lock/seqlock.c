@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Sequence lock implementation
+ */
+
+#include <thuban/seqlock.h>
+
+/*
+ * Initialize a sequence lock
+ */
+void seqlock_init(seqlock_t *lock, const char *name)
+{
+    lock->sequence = 0;
+    spin_lock_init(&lock->lock, name);
+}
+
+/*
+ * Start a write section
+ * x86 keeps stores in order, so the odd sequence is visible
+ * before anything the writer changes
+ */
+void write_seqlock(seqlock_t *lock)
+{
+    spin_lock(&lock->lock);
+    lock->sequence++;
+    asm volatile("" : : : "memory");
+}
+
+/*
+ * End a write section
+ */
+void write_sequnlock(seqlock_t *lock)
+{
+    asm volatile("" : : : "memory");
+    lock->sequence++;
+    spin_unlock(&lock->lock);
+}
@@ -7,42 +7,103 @@
 #include <thuban/stdio.h>
 
 /*
- * Save RFLAGS and disable interrupts
+ * Take a ticket and wait for it to be served
+ * Waiters further back in the queue pause longer between polls,
+ * so the lock's cache line isn't hammered by every waiter at once
+ *
+ * Returns:
+ *   TSC cycles spent waiting with CONFIG_LOCKSTAT, 0 if the lock was free
  */
-static inline uint64_t save_flags_and_cli(void)
+static inline uint64_t ticket_lock(spinlock_t *lock)
 {
-    uint64_t flags;
-    asm volatile(
-        "pushfq\n" /* Push RFLAGS onto stack */
-        "pop %0\n" /* Pop into flags variable */
-        "cli\n"    /* Disable interrupts */
-        : "=r"(flags)
-        :
-        : "memory");
-    return flags;
+    uint16_t ticket = 1;
+    uint64_t spin = 0;
+
+    asm volatile("lock xaddw %0, %1"
+                 : "+r"(ticket), "+m"(lock->next)
+                 :
+                 : "memory", "cc");
+
+    if ((uint16_t)(ticket - lock->owner) != 0)
+    {
+#ifdef CONFIG_LOCKSTAT
+        uint64_t start = rdtsc();
+#endif
+
+        for (;;)
+        {
+            uint16_t ahead = (uint16_t)(ticket - lock->owner);
+
+            if (ahead == 0)
+            {
+                break;
+            }
+
+            for (uint16_t i = 0; i < ahead; i++)
+            {
+                asm volatile("pause");
+            }
+        }
+
+#ifdef CONFIG_LOCKSTAT
+        spin = rdtsc() - start;
+#endif
+    }
+
+    /* Nothing in the critical section may be read before the lock is ours */
+    asm volatile("" : : : "memory");
+    return spin;
 }
 
 /*
- * Restore RFLAGS (and interrupt state)
+ * Serve the next ticket
+ * Only the holder writes owner, so a plain store is a release on x86
  */
-static inline void restore_flags(uint64_t flags)
+static inline void ticket_unlock(spinlock_t *lock)
 {
-    asm volatile(
-        "push %0\n" /* Push flags onto stack */
-        "popfq\n"   /* Pop into RFLAGS */
-        :
-        : "r"(flags)
-        : "memory", "cc");
+    asm volatile("" : : : "memory");
+    lock->owner = (uint16_t)(lock->owner + 1);
 }
 
+#ifdef CONFIG_LOCKSTAT
+/*
+ * Count an acquisition and start timing the hold
+ */
+static inline void stat_acquired(spinlock_t *lock, uint64_t spin, void *rip)
+{
+    if (!lock->class)
+    {
+        lock->class = lockstat_class(lock->name);
+    }
+
+    lockstat_acquired(lock->class, spin);
+    lock->acquired_rip = (uint64_t)rip;
+    lock->acquired_at = rdtsc();
+}
+
+/*
+ * Count a release, must run before the lock is handed on
+ */
+static inline void stat_released(spinlock_t *lock)
+{
+    lockstat_released(lock->class, rdtsc() - lock->acquired_at, lock->acquired_rip);
+}
+#else
+#define stat_acquired(lock, spin, rip) ((void)(spin))
+#define stat_released(lock) ((void)0)
+#endif
+
 /*
  * Initialize a spinlock
  */
 void spin_lock_init(spinlock_t *lock, const char *name)
 {
+    lock->ticket = 0;
     lock->flags = 0;
-    lock->locked = 0;
     lock->name = name;
+#ifdef CONFIG_LOCKSTAT
+    lock->class = NULL;
+#endif
 }
 
 /*
@@ -51,21 +112,13 @@ void spin_lock_init(spinlock_t *lock, const char *name)
 void spin_lock(spinlock_t *lock)
 {
     /* Save interrupt state and disable interrupts */
-    lock->flags = save_flags_and_cli();
-
-    /*
-     * On single-core systems, disabling interrupts is sufficient
-     * On SMP systems, we would spin here using atomic operations:
-     *
-     * while (__sync_lock_test_and_set(&lock->locked, 1)) {
-     *     while (lock->locked) {
-     *         asm volatile("pause");
-     *     }
-     * }
-     */
-
-    /* For now, just mark as locked */
-    lock->locked = 1;
+    uint64_t flags = save_flags_and_cli();
+    uint64_t spin = ticket_lock(lock);
+
+    stat_acquired(lock, spin, __builtin_return_address(0));
+
+    /* Only stored once the lock is ours, a waiter can't overwrite it */
+    lock->flags = flags;
 }
 
 /*
@@ -73,16 +126,36 @@ void spin_lock(spinlock_t *lock)
  */
 void spin_unlock(spinlock_t *lock)
 {
-    /* Mark as unlocked */
-    lock->locked = 0;
+    /* Read before the next holder can store its own */
+    uint64_t flags = lock->flags;
 
-    /*
-     * On SMP systems, we would use atomic release:
-     * __sync_lock_release(&lock->locked);
-     */
+    stat_released(lock);
+    ticket_unlock(lock);
 
     /* Restore interrupt state */
-    restore_flags(lock->flags);
+    restore_flags(flags);
+}
+
+/*
+ * Acquire a spinlock, returning the saved flags
+ */
+uint64_t spin_lock_irqsave(spinlock_t *lock)
+{
+    uint64_t flags = save_flags_and_cli();
+    uint64_t spin = ticket_lock(lock);
+
+    stat_acquired(lock, spin, __builtin_return_address(0));
+    return flags;
+}
+
+/*
+ * Release a spinlock taken with spin_lock_irqsave
+ */
+void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags)
+{
+    stat_released(lock);
+    ticket_unlock(lock);
+    restore_flags(flags);
 }
 
 /*
@@ -92,9 +165,25 @@ int spin_trylock(spinlock_t *lock)
 {
     /* Save interrupt state and disable interrupts */
     uint64_t flags = save_flags_and_cli();
+    uint32_t old = lock->ticket;
+    uint16_t owner = (uint16_t)old;
+
+    /* Free only if the next ticket is the one being served */
+    if ((uint16_t)(old >> 16) != owner)
+    {
+        restore_flags(flags);
+        return 0;
+    }
+
+    uint32_t new = old + (1U << 16);
+    uint32_t seen;
 
-    /* Check if already locked */
-    if (lock->locked)
+    asm volatile("lock cmpxchgl %2, %1"
+                 : "=a"(seen), "+m"(lock->ticket)
+                 : "r"(new), "0"(old)
+                 : "memory", "cc");
+
+    if (seen != old)
     {
         /* Failed to acquire - restore interrupts */
         restore_flags(flags);
@@ -102,8 +191,8 @@ int spin_trylock(spinlock_t *lock)
     }
 
     /* Acquired successfully */
+    stat_acquired(lock, 0, __builtin_return_address(0));
     lock->flags = flags;
-    lock->locked = 1;
     return 1;
 }
 
@@ -112,5 +201,7 @@ int spin_trylock(spinlock_t *lock)
  */
 int spin_is_locked(spinlock_t *lock)
 {
-    return lock->locked;
-}
\ No newline at end of file
+    uint32_t ticket = lock->ticket;
+
+    return (uint16_t)(ticket >> 16) != (uint16_t)ticket;
+}
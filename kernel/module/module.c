@@ -6,9 +6,13 @@
 #include <thuban/module.h>
 #include <thuban/stdio.h>
 #include <thuban/string.h>
+#include <thuban/rwlock.h>
 
 static struct module *module_list_head = NULL;
 
+// lookups far outnumber loads and unloads
+static rwlock_t module_lock = RWLOCK_INIT_NAMED("module");
+
 // external symbols from linker for initcalls
 extern initcall_t __initcall0_start[];
 extern initcall_t __initcall1_start[];
@@ -67,9 +71,11 @@ static int module_register(struct module *mod)
     if (!mod)
         return -1;
 
+    uint64_t irq = write_lock_irqsave(&module_lock);
     mod->next = module_list_head;
     module_list_head = mod;
     mod->state = MODULE_STATE_LIVE;
+    write_unlock_irqrestore(&module_lock, irq);
 
     printf("[MODULE] Registered: %s v%s\n", mod->name, mod->version ? mod->version : "unknown");
 
@@ -111,6 +117,7 @@ int module_unload(const char *name)
     }
 
     // remove from list
+    uint64_t irq = write_lock_irqsave(&module_lock);
     struct module *curr = module_list_head;
     struct module *prev = NULL;
 
@@ -133,6 +140,8 @@ int module_unload(const char *name)
     }
 
     mod->state = MODULE_STATE_UNLOADED;
+    write_unlock_irqrestore(&module_lock, irq);
+
     printf("[MODULE] Unloaded: %s\n", name);
 
     return 0;
@@ -143,18 +152,20 @@ int module_unload(const char *name)
  */
 struct module *module_find(const char *name)
 {
+    uint64_t irq = read_lock_irqsave(&module_lock);
     struct module *mod = module_list_head;
 
     while (mod)
     {
         if (strcmp(mod->name, name) == 0)
         {
-            return mod;
+            break;
         }
         mod = mod->next;
     }
 
-    return NULL;
+    read_unlock_irqrestore(&module_lock, irq);
+    return mod;
 }
 
 /*
@@ -162,6 +173,7 @@ struct module *module_find(const char *name)
  */
 void module_list(void)
 {
+    uint64_t irq = read_lock_irqsave(&module_lock);
     struct module *mod = module_list_head;
     int count = 0;
 
@@ -199,6 +211,8 @@ void module_list(void)
         mod = mod->next;
     }
 
+    read_unlock_irqrestore(&module_lock, irq);
+
     printf("\nTotal modules: %d\n", count);
 }
 
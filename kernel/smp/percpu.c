@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Per-CPU data areas
+ */
+
+#include <thuban/percpu.h>
+#include <thuban/smp.h>
+#include <thuban/aspace.h>
+#include <thuban/syscall.h>
+
+// syscall.s hardcodes these
+_Static_assert(offsetof(struct percpu, syscall_stack_top) == 8, "syscall.s percpu offsets");
+_Static_assert(offsetof(struct percpu, user_rsp) == 16, "syscall.s percpu offsets");
+
+// cache line aligned so no two CPUs write the same line
+static struct percpu percpu_areas[MAX_CPUS];
+
+/*
+ * Initialize's a CPU's area and loads it into GS
+ * NOTE: Must run on the CPU itself, before anything asks smp_processor_id()
+ */
+void percpu_init(unsigned int cpu)
+{
+    struct percpu *area = &percpu_areas[cpu];
+
+    area->self = area;
+    area->cpu = cpu;
+    area->current_space = &kernel_space;
+
+    // the kernel's GS base is live, the user's waits for swapgs
+    wrmsr(MSR_GS_BASE, (uint64_t)area);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+/*
+ * Get's a CPU's area
+ */
+struct percpu *per_cpu(unsigned int cpu)
+{
+    return &percpu_areas[cpu];
+}
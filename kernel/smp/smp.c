@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Application processor bring-up
+ */
+
+#include <thuban/smp.h>
+#include <thuban/acpi.h>
+#include <thuban/lapic.h>
+#include <thuban/aspace.h>
+#include <thuban/gdt.h>
+#include <thuban/idt.h>
+#include <thuban/multiboot.h>
+#include <thuban/paging.h>
+#include <thuban/pmm.h>
+#include <thuban/vmm.h>
+#include <thuban/syscall.h>
+#include <thuban/percpu.h>
+#include <thuban/io.h>
+#include <thuban/stdio.h>
+#include <thuban/string.h>
+
+#define AP_STACK_SIZE (16 * 1024)
+
+// how long a started CPU gets to report in
+#define AP_START_TIMEOUT_MS 200
+
+#define PIT_FREQUENCY 1193182
+
+// trampoline.s, copied to TRAMPOLINE_BASE
+extern uint8_t trampoline_start[];
+extern uint8_t trampoline_end[];
+extern uint8_t trampoline_cr3[];
+extern uint8_t trampoline_stack[];
+extern uint8_t trampoline_cpu[];
+
+unsigned int smp_num_cpus = 1;
+uint32_t cpu_apic_id[MAX_CPUS];
+
+static volatile int cpu_online[MAX_CPUS];
+
+/*
+ * Wait's at least us microseconds (up to 50ms)
+ * NOTE: Polls PIT channel 2, which counts down from its gate going high
+ * and raises its output once done, so no interrupt or calibration is needed
+ */
+static void udelay(uint32_t us)
+{
+    uint32_t count = (uint32_t)((uint64_t)us * PIT_FREQUENCY / 1000000);
+
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    // gate low while programming, speaker output off
+    uint8_t port61 = inb(0x61) & ~0x03;
+    outb(0x61, port61);
+
+    // channel 2, low then high byte, mode 0 (interrupt on terminal count)
+    outb(0x43, 0xB0);
+    outb(0x42, count & 0xFF);
+    outb(0x42, (count >> 8) & 0xFF);
+
+    outb(0x61, port61 | 0x01);
+
+    while (!(inb(0x61) & 0x20))
+    {
+        asm volatile("pause");
+    }
+}
+
+/*
+ * Set's a field of the copied trampoline
+ */
+static void trampoline_set(uint8_t *field, uint64_t value)
+{
+    uint8_t *copy = phys_to_virt(TRAMPOLINE_BASE);
+
+    *(volatile uint64_t *)(copy + (field - trampoline_start)) = value;
+}
+
+/*
+ * Start's one application processor with INIT-SIPI-SIPI
+ */
+static int smp_boot_cpu(unsigned int cpu, uint32_t apic_id)
+{
+    lapic_send_init(apic_id);
+    udelay(10000);
+
+    // a second startup IPI covers CPUs that missed the first
+    for (int i = 0; i < 2 && !cpu_online[cpu]; i++)
+    {
+        lapic_send_startup(apic_id, TRAMPOLINE_BASE >> 12);
+        udelay(200);
+    }
+
+    for (int ms = 0; ms < AP_START_TIMEOUT_MS && !cpu_online[cpu]; ms++)
+    {
+        udelay(1000);
+    }
+
+    return cpu_online[cpu] ? 0 : -1;
+}
+
+/*
+ * Collect's the enabled CPUs from the MADT
+ */
+static unsigned int madt_parse(struct acpi_madt *madt, uint32_t *apic_ids, uint64_t *lapic_phys)
+{
+    uint8_t *entry = (uint8_t *)(madt + 1);
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+    unsigned int count = 0;
+
+    *lapic_phys = madt->lapic_addr;
+
+    while (entry + sizeof(struct acpi_madt_entry) <= end)
+    {
+        struct acpi_madt_entry *header = (struct acpi_madt_entry *)entry;
+
+        if (header->length < sizeof(struct acpi_madt_entry) || entry + header->length > end)
+        {
+            break;
+        }
+
+        if (header->type == ACPI_MADT_LAPIC)
+        {
+            struct acpi_madt_lapic *lapic = (struct acpi_madt_lapic *)entry;
+
+            // online capable CPUs are for hotplug, which isn't supported
+            if ((lapic->flags & ACPI_MADT_LAPIC_ENABLED) && count < MAX_CPUS)
+            {
+                apic_ids[count++] = lapic->apic_id;
+            }
+        }
+        else if (header->type == ACPI_MADT_LAPIC_OVERRIDE)
+        {
+            *lapic_phys = ((struct acpi_madt_lapic_override *)entry)->lapic_addr;
+        }
+
+        entry += header->length;
+    }
+
+    return count;
+}
+
+/*
+ * Initialize's SMP
+ * NOTE: CPUs are started one at a time since they share the trampoline
+ * and its patched stack. Device interrupts stay on the BSP through the PIC
+ */
+void smp_init(struct multiboot_info *mbi)
+{
+    uint32_t apic_ids[MAX_CPUS];
+    uint64_t lapic_phys;
+
+    cpu_online[0] = 1;
+
+    if (acpi_init(mbi) != 0)
+    {
+        return;
+    }
+
+    struct acpi_madt *madt = acpi_find_table("APIC");
+
+    if (!madt)
+    {
+        printf("[SMP] No MADT, running on the BSP only\n");
+        return;
+    }
+
+    unsigned int count = madt_parse(madt, apic_ids, &lapic_phys);
+
+    if (lapic_init(lapic_phys) != 0)
+    {
+        return;
+    }
+
+    cpu_apic_id[0] = lapic_id();
+
+    if (count <= 1)
+    {
+        printf("[SMP] 1 CPU\n");
+        return;
+    }
+
+    if (mbi->mbi_start < TRAMPOLINE_BASE + PAGE_SIZE && mbi->mbi_end > TRAMPOLINE_BASE)
+    {
+        printf("[SMP] Boot information overlaps the trampoline, running on the BSP only\n");
+        return;
+    }
+
+    // the trampoline loads a 32-bit CR3, and the low identity map in the
+    // kernel PML4 keeps it running across the switch to paging
+    if (kernel_space.pml4_phys >= (1ULL << 32) || !(kernel_space.pml4[0] & PAGING_PRESENT))
+    {
+        printf("[SMP] Kernel PML4 unusable by the trampoline, running on the BSP only\n");
+        return;
+    }
+
+    if (!paging_is_direct_mapped(TRAMPOLINE_BASE, PAGE_SIZE))
+    {
+        printf("[SMP] Trampoline page isn't RAM, running on the BSP only\n");
+        return;
+    }
+
+    memcpy(phys_to_virt(TRAMPOLINE_BASE), trampoline_start, trampoline_end - trampoline_start);
+    trampoline_set(trampoline_cr3, kernel_space.pml4_phys);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned int cpu = smp_num_cpus;
+
+        if (apic_ids[i] == cpu_apic_id[0])
+        {
+            continue;
+        }
+
+        // vmalloc leaves an unmapped guard page below the stack
+        uint8_t *stack = vmalloc(AP_STACK_SIZE);
+
+        if (!stack || syscall_stack_alloc(cpu) != 0)
+        {
+            printf("[SMP] Out of memory for CPU stacks\n");
+            break;
+        }
+
+        trampoline_set(trampoline_stack, ((uint64_t)stack + AP_STACK_SIZE) & ~0xFULL);
+        trampoline_set(trampoline_cpu, cpu);
+
+        // a late start would still run on this stack and index, so the
+        // stack is kept and no other CPU is given either
+        if (smp_boot_cpu(cpu, apic_ids[i]) != 0)
+        {
+            printf("[SMP] CPU with APIC ID %u didn't start\n", apic_ids[i]);
+            break;
+        }
+
+        cpu_apic_id[cpu] = apic_ids[i];
+        smp_num_cpus++;
+    }
+
+    printf("[SMP] %u of %u CPUs online\n", smp_num_cpus, count);
+}
+
+/*
+ * Application processor entry
+ * NOTE: Runs on the stack smp_init gave this CPU, with the kernel PML4
+ * and the trampoline's GDT, then parks until there is work for it
+ */
+void ap_main(uint64_t cpu)
+{
+    percpu_init(cpu);
+    aspace_cpu_init();
+    gdt_init_cpu(cpu);
+    idt_load();
+    lapic_enable();
+    syscall_init_cpu();
+
+    cpu_online[cpu] = 1;
+
+    while (1)
+    {
+        asm volatile("sti; hlt");
+    }
+}
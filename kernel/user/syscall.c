@@ -8,6 +8,12 @@
 #include <thuban/string.h>
 #include <thuban/gdt.h>
 #include <thuban/vfs.h>
+#include <thuban/pmm.h>
+#include <thuban/vmm.h>
+#include <thuban/aspace.h>
+#include <thuban/filemap.h>
+#include <thuban/mman.h>
+#include <thuban/percpu.h>
 
 /* System call table */
 static syscall_handler_t syscall_table[SYSCALL_MAX];
@@ -44,6 +50,14 @@ static int64_t sys_getdents_impl(uint64_t fd, uint64_t dirp, uint64_t count,
 static int64_t sys_unlink_impl(uint64_t path, uint64_t arg2, uint64_t arg3,
                                uint64_t arg4, uint64_t arg5, uint64_t arg6);
 
+/* Memory mapping syscalls */
+static int64_t sys_mmap_impl(uint64_t addr, uint64_t length, uint64_t prot,
+                             uint64_t flags, uint64_t fd, uint64_t offset);
+static int64_t sys_munmap_impl(uint64_t addr, uint64_t length, uint64_t arg3,
+                               uint64_t arg4, uint64_t arg5, uint64_t arg6);
+static int64_t sys_msync_impl(uint64_t addr, uint64_t length, uint64_t flags,
+                              uint64_t arg4, uint64_t arg5, uint64_t arg6);
+
 /*
  * Initialize syscall subsystem
  */
@@ -70,6 +84,24 @@ void syscall_init(void)
     syscall_register(SYS_GETDENTS, sys_getdents_impl);
     syscall_register(SYS_UNLINK, sys_unlink_impl);
 
+    /* Register memory mapping syscalls */
+    syscall_register(SYS_MMAP, sys_mmap_impl);
+    syscall_register(SYS_MUNMAP, sys_munmap_impl);
+    syscall_register(SYS_MSYNC, sys_msync_impl);
+
+    if (syscall_stack_alloc(0) != 0)
+    {
+        printf("[SYSCALL] Failed to allocate the syscall stack\n");
+    }
+
+    syscall_init_cpu();
+}
+
+/*
+ * Configure the executing CPU for SYSCALL/SYSRET
+ */
+void syscall_init_cpu(void)
+{
     /* Configure MSRs for SYSCALL/SYSRET */
 
     /* STAR: Set segment selectors
@@ -94,6 +126,23 @@ void syscall_init(void)
     wrmsr(0xC0000080, efer);
 }
 
+/*
+ * Allocate a CPU's syscall stack
+ * NOTE: syscall_entry switches to it through the CPU's per-CPU area
+ */
+int syscall_stack_alloc(unsigned int cpu)
+{
+    uint8_t *stack = vmalloc(SYSCALL_STACK_SIZE);
+
+    if (!stack)
+    {
+        return -1;
+    }
+
+    per_cpu(cpu)->syscall_stack_top = ((uint64_t)stack + SYSCALL_STACK_SIZE) & ~0xFULL;
+    return 0;
+}
+
 /*
  * Register a syscall handler
  */
@@ -114,7 +163,8 @@ void syscall_register(int num, syscall_handler_t handler)
  * Syscall number in: rax
  */
 int64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
-                        uint64_t arg3, uint64_t arg4, uint64_t arg5)
+                        uint64_t arg3, uint64_t arg4, uint64_t arg5,
+                        uint64_t arg6)
 {
     /* Validate syscall number */
     if (num >= SYSCALL_MAX)
@@ -130,8 +180,10 @@ int64_t syscall_handler(uint64_t num, uint64_t arg1, uint64_t arg2,
         return -1;
     }
 
+    this_cpu_inc(syscall_count);
+
     /* Call the handler */
-    return syscall_table[num](arg1, arg2, arg3, arg4, arg5, 0);
+    return syscall_table[num](arg1, arg2, arg3, arg4, arg5, arg6);
 }
 
 /*
@@ -432,4 +484,106 @@ static int64_t sys_unlink_impl(uint64_t path, uint64_t arg2, uint64_t arg3,
     }
 
     return (int64_t)vfs_unlink((const char *)path);
+}
+
+/*
+ * Memory Mapping Syscall Implementations
+ */
+
+/*
+ * SYS_MMAP: Map a file or anonymous memory
+ * The address is only a hint and is ignored, the kernel picks the range
+ */
+static int64_t sys_mmap_impl(uint64_t addr, uint64_t length, uint64_t prot,
+                             uint64_t flags, uint64_t fd, uint64_t offset)
+{
+    (void)addr;
+
+    uint64_t type = flags & (MAP_SHARED | MAP_PRIVATE);
+
+    if (length == 0 || (offset & (PAGE_SIZE - 1)) ||
+        !(prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) ||
+        (type != MAP_SHARED && type != MAP_PRIVATE))
+    {
+        return -1;
+    }
+
+    size_t pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t page_flags = (prot & PROT_WRITE) ? PAGE_WRITE : 0;
+    void *virt;
+
+    if (flags & MAP_ANONYMOUS)
+    {
+        virt = vmm_mmap(aspace_current(), pages, page_flags, NULL, 0, 0);
+        return virt ? (int64_t)virt : -1;
+    }
+
+    vfs_file_t *file = vfs_file_get((int)fd);
+
+    if (!file)
+    {
+        return -1;
+    }
+
+    int mode = file->flags & O_ACCMODE;
+    int is_file = vfs_is_file(file->node);
+
+    vfs_file_put(file);
+
+    /* Writes through a shared mapping reach the file */
+    if (!is_file || mode == O_WRONLY ||
+        (type == MAP_SHARED && (prot & PROT_WRITE) && mode == O_RDONLY))
+    {
+        return -1;
+    }
+
+    struct vm_file *vmf = filemap_open((int)fd);
+
+    if (!vmf)
+    {
+        return -1;
+    }
+
+    virt = vmm_mmap(aspace_current(), pages, page_flags, vmf,
+                    offset / PAGE_SIZE, type == MAP_SHARED);
+
+    /* The mapping holds its own reference on the page cache */
+    filemap_put(vmf);
+
+    return virt ? (int64_t)virt : -1;
+}
+
+/*
+ * SYS_MUNMAP: Unmap pages
+ */
+static int64_t sys_munmap_impl(uint64_t addr, uint64_t length, uint64_t arg3,
+                               uint64_t arg4, uint64_t arg5, uint64_t arg6)
+{
+    (void)arg3;
+    (void)arg4;
+    (void)arg5;
+    (void)arg6;
+
+    if (length == 0)
+    {
+        return -1;
+    }
+
+    return (int64_t)vmm_munmap(aspace_current(), addr,
+                               (length + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+/*
+ * SYS_MSYNC: Write back dirty pages of shared file mappings
+ */
+static int64_t sys_msync_impl(uint64_t addr, uint64_t length, uint64_t flags,
+                              uint64_t arg4, uint64_t arg5, uint64_t arg6)
+{
+    (void)flags;
+    (void)arg4;
+    (void)arg5;
+    (void)arg6;
+
+    return (int64_t)vmm_msync(aspace_current(), addr,
+                              (length + PAGE_SIZE - 1) / PAGE_SIZE);
 }
\ No newline at end of file
@@ -7,26 +7,31 @@
 #include <thuban/gdt.h>
 #include <thuban/stdio.h>
 #include <thuban/string.h>
-#include <thuban/heap.h>
+#include <thuban/vmm.h>
+#include <thuban/pmm.h>
+#include <thuban/aspace.h>
 
 /*
  * Allocate and initialize a user mode stack
  */
 void *create_user_stack(size_t size)
 {
-    /* Allocate memory for stack */
-    void *stack = malloc(size);
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    /*
+     * Reserve the stack in the user half of the current address space
+     * without backing it, every page is faulted in already zeroed the
+     * first time the program touches it
+     */
+    void *stack = vmm_alloc_user(aspace_current(), pages, PAGE_WRITE);
     if (!stack)
     {
         printf("[USERMODE] Failed to allocate user stack (%zu bytes)\n", size);
         return NULL;
     }
 
-    /* Zero out the stack for safety */
-    memset(stack, 0, size);
-
     /* Return pointer to TOP of stack (x86_64 stacks grow downward) */
-    return (void *)((uint64_t)stack + size);
+    return (void *)((uint64_t)stack + pages * PAGE_SIZE);
 }
 
 /*
@@ -7,6 +7,7 @@
 #include <thuban/vga.h>
 #include <thuban/string.h>
 #include <thuban/keyboard.h>
+#include <thuban/pmm.h>
 
 static size_t term_x = 0;
 static size_t term_y = 0;
@@ -140,6 +141,7 @@ int getchar(void)
 {
     while (!keyboard_available())
     {
+        pmm_zero_idle();
         asm volatile("hlt");
     }
     return keyboard_getchar();
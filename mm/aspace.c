@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Address space implementation
+ * Every space gets its own PML4 whose kernel half is copied from the boot
+ * table. The kernel PDPTs are all created up front so a kernel mapping
+ * made later shows up in every space without touching any PML4.
+ */
+
+#include <thuban/aspace.h>
+#include <thuban/vmm.h>
+#include <thuban/pmm.h>
+#include <thuban/paging.h>
+#include <thuban/slab.h>
+#include <thuban/stdio.h>
+#include <thuban/string.h>
+#include <thuban/filemap.h>
+#include <thuban/percpu.h>
+
+extern uint64_t p4_table;
+
+struct address_space kernel_space;
+
+static struct kmem_cache *aspace_cache = NULL;
+static int pcid_enabled = 0;
+
+static uint64_t pcid_map[PCID_COUNT / 64]; // bit set = tag in use
+static uint8_t pcid_used[PCID_COUNT / 8];  // bit set = tag was handed out before
+
+/*
+ * Read's CR4
+ */
+static inline uint64_t read_cr4(void)
+{
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+/*
+ * Write's CR4
+ */
+static inline void write_cr4(uint64_t cr4)
+{
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+/*
+ * Allocate's a PCID, 0 when every tag is taken
+ * NOTE: A tag handed out before may still tag the old owner's translations,
+ * stale tells the caller to flush on its first load
+ */
+static uint16_t pcid_alloc(uint8_t *stale)
+{
+    for (unsigned int i = 1; i < PCID_COUNT; i++)
+    {
+        if (pcid_map[i / 64] & (1ULL << (i % 64)))
+        {
+            continue;
+        }
+
+        pcid_map[i / 64] |= 1ULL << (i % 64);
+        *stale = (pcid_used[i / 8] >> (i % 8)) & 1;
+        pcid_used[i / 8] |= 1 << (i % 8);
+        return (uint16_t)i;
+    }
+
+    *stale = 1;
+    return 0;
+}
+
+/*
+ * Free's a PCID
+ */
+static void pcid_free(uint16_t pcid)
+{
+    if (pcid)
+    {
+        pcid_map[pcid / 64] &= ~(1ULL << (pcid % 64));
+    }
+}
+
+/*
+ * Set's up the executing CPU's paging features
+ * NOTE: Application processors run this too, so it must not allocate
+ */
+void aspace_cpu_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+
+    // global kernel pages survive CR3 loads, invlpg still drops them
+    if ((edx >> 13) & 1)
+    {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+
+    // supervisor writes must fault on read-only pages too, or the kernel
+    // would write straight through a copy-on-write mapping
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_WP) : "memory");
+
+    // the boot CR3 has PCID 0 in its low bits, which PCIDE requires
+    if ((ecx >> 17) & 1)
+    {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = 1;
+    }
+}
+
+/*
+ * Initialize's the kernel address space
+ */
+void aspace_init(void)
+{
+    uint64_t *pml4 = &p4_table;
+
+    aspace_cpu_init();
+
+    for (int i = PML4_KERNEL_START; i < 512; i++)
+    {
+        if (pml4[i] & PAGING_PRESENT)
+        {
+            continue;
+        }
+
+        void *pdpt = pmm_alloc_flags(PMM_ZERO);
+
+        if (!pdpt)
+        {
+            printf("[ASPACE] Out of memory for kernel PDPTs\n");
+            break;
+        }
+
+        pml4[i] = (uint64_t)pdpt | PAGING_PRESENT | PAGING_WRITE;
+    }
+
+    kernel_space.pml4 = pml4;
+    kernel_space.pml4_phys = virt_to_phys(pml4);
+    kernel_space.pcid = 0;
+    kernel_space.stale = 0;
+    kernel_space.regions = NULL;
+
+    aspace_cache = kmem_cache_create("address_space", sizeof(struct address_space), 0, 0, NULL);
+
+    if (va_space_init(&kernel_space.user_va, "kernel_user_va", USER_ALLOC_START, USER_ALLOC_END) != 0)
+    {
+        printf("[ASPACE] Failed to set up the kernel space\n");
+    }
+
+    printf("[ASPACE] PCID %s, global pages %s\n", pcid_enabled ? "on" : "off",
+           (read_cr4() & CR4_PGE) ? "on" : "off");
+}
+
+/*
+ * Create's an empty user address space
+ */
+struct address_space *aspace_create(void)
+{
+    struct address_space *as = kmem_cache_alloc(aspace_cache);
+
+    if (!as)
+    {
+        return NULL;
+    }
+
+    void *phys = pmm_alloc_flags(PMM_ZERO);
+
+    if (!phys)
+    {
+        kmem_cache_free(aspace_cache, as);
+        return NULL;
+    }
+
+    if (va_space_init(&as->user_va, "user_va", USER_ALLOC_START, USER_ALLOC_END) != 0)
+    {
+        pmm_free(phys);
+        kmem_cache_free(aspace_cache, as);
+        return NULL;
+    }
+
+    as->pml4 = (uint64_t *)phys_to_virt((uint64_t)phys);
+    as->pml4_phys = (uint64_t)phys;
+    as->regions = NULL;
+
+    memcpy(&as->pml4[PML4_KERNEL_START], &kernel_space.pml4[PML4_KERNEL_START],
+           (512 - PML4_KERNEL_START) * sizeof(uint64_t));
+
+    as->pcid = pcid_enabled ? pcid_alloc(&as->stale) : 0;
+
+    return as;
+}
+
+/*
+ * Fork's an address space
+ * NOTE: Only page tables are copied, every frame is shared copy-on-write
+ * until one side writes to it
+ */
+struct address_space *aspace_fork(struct address_space *src)
+{
+    struct address_space *as = aspace_create();
+
+    if (!as)
+    {
+        return NULL;
+    }
+
+    if (va_space_copy(&as->user_va, &src->user_va) != 0 || vmm_clone_user(as, src) != 0)
+    {
+        aspace_destroy(as);
+        return NULL;
+    }
+
+    return as;
+}
+
+/*
+ * Free's a user table and everything below it
+ * NOTE: Each leaf drops its reference on the frame, so frames still shared
+ * copy-on-write stay with the other spaces. Huge leaves free their whole run.
+ */
+static void free_table(uint64_t *table, int level)
+{
+    for (int i = 0; i < 512; i++)
+    {
+        uint64_t entry = table[i];
+
+        if (!(entry & PAGING_PRESENT))
+        {
+            continue;
+        }
+
+        uint64_t phys = entry & PAGING_ADDR_MASK & ~(pt_level_size(level) - 1);
+
+        if (level == PT_LEVEL_PTE)
+        {
+            filemap_dirty_pte(entry);
+            pmm_free((void *)phys);
+        }
+        else if (entry & PAGING_HUGE)
+        {
+            pmm_free_pages((void *)phys, pt_level_size(level) / PAGE_SIZE);
+        }
+        else
+        {
+            free_table((uint64_t *)phys_to_virt(phys), level - 1);
+        }
+    }
+
+    pmm_free((void *)virt_to_phys(table));
+}
+
+/*
+ * Destroy's a user address space
+ */
+void aspace_destroy(struct address_space *as)
+{
+    if (!as || as == &kernel_space)
+    {
+        return;
+    }
+
+    if (as == this_cpu_read(current_space))
+    {
+        aspace_switch(&kernel_space);
+    }
+
+    for (int i = 0; i < PML4_KERNEL_START; i++)
+    {
+        if (as->pml4[i] & PAGING_PRESENT)
+        {
+            free_table((uint64_t *)phys_to_virt(as->pml4[i] & PAGING_ADDR_MASK), PT_LEVEL_PDPTE);
+        }
+    }
+
+    // after the tables, so mapped file pages are marked dirty before write back
+    vmm_drop_regions(as);
+
+    va_space_destroy(&as->user_va);
+    pcid_free(as->pcid);
+    pmm_free((void *)as->pml4_phys);
+    kmem_cache_free(aspace_cache, as);
+}
+
+/*
+ * Switch's to an address space
+ * NOTE: With PCID the new space's translations are kept across the switch
+ * unless its tag may still hold someone else's
+ */
+void aspace_switch(struct address_space *as)
+{
+    if (as == this_cpu_read(current_space))
+    {
+        return;
+    }
+
+    uint64_t cr3 = as->pml4_phys;
+
+    if (pcid_enabled)
+    {
+        cr3 |= as->pcid;
+
+        if (as->pcid && !as->stale)
+        {
+            cr3 |= CR3_NOFLUSH;
+        }
+
+        as->stale = 0;
+    }
+
+    this_cpu_write(current_space, as);
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+/*
+ * Get's the current address space
+ */
+struct address_space *aspace_current(void)
+{
+    return this_cpu_read(current_space);
+}
+
+/*
+ * Check's if CR3 switches are PCID tagged
+ */
+int aspace_pcid_enabled(void)
+{
+    return pcid_enabled;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Page cache implementation
+ * Each mapped file has one vm_file whose pages sit in a hash keyed by
+ * (file, index). Mappings take page references on cached frames, the
+ * cache keeps its own until the last mapping of the file goes away.
+ * Dirty pages are found through the page table dirty bit when a mapping
+ * is synced or torn down and written back through the file's fops.
+ */
+
+#include <thuban/filemap.h>
+#include <thuban/page.h>
+#include <thuban/paging.h>
+#include <thuban/slab.h>
+#include <thuban/spinlock.h>
+#include <thuban/stdio.h>
+
+struct filemap_page
+{
+    struct vm_file *vmf;
+    uint64_t index;
+    uint64_t phys;
+    struct filemap_page *hnext; // hash bucket chain
+    struct filemap_page *fnext; // the file's page list
+};
+
+static struct filemap_page *buckets[FILEMAP_BUCKETS];
+static struct vm_file *vm_files = NULL;
+
+static struct kmem_cache *filemap_page_cache = NULL;
+static struct kmem_cache *vm_file_cache = NULL;
+
+static spinlock_t filemap_lock = SPINLOCK_INIT_NAMED("filemap");
+
+/*
+ * Hash's a (file, index) pair to a bucket
+ */
+static inline unsigned int filemap_hash(struct vm_file *vmf, uint64_t index)
+{
+    return (unsigned int)((((uint64_t)vmf >> 6) ^ ((index * 0x9E3779B97F4A7C15ULL) >> 32)) % FILEMAP_BUCKETS);
+}
+
+/*
+ * Find's a cached page
+ * NOTE: Must be called with filemap_lock held
+ */
+static struct filemap_page *filemap_find(struct vm_file *vmf, uint64_t index)
+{
+    for (struct filemap_page *p = buckets[filemap_hash(vmf, index)]; p; p = p->hnext)
+    {
+        if (p->vmf == vmf && p->index == index)
+        {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Initialize's the page cache
+ */
+void filemap_init(void)
+{
+    spin_lock_init(&filemap_lock, "filemap");
+
+    for (int i = 0; i < FILEMAP_BUCKETS; i++)
+    {
+        buckets[i] = NULL;
+    }
+
+    filemap_page_cache = kmem_cache_create("filemap_page", sizeof(struct filemap_page), 0, 0, NULL);
+    vm_file_cache = kmem_cache_create("vm_file", sizeof(struct vm_file), 0, 0, NULL);
+}
+
+/*
+ * Get's the page cache of an open file
+ * NOTE: Files are told apart by superblock and inode. FAT32 uses the first
+ * cluster as the inode, so an empty file (inode 0) gets a cache of its own.
+ */
+struct vm_file *filemap_open(int fd)
+{
+    vfs_file_t *file = vfs_file_get(fd);
+
+    if (!file)
+    {
+        return NULL;
+    }
+
+    vfs_node_t *node = file->node;
+
+    spin_lock(&filemap_lock);
+
+    for (struct vm_file *vmf = vm_files; vmf && node->inode; vmf = vmf->next)
+    {
+        if (vmf->sb == node->sb && vmf->inode == node->inode)
+        {
+            vmf->refcount++;
+            spin_unlock(&filemap_lock);
+            vfs_file_put(file);
+            return vmf;
+        }
+    }
+
+    struct vm_file *vmf = kmem_cache_alloc(vm_file_cache);
+
+    if (!vmf)
+    {
+        spin_unlock(&filemap_lock);
+        vfs_file_put(file);
+        return NULL;
+    }
+
+    vmf->sb = node->sb;
+    vmf->inode = node->inode;
+    vmf->file = file;
+    vmf->refcount = 1;
+    vmf->nr_pages = 0;
+    vmf->pages = NULL;
+    vmf->next = vm_files;
+    vm_files = vmf;
+
+    spin_unlock(&filemap_lock);
+    return vmf;
+}
+
+/*
+ * Take's another reference on a page cache
+ */
+void filemap_get(struct vm_file *vmf)
+{
+    spin_lock(&filemap_lock);
+    vmf->refcount++;
+    spin_unlock(&filemap_lock);
+}
+
+/*
+ * Drop's a reference on a page cache
+ * NOTE: The last one writes back every dirty page and releases the cache's
+ * reference on each frame, mappings still holding one keep theirs
+ */
+void filemap_put(struct vm_file *vmf)
+{
+    spin_lock(&filemap_lock);
+
+    if (--vmf->refcount)
+    {
+        spin_unlock(&filemap_lock);
+        return;
+    }
+
+    for (struct vm_file **link = &vm_files; *link; link = &(*link)->next)
+    {
+        if (*link == vmf)
+        {
+            *link = vmf->next;
+            break;
+        }
+    }
+
+    spin_unlock(&filemap_lock);
+
+    filemap_sync(vmf, 0, (uint64_t)-1);
+
+    spin_lock(&filemap_lock);
+
+    while (vmf->pages)
+    {
+        struct filemap_page *p = vmf->pages;
+        struct filemap_page **link = &buckets[filemap_hash(vmf, p->index)];
+
+        while (*link != p)
+        {
+            link = &(*link)->hnext;
+        }
+
+        *link = p->hnext;
+        vmf->pages = p->fnext;
+
+        struct page *page = phys_to_page(p->phys);
+        page->owner = NULL;
+        put_page(page);
+
+        kmem_cache_free(filemap_page_cache, p);
+    }
+
+    spin_unlock(&filemap_lock);
+
+    vfs_file_put(vmf->file);
+    kmem_cache_free(vm_file_cache, vmf);
+}
+
+/*
+ * Get's the frame caching a page of a file
+ * NOTE: The caller gets a page reference of its own. A miss reads the page
+ * without the lock held, so a racing reader's copy may win and ours goes.
+ * The tail past end of file reads as zeroes.
+ */
+uint64_t filemap_get_page(struct vm_file *vmf, uint64_t index)
+{
+    spin_lock(&filemap_lock);
+
+    struct filemap_page *p = filemap_find(vmf, index);
+
+    if (p)
+    {
+        get_page(phys_to_page(p->phys));
+        spin_unlock(&filemap_lock);
+        return p->phys;
+    }
+
+    spin_unlock(&filemap_lock);
+
+    vfs_file_t *file = vmf->file;
+    void *frame = pmm_alloc_flags(PMM_ZERO);
+
+    if (!frame)
+    {
+        return 0;
+    }
+
+    if (!file->node->fops || !file->node->fops->read ||
+        file->node->fops->read(file, phys_to_virt((uint64_t)frame), PAGE_SIZE, (off_t)(index * PAGE_SIZE)) < 0)
+    {
+        printf("[FILEMAP] Failed to read page %llu of %s\n", index, file->node->name);
+        pmm_free(frame);
+        return 0;
+    }
+
+    spin_lock(&filemap_lock);
+
+    p = filemap_find(vmf, index);
+
+    if (p)
+    {
+        get_page(phys_to_page(p->phys));
+        spin_unlock(&filemap_lock);
+        pmm_free(frame);
+        return p->phys;
+    }
+
+    p = kmem_cache_alloc(filemap_page_cache);
+
+    if (!p)
+    {
+        spin_unlock(&filemap_lock);
+        pmm_free(frame);
+        return 0;
+    }
+
+    unsigned int bucket = filemap_hash(vmf, index);
+
+    p->vmf = vmf;
+    p->index = index;
+    p->phys = (uint64_t)frame;
+    p->hnext = buckets[bucket];
+    p->fnext = vmf->pages;
+    buckets[bucket] = p;
+    vmf->pages = p;
+    vmf->nr_pages++;
+
+    // the allocation's reference is the cache's, this one is the caller's
+    struct page *page = phys_to_page(p->phys);
+    page->owner = vmf;
+    get_page(page);
+
+    spin_unlock(&filemap_lock);
+    return p->phys;
+}
+
+/*
+ * Write's back dirty pages in an index range
+ * NOTE: Writes never run past the file's size, so a mapping can't grow it
+ */
+int filemap_sync(struct vm_file *vmf, uint64_t first, uint64_t last)
+{
+    vfs_file_t *file = vmf->file;
+    int ret = 0;
+
+    if (!file->node->fops || !file->node->fops->write)
+    {
+        return -1;
+    }
+
+    spin_lock(&filemap_lock);
+
+    for (struct filemap_page *p = vmf->pages; p; p = p->fnext)
+    {
+        struct page *page = phys_to_page(p->phys);
+
+        if (p->index < first || p->index > last || !(page->flags & PG_DIRTY))
+        {
+            continue;
+        }
+
+        uint64_t offset = p->index * PAGE_SIZE;
+
+        page->flags &= ~PG_DIRTY;
+
+        if (offset >= file->node->size)
+        {
+            continue;
+        }
+
+        size_t len = file->node->size - offset < PAGE_SIZE ? file->node->size - offset : PAGE_SIZE;
+
+        // p stays on the list while the caller holds its reference on vmf
+        spin_unlock(&filemap_lock);
+        ssize_t n = file->node->fops->write(file, phys_to_virt(p->phys), len, (off_t)offset);
+        spin_lock(&filemap_lock);
+
+        if (n != (ssize_t)len)
+        {
+            page->flags |= PG_DIRTY;
+            ret = -1;
+        }
+    }
+
+    spin_unlock(&filemap_lock);
+    return ret;
+}
+
+/*
+ * Carry's a page table dirty bit over to the cached frame it maps
+ */
+void filemap_dirty_pte(uint64_t entry)
+{
+    if (!(entry & PAGING_PRESENT) || !(entry & PAGING_DIRTY))
+    {
+        return;
+    }
+
+    uint64_t pfn = (entry & PAGING_ADDR_MASK) / PAGE_SIZE;
+
+    if (!pfn_valid(pfn))
+    {
+        return;
+    }
+
+    struct page *page = pfn_to_page(pfn);
+
+    if (page->owner && !(page->flags & PG_SLAB))
+    {
+        page->flags |= PG_DIRTY;
+    }
+}
@@ -2,50 +2,304 @@
  * Copyright (c) 2026 Trollycat
  * Dynamic heap implementation
  * Starts with static heap then expands dynamically using VMM
+ * Free blocks are kept in size-class bins and carry boundary tags
  */
 
 #include <thuban/heap.h>
 #include <thuban/vmm.h>
+#include <thuban/slab.h>
 #include <thuban/stdio.h>
 #include <thuban/string.h>
 #include <thuban/spinlock.h>
 
 #define HEAP_MAGIC 0x48454150          // "HEAP"
 #define INITIAL_HEAP_SIZE (256 * 1024) // 256KB initial
+#define HEAP_ALIGN 16
+#define HEAP_MIN_EXPAND_PAGES 16 // grow by at least 64KB so small requests don't make tiny regions
+#define HEAP_LARGE_MIN (32 * 1024) // requests this big skip the bins and go to vmalloc
 
-typedef struct heap_block
+/*
+ * Trimming starts once free heap memory passes the high-water mark and
+ * stops at the low-water mark, the gap keeps a free/malloc cycle from
+ * shrinking and regrowing the heap every time
+ */
+#ifndef CONFIG_HEAP_TRIM_HIGH_KB
+#define CONFIG_HEAP_TRIM_HIGH_KB 1024
+#endif
+
+#ifndef CONFIG_HEAP_TRIM_LOW_KB
+#define CONFIG_HEAP_TRIM_LOW_KB 256
+#endif
+
+#define HEAP_TRIM_HIGH ((size_t)CONFIG_HEAP_TRIM_HIGH_KB * 1024)
+#define HEAP_TRIM_LOW ((size_t)CONFIG_HEAP_TRIM_LOW_KB * 1024)
+
+#define NR_SMALL_BINS 32                       // exact classes 16, 32, ... 512 bytes
+#define SMALL_BIN_MAX (NR_SMALL_BINS * HEAP_ALIGN)
+#define NR_BINS 64                             // then one class per power of two
+
+/*
+ * Boundary tag, placed both before and after every block's payload
+ * The copy after the payload lets free() find and merge the block to its left.
+ */
+typedef struct heap_tag
 {
     uint32_t magic;
-    size_t size;
-    int free;
-    struct heap_block *next;
-    struct heap_block *prev;
-} heap_block_t;
+    uint32_t free;
+    size_t size; // payload bytes
+} heap_tag_t;
+
+/* Free block, its list links live in the otherwise unused payload */
+typedef struct heap_free
+{
+    heap_tag_t tag;
+    struct heap_free *next;
+    struct heap_free *prev;
+} heap_free_t;
+
+/*
+ * Contiguous stretch of heap memory
+ * Laid out as [region][prologue tag][blocks...][epilogue tag], the two
+ * fence tags are never free so merging stops at the region edges.
+ */
+typedef struct heap_region
+{
+    struct heap_region *next;
+    size_t pages; // 0 for the static initial region
+} heap_region_t;
+
+#define TAG_SIZE sizeof(heap_tag_t)
+#define BLOCK_OVERHEAD (2 * TAG_SIZE)
+#define MIN_PAYLOAD (sizeof(heap_free_t) - TAG_SIZE)
+#define REGION_OVERHEAD (sizeof(heap_region_t) + 2 * TAG_SIZE)
 
 static uint8_t initial_heap[INITIAL_HEAP_SIZE] __attribute__((aligned(16)));
-static heap_block_t *heap_start = NULL;
+static heap_region_t *heap_regions = NULL;
+static heap_free_t *bins[NR_BINS];
+static uint64_t bin_map = 0; // bit set for every non-empty bin
 static size_t total_heap_size = 0;
 static size_t used_heap_size = 0;
+static uint64_t realloc_in_place = 0;
+static uint64_t realloc_copied = 0;
 
 /* Spinlock to protect heap operations */
 static spinlock_t heap_lock = SPINLOCK_INIT_NAMED("heap");
 
+/*
+ * Get's the tag after a block's payload
+ */
+static inline heap_tag_t *block_footer(heap_tag_t *block)
+{
+    return (heap_tag_t *)((uint8_t *)block + TAG_SIZE + block->size);
+}
+
+/*
+ * Get's the block to the right of a block
+ */
+static inline heap_tag_t *block_next(heap_tag_t *block)
+{
+    return (heap_tag_t *)((uint8_t *)block + BLOCK_OVERHEAD + block->size);
+}
+
+/*
+ * Get's the block to the left of a block, found through its footer
+ */
+static inline heap_tag_t *block_prev(heap_tag_t *block)
+{
+    heap_tag_t *footer = block - 1;
+    return (heap_tag_t *)((uint8_t *)footer - footer->size - TAG_SIZE);
+}
+
+/*
+ * Write's matching header and footer tags
+ */
+static inline void block_set(heap_tag_t *block, size_t size, int free)
+{
+    block->magic = HEAP_MAGIC;
+    block->free = free;
+    block->size = size;
+
+    heap_tag_t *footer = block_footer(block);
+    footer->magic = HEAP_MAGIC;
+    footer->free = free;
+    footer->size = size;
+}
+
+/*
+ * Get's the bin for a payload size
+ */
+static inline unsigned int size_to_bin(size_t size)
+{
+    if (size <= SMALL_BIN_MAX)
+    {
+        return size / HEAP_ALIGN - 1;
+    }
+
+    // 513..1023 lands in the first large bin, each following bin doubles
+    unsigned int bin = NR_SMALL_BINS + (63 - __builtin_clzll(size)) - 9;
+    return bin < NR_BINS ? bin : NR_BINS - 1;
+}
+
+/*
+ * Push's a free block onto its bin
+ * NOTE: Must be called with heap_lock held
+ */
+static void bin_insert(heap_free_t *block)
+{
+    unsigned int bin = size_to_bin(block->tag.size);
+
+    block->prev = NULL;
+    block->next = bins[bin];
+
+    if (bins[bin])
+    {
+        bins[bin]->prev = block;
+    }
+
+    bins[bin] = block;
+    bin_map |= 1ULL << bin;
+}
+
+/*
+ * Unlink's a free block from its bin
+ * NOTE: Must be called with heap_lock held
+ */
+static void bin_remove(heap_free_t *block)
+{
+    unsigned int bin = size_to_bin(block->tag.size);
+
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        bins[bin] = block->next;
+    }
+
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+
+    if (!bins[bin])
+    {
+        bin_map &= ~(1ULL << bin);
+    }
+}
+
+/*
+ * Find's a free block with at least size bytes of payload
+ * NOTE: Must be called with heap_lock held
+ */
+static heap_free_t *bin_find(size_t size)
+{
+    unsigned int bin = size_to_bin(size);
+
+    // small bins hold one exact size, large bins a range that may not all fit
+    if (bin >= NR_SMALL_BINS)
+    {
+        for (heap_free_t *block = bins[bin]; block; block = block->next)
+        {
+            if (block->tag.size >= size)
+            {
+                return block;
+            }
+        }
+
+        bin++;
+    }
+
+    // every block in a higher bin is big enough
+    uint64_t candidates = bin < NR_BINS ? bin_map & (~0ULL << bin) : 0;
+
+    if (!candidates)
+    {
+        return NULL;
+    }
+
+    return bins[__builtin_ctzll(candidates)];
+}
+
+/*
+ * Cut's a used block down to size, freeing the tail if it can stand as a block
+ * NOTE: Must be called with heap_lock held
+ */
+static void block_trim(heap_tag_t *block, size_t size)
+{
+    if (block->size < size + BLOCK_OVERHEAD + MIN_PAYLOAD)
+    {
+        return;
+    }
+
+    size_t rest = block->size - size - BLOCK_OVERHEAD;
+
+    used_heap_size -= rest;
+    block_set(block, size, 0);
+
+    heap_tag_t *tail = block_next(block);
+    heap_tag_t *next = (heap_tag_t *)((uint8_t *)tail + BLOCK_OVERHEAD + rest);
+
+    // a shrinking realloc can leave the tail next to a free block
+    if (next->free)
+    {
+        bin_remove((heap_free_t *)next);
+        rest += BLOCK_OVERHEAD + next->size;
+        used_heap_size -= BLOCK_OVERHEAD;
+    }
+
+    block_set(tail, rest, 1);
+    bin_insert((heap_free_t *)tail);
+}
+
+/*
+ * Set's up a region of memory as one free block between fence tags
+ * NOTE: Must be called with heap_lock held
+ */
+static void add_region(void *mem, size_t bytes, size_t pages)
+{
+    heap_region_t *region = (heap_region_t *)mem;
+    region->pages = pages;
+    region->next = heap_regions;
+    heap_regions = region;
+
+    heap_tag_t *prologue = (heap_tag_t *)(region + 1);
+    prologue->magic = HEAP_MAGIC;
+    prologue->free = 0;
+    prologue->size = 0;
+
+    heap_tag_t *block = prologue + 1;
+    block_set(block, bytes - REGION_OVERHEAD - BLOCK_OVERHEAD, 1);
+
+    heap_tag_t *epilogue = block_next(block);
+    epilogue->magic = HEAP_MAGIC;
+    epilogue->free = 0;
+    epilogue->size = 0;
+
+    bin_insert((heap_free_t *)block);
+
+    total_heap_size += bytes;
+    used_heap_size += REGION_OVERHEAD + BLOCK_OVERHEAD;
+}
+
 /*
  * Initialize's the heap
  */
 void heap_init(void)
 {
-    heap_start = (heap_block_t *)initial_heap;
-    heap_start->magic = HEAP_MAGIC;
-    heap_start->size = INITIAL_HEAP_SIZE - sizeof(heap_block_t);
-    heap_start->free = 1;
-    heap_start->next = NULL;
-    heap_start->prev = NULL;
+    spin_lock_init(&heap_lock, "heap");
+
+    for (int i = 0; i < NR_BINS; i++)
+    {
+        bins[i] = NULL;
+    }
 
-    total_heap_size = INITIAL_HEAP_SIZE;
-    used_heap_size = sizeof(heap_block_t);
+    bin_map = 0;
+    heap_regions = NULL;
+    total_heap_size = 0;
+    used_heap_size = 0;
 
-    spin_lock_init(&heap_lock, "heap");
+    add_region(initial_heap, INITIAL_HEAP_SIZE, 0);
 }
 
 /*
@@ -54,60 +308,109 @@ void heap_init(void)
  */
 static int expand_heap(size_t needed_size)
 {
-    size_t pages = (needed_size + sizeof(heap_block_t) + 4095) / 4096;
+    size_t pages = (needed_size + REGION_OVERHEAD + BLOCK_OVERHEAD + 4095) / 4096;
 
-    void *new_mem = vmm_alloc(pages, PAGE_WRITE);
-    if (!new_mem)
+    if (pages < HEAP_MIN_EXPAND_PAGES)
     {
-        return 0;
+        pages = HEAP_MIN_EXPAND_PAGES;
     }
 
-    heap_block_t *new_block = (heap_block_t *)new_mem;
-    new_block->magic = HEAP_MAGIC;
-    new_block->size = (pages * 4096) - sizeof(heap_block_t);
-    new_block->free = 1;
-    new_block->next = NULL;
-    new_block->prev = NULL;
-
-    // add to end of heap list
-    heap_block_t *current = heap_start;
-    while (current->next)
+    // only the region header and epilogue are touched now, the rest faults in as used
+    void *new_mem = vmm_alloc(pages, PAGE_WRITE | VMM_DEMAND);
+    if (!new_mem)
     {
-        current = current->next;
+        return 0;
     }
 
-    current->next = new_block;
-    new_block->prev = current;
-
-    total_heap_size += pages * 4096;
+    add_region(new_mem, pages * 4096, pages);
 
     return 1;
 }
 
 /*
- * Coalesce's adjacent free blocks
+ * Get's the epilogue tag closing a region
+ */
+static inline heap_tag_t *region_epilogue(heap_region_t *region)
+{
+    return (heap_tag_t *)((uint8_t *)region + region->pages * 4096) - 1;
+}
+
+/*
+ * Give's whole free pages at the end of expanded regions back to the VMM
+ * Trims at most down to the low-water mark of free memory.
  * NOTE: Must be called with heap_lock held
  */
-static void coalesce(heap_block_t *block)
+static void heap_trim(void)
 {
-    if (block->next && block->next->free)
+    heap_region_t **link = &heap_regions;
+
+    while (*link && total_heap_size - used_heap_size > HEAP_TRIM_LOW)
     {
-        block->size += sizeof(heap_block_t) + block->next->size;
-        block->next = block->next->next;
-        if (block->next)
+        heap_region_t *region = *link;
+        size_t excess = total_heap_size - used_heap_size - HEAP_TRIM_LOW;
+
+        // the static initial region can't be handed back
+        if (!region->pages)
         {
-            block->next->prev = block;
+            link = &region->next;
+            continue;
         }
-    }
 
-    if (block->prev && block->prev->free)
-    {
-        block->prev->size += sizeof(heap_block_t) + block->size;
-        block->prev->next = block->next;
-        if (block->next)
+        heap_tag_t *epilogue = region_epilogue(region);
+        heap_tag_t *last = block_prev(epilogue);
+
+        if (!last->free)
         {
-            block->next->prev = block->prev;
+            link = &region->next;
+            continue;
         }
+
+        size_t region_bytes = region->pages * 4096;
+
+        // an entirely free region goes back whole when that stays above the low mark
+        if (last == (heap_tag_t *)(region + 1) + 1 && region_bytes - REGION_OVERHEAD - BLOCK_OVERHEAD <= excess)
+        {
+            bin_remove((heap_free_t *)last);
+            *link = region->next;
+
+            total_heap_size -= region_bytes;
+            used_heap_size -= REGION_OVERHEAD + BLOCK_OVERHEAD;
+
+            vmm_free(region, region->pages);
+            continue;
+        }
+
+        // otherwise cut the free tail, keeping the last block and a new epilogue
+        uint64_t keep = (uint64_t)last + BLOCK_OVERHEAD + MIN_PAYLOAD + TAG_SIZE;
+        uint64_t new_end = (keep + 4095) & ~4095ULL;
+        uint64_t old_end = (uint64_t)region + region_bytes;
+        size_t pages = new_end < old_end ? (old_end - new_end) / 4096 : 0;
+
+        if (pages > excess / 4096)
+        {
+            pages = excess / 4096;
+        }
+
+        if (pages)
+        {
+            new_end = old_end - pages * 4096;
+
+            bin_remove((heap_free_t *)last);
+            block_set(last, new_end - TAG_SIZE - (uint64_t)last - BLOCK_OVERHEAD, 1);
+            bin_insert((heap_free_t *)last);
+
+            region->pages -= pages;
+            total_heap_size -= pages * 4096;
+
+            epilogue = region_epilogue(region);
+            epilogue->magic = HEAP_MAGIC;
+            epilogue->free = 0;
+            epilogue->size = 0;
+
+            vmm_free((void *)new_end, pages);
+        }
+
+        link = &region->next;
     }
 }
 
@@ -121,62 +424,47 @@ void *malloc(size_t size)
         return NULL;
     }
 
-    size = (size + 15) & ~15; // align to 16 bytes
+    // large blocks get their own mapping so they never fragment the bins
+    if (size >= HEAP_LARGE_MIN)
+    {
+        return vmalloc(size);
+    }
+
+    size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+
+    if (size < MIN_PAYLOAD)
+    {
+        size = MIN_PAYLOAD;
+    }
 
     spin_lock(&heap_lock);
 
-    heap_block_t *current = heap_start;
+    heap_free_t *block = bin_find(size);
 
-    while (current)
+    if (!block)
     {
-        if (current->magic != HEAP_MAGIC)
+        // no suitable block found expand heap, the new region is one block that fits
+        if (!expand_heap(size))
         {
             spin_unlock(&heap_lock);
-            printf("[HEAP] Corruption detected at 0x%llx\n", (uint64_t)current);
             return NULL;
         }
 
-        if (current->free && current->size >= size)
-        {
-            // split block if there's enough space
-            if (current->size >= size + sizeof(heap_block_t) + 64)
-            {
-                heap_block_t *new_block = (heap_block_t *)((uint8_t *)current + sizeof(heap_block_t) + size);
-                new_block->magic = HEAP_MAGIC;
-                new_block->size = current->size - size - sizeof(heap_block_t);
-                new_block->free = 1;
-                new_block->next = current->next;
-                new_block->prev = current;
-
-                if (current->next)
-                {
-                    current->next->prev = new_block;
-                }
-
-                current->next = new_block;
-                current->size = size;
-            }
+        block = bin_find(size);
+    }
 
-            current->free = 0;
-            used_heap_size += current->size + sizeof(heap_block_t);
+    bin_remove(block);
 
-            void *ptr = (void *)((uint8_t *)current + sizeof(heap_block_t));
-            spin_unlock(&heap_lock);
-            return ptr;
-        }
+    heap_tag_t *tag = &block->tag;
 
-        current = current->next;
-    }
+    block_set(tag, tag->size, 0);
+    used_heap_size += tag->size;
 
-    // no suitable block found expand heap
-    if (!expand_heap(size))
-    {
-        spin_unlock(&heap_lock);
-        return NULL;
-    }
+    block_trim(tag, size);
 
+    void *ptr = (void *)(tag + 1);
     spin_unlock(&heap_lock);
-    return malloc(size);
+    return ptr;
 }
 
 /*
@@ -211,9 +499,52 @@ void *realloc(void *ptr, size_t size)
         return NULL;
     }
 
+    struct kmem_cache *cache = kmem_cache_of(ptr);
+
+    if (cache)
+    {
+        if (kmem_cache_size(cache) >= size)
+        {
+            return ptr;
+        }
+
+        void *new_ptr = malloc(size);
+        if (!new_ptr)
+        {
+            return NULL;
+        }
+
+        memcpy(new_ptr, ptr, kmem_cache_size(cache));
+        kmem_cache_free(cache, ptr);
+
+        return new_ptr;
+    }
+
+    if (is_vmalloc_addr(ptr))
+    {
+        size_t old_size = vmalloc_size(ptr);
+
+        // the tail of the last page is already mapped
+        if (old_size >= size)
+        {
+            return ptr;
+        }
+
+        void *new_ptr = malloc(size);
+        if (!new_ptr)
+        {
+            return NULL;
+        }
+
+        memcpy(new_ptr, ptr, old_size);
+        vfree(ptr);
+
+        return new_ptr;
+    }
+
     spin_lock(&heap_lock);
 
-    heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - sizeof(heap_block_t));
+    heap_tag_t *block = (heap_tag_t *)ptr - 1;
 
     if (block->magic != HEAP_MAGIC)
     {
@@ -221,12 +552,40 @@ void *realloc(void *ptr, size_t size)
         return NULL;
     }
 
-    if (block->size >= size)
+    size_t new_size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+
+    if (new_size < MIN_PAYLOAD)
+    {
+        new_size = MIN_PAYLOAD;
+    }
+
+    // shrink in place, handing the tail back
+    if (block->size >= new_size)
+    {
+        block_trim(block, new_size);
+        realloc_in_place++;
+        spin_unlock(&heap_lock);
+        return ptr;
+    }
+
+    // grow into a free right neighbour
+    heap_tag_t *next = block_next(block);
+
+    if (next->free && block->size + BLOCK_OVERHEAD + next->size >= new_size)
     {
+        bin_remove((heap_free_t *)next);
+        used_heap_size += next->size;
+
+        block_set(block, block->size + BLOCK_OVERHEAD + next->size, 0);
+        block_trim(block, new_size);
+
+        realloc_in_place++;
         spin_unlock(&heap_lock);
         return ptr;
     }
 
+    size_t old_size = block->size;
+    realloc_copied++;
     spin_unlock(&heap_lock);
 
     void *new_ptr = malloc(size);
@@ -235,7 +594,7 @@ void *realloc(void *ptr, size_t size)
         return NULL;
     }
 
-    memcpy(new_ptr, ptr, block->size);
+    memcpy(new_ptr, ptr, old_size);
     free(ptr);
 
     return new_ptr;
@@ -243,6 +602,9 @@ void *realloc(void *ptr, size_t size)
 
 /*
  * Free's allocated memory
+ * NOTE: Slab objects are handed back to their cache and large blocks to
+ * vmalloc, so code that frees objects it didn't allocate (VFS nodes and
+ * fs_data) needn't know which
  */
 void free(void *ptr)
 {
@@ -251,11 +613,25 @@ void free(void *ptr)
         return;
     }
 
+    struct kmem_cache *cache = kmem_cache_of(ptr);
+
+    if (cache)
+    {
+        kmem_cache_free(cache, ptr);
+        return;
+    }
+
+    if (is_vmalloc_addr(ptr))
+    {
+        vfree(ptr);
+        return;
+    }
+
     spin_lock(&heap_lock);
 
-    heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - sizeof(heap_block_t));
+    heap_tag_t *block = (heap_tag_t *)ptr - 1;
 
-    if (block->magic != HEAP_MAGIC)
+    if (block->magic != HEAP_MAGIC || block_footer(block)->magic != HEAP_MAGIC)
     {
         spin_unlock(&heap_lock);
         printf("[HEAP] Invalid free at 0x%llx\n", (uint64_t)ptr);
@@ -269,10 +645,35 @@ void free(void *ptr)
         return;
     }
 
-    block->free = 1;
-    used_heap_size -= block->size + sizeof(heap_block_t);
+    used_heap_size -= block->size;
+    size_t size = block->size;
+
+    // merge with the right neighbour, the epilogue is never free
+    heap_tag_t *next = block_next(block);
+    if (next->free)
+    {
+        bin_remove((heap_free_t *)next);
+        size += BLOCK_OVERHEAD + next->size;
+        used_heap_size -= BLOCK_OVERHEAD;
+    }
+
+    // merge with the left neighbour through its footer, the prologue is never free
+    if ((block - 1)->free)
+    {
+        heap_tag_t *prev = block_prev(block);
+        bin_remove((heap_free_t *)prev);
+        size += BLOCK_OVERHEAD + prev->size;
+        used_heap_size -= BLOCK_OVERHEAD;
+        block = prev;
+    }
+
+    block_set(block, size, 1);
+    bin_insert((heap_free_t *)block);
 
-    coalesce(block);
+    if (total_heap_size - used_heap_size > HEAP_TRIM_HIGH)
+    {
+        heap_trim();
+    }
 
     spin_unlock(&heap_lock);
 }
@@ -308,4 +709,15 @@ uint64_t heap_get_free(void)
     uint64_t free = total_heap_size - used_heap_size;
     spin_unlock(&heap_lock);
     return free;
+}
+
+/*
+ * Get's how many reallocs were served in place versus by copying
+ */
+void heap_get_realloc_stats(uint64_t *in_place, uint64_t *copied)
+{
+    spin_lock(&heap_lock);
+    *in_place = realloc_in_place;
+    *copied = realloc_copied;
+    spin_unlock(&heap_lock);
 }
\ No newline at end of file
@@ -24,6 +24,10 @@ void multiboot_parse(uint32_t magic, void *mbi_ptr)
 
     memset(&mbi_info, 0, sizeof(struct multiboot_info));
 
+    // first field of the fixed header is the total size of all tags
+    mbi_info.mbi_start = (uint64_t)mbi_ptr;
+    mbi_info.mbi_end = mbi_info.mbi_start + *(uint32_t *)mbi_ptr;
+
     struct multiboot_tag *tag = (struct multiboot_tag *)((uint8_t *)mbi_ptr + 8);
 
     while (tag->type != MULTIBOOT_TAG_TYPE_END)
@@ -60,6 +64,26 @@ void multiboot_parse(uint32_t magic, void *mbi_ptr)
                 {
                     mbi_info.available_mem += entry->len;
                 }
+
+                if (mbi_info.region_count < MULTIBOOT_MAX_REGIONS)
+                {
+                    struct multiboot_mem_region *region = &mbi_info.regions[mbi_info.region_count++];
+                    region->base = entry->addr;
+                    region->len = entry->len;
+                    region->type = entry->type;
+                }
+            }
+            break;
+        }
+        case MULTIBOOT_TAG_TYPE_ACPI_OLD:
+        case MULTIBOOT_TAG_TYPE_ACPI_NEW:
+        {
+            struct multiboot_tag_acpi *acpi = (struct multiboot_tag_acpi *)tag;
+
+            // an ACPI 2.0 RSDP reaches the XSDT, keep it over the old one
+            if (!mbi_info.acpi_rsdp || tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW)
+            {
+                mbi_info.acpi_rsdp = acpi->rsdp;
             }
             break;
         }
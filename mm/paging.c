@@ -4,148 +4,509 @@
  */
 
 #include <thuban/paging.h>
+#include <thuban/pmm.h>
+#include <thuban/multiboot.h>
 #include <thuban/stdio.h>
+#include <thuban/string.h>
 
-#define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
+#define PAGE_1G (1ULL << 30)
+#define PAGE_2M (1ULL << 21)
 
 extern uint64_t p4_table;
 
+static uint64_t direct_map_end = 0;
+static uint64_t direct_map_size = 0; // bytes of RAM mapped, holes excluded
+static struct multiboot_info *direct_map_mbi = NULL;
+
 /*
- * Initialize's paging system
- * NOTE: Paging is already set up by boot.s so this just confirms it
+ * Check's if the CPU can map 1GB pages
  */
-void paging_init(void)
+static int cpu_has_1g_pages(void)
 {
+    uint32_t eax, ebx, ecx, edx;
+
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+
+    if (eax < 0x80000001)
+    {
+        return 0;
+    }
+
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001));
+
+    return (edx >> 26) & 1;
 }
 
 /*
- * Map's a virtual page to physical page
+ * Allocate's a cleared table for the direct map
+ * NOTE: The direct map doesn't exist yet so tables come from the boot-mapped low zone
  */
-void paging_map(uint64_t virt, uint64_t phys, uint64_t flags)
+static uint64_t *direct_map_table(void)
 {
-    uint64_t *pml4 = &p4_table;
+    void *phys = pmm_alloc_flags(PMM_LOW);
 
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx = (virt >> 12) & 0x1FF;
+    if (!phys)
+    {
+        return NULL;
+    }
+
+    uint64_t *table = (uint64_t *)((uint64_t)phys + KERNEL_VIRT_BASE);
+    memset(table, 0, PAGE_SIZE);
+    return table;
+}
 
-    // ensure all levels exist
-    if (!(pml4[pml4_idx] & PAGING_PRESENT))
+/*
+ * Get's the table an entry of the direct map points to
+ * NOTE: Every direct map table comes from the low zone, so the boot map reaches it
+ */
+static uint64_t *direct_map_next(uint64_t *entry)
+{
+    if (*entry & PAGING_PRESENT)
     {
-        return; // should use vmm for allocation
+        return (uint64_t *)((*entry & PAGING_ADDR_MASK) + KERNEL_VIRT_BASE);
     }
 
-    uint64_t *pdpt = (uint64_t *)((pml4[pml4_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    uint64_t *table = direct_map_table();
 
-    if (!(pdpt[pdpt_idx] & PAGING_PRESENT))
+    if (table)
     {
-        return;
+        *entry = ((uint64_t)table - KERNEL_VIRT_BASE) | PAGING_PRESENT | PAGING_WRITE;
     }
 
-    uint64_t *pd = (uint64_t *)((pdpt[pdpt_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    return table;
+}
 
-    if (!(pd[pd_idx] & PAGING_PRESENT))
+/*
+ * Map's one page of the direct map, 4KB, 2MB or 1GB by size
+ */
+static int direct_map_page(uint64_t *pml4, uint64_t phys, uint64_t size)
+{
+    uint64_t virt = DIRECT_MAP_BASE + phys;
+    uint64_t *pdpt = direct_map_next(&pml4[(virt >> 39) & 0x1FF]);
+
+    if (!pdpt)
     {
-        return;
+        return -1;
     }
 
-    uint64_t *pt = (uint64_t *)((pd[pd_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    uint64_t *pdpte = &pdpt[(virt >> 30) & 0x1FF];
 
-    pt[pt_idx] = (phys & ~0xFFF) | flags | PAGING_PRESENT;
+    if (size == PAGE_1G)
+    {
+        *pdpte = phys | PAGING_PRESENT | PAGING_WRITE | PAGING_HUGE;
+        return 0;
+    }
 
-    paging_invalidate(virt);
+    uint64_t *pd = direct_map_next(pdpte);
+
+    if (!pd)
+    {
+        return -1;
+    }
+
+    uint64_t *pde = &pd[(virt >> 21) & 0x1FF];
+
+    if (size == PAGE_2M)
+    {
+        *pde = phys | PAGING_PRESENT | PAGING_WRITE | PAGING_HUGE;
+        return 0;
+    }
+
+    uint64_t *pt = direct_map_next(pde);
+
+    if (!pt)
+    {
+        return -1;
+    }
+
+    pt[(virt >> 12) & 0x1FF] = phys | PAGING_PRESENT | PAGING_WRITE;
+    return 0;
 }
 
 /*
- * Unmap's a virtual page
+ * Check's if a memory map range is RAM the direct map should cover
+ * NOTE: Reserved ranges and the holes between regions may be device
+ * memory, mapping them write-back would let the CPU speculate into it
  */
-void paging_unmap(uint64_t virt)
+static int direct_map_wanted(uint32_t type)
+{
+    return type == MULTIBOOT_MEMORY_AVAILABLE || type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE ||
+           type == MULTIBOOT_MEMORY_NVS;
+}
+
+/*
+ * Map's a physical range into the direct map
+ * NOTE: A page is as large as the range around it allows, so holes and
+ * region edges fall back to 2MB and 4KB pages
+ */
+static int direct_map_range(uint64_t *pml4, uint64_t base, uint64_t len, int huge_1g)
+{
+    uint64_t phys = (base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint64_t end = (base + len) & ~(PAGE_SIZE - 1);
+
+    if (end > DIRECT_MAP_SIZE)
+    {
+        end = DIRECT_MAP_SIZE;
+    }
+
+    while (phys < end)
+    {
+        uint64_t size = PAGE_SIZE;
+
+        if (huge_1g && !(phys & (PAGE_1G - 1)) && end - phys >= PAGE_1G)
+        {
+            size = PAGE_1G;
+        }
+        else if (!(phys & (PAGE_2M - 1)) && end - phys >= PAGE_2M)
+        {
+            size = PAGE_2M;
+        }
+
+        if (direct_map_page(pml4, phys, size) != 0)
+        {
+            return -1;
+        }
+
+        phys += size;
+        direct_map_size += size;
+
+        if (phys > direct_map_end)
+        {
+            direct_map_end = phys;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Initialize's paging system
+ * NOTE: boot.s only maps the first 1GB, this maps the RAM ranges of the
+ * memory map at DIRECT_MAP_BASE. Without a memory map everything below
+ * the PMM's highest frame is taken to be RAM
+ */
+void paging_init(struct multiboot_info *mbi)
 {
     uint64_t *pml4 = &p4_table;
+    int huge_1g = cpu_has_1g_pages();
+    int ret = 0;
 
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx = (virt >> 12) & 0x1FF;
+    direct_map_mbi = mbi;
 
-    if (!(pml4[pml4_idx] & PAGING_PRESENT))
+    if (mbi->region_count == 0)
     {
-        return;
+        ret = direct_map_range(pml4, 0, pmm_get_max_phys(), huge_1g);
     }
 
-    uint64_t *pdpt = (uint64_t *)((pml4[pml4_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    for (uint32_t i = 0; i < mbi->region_count && ret == 0; i++)
+    {
+        struct multiboot_mem_region *region = &mbi->regions[i];
+
+        if (direct_map_wanted(region->type))
+        {
+            ret = direct_map_range(pml4, region->base, region->len, huge_1g);
+        }
+    }
 
-    if (!(pdpt[pdpt_idx] & PAGING_PRESENT))
+    if (ret != 0)
     {
-        return;
+        printf("[PAGING] Out of memory for direct map tables\n");
     }
 
-    uint64_t *pd = (uint64_t *)((pdpt[pdpt_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    printf("[PAGING] Direct map covers %llu MB of RAM up to 0x%llx, %s pages at most\n",
+           direct_map_size / (1024 * 1024), direct_map_end, huge_1g ? "1GB" : "2MB");
+}
 
-    if (!(pd[pd_idx] & PAGING_PRESENT))
+/*
+ * Check's if a physical range is RAM the direct map covers
+ */
+int paging_is_direct_mapped(uint64_t phys, uint64_t len)
+{
+    if (!direct_map_mbi || direct_map_mbi->region_count == 0)
     {
-        return;
+        return phys + len <= direct_map_end;
     }
 
-    uint64_t *pt = (uint64_t *)((pd[pd_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    for (uint32_t i = 0; i < direct_map_mbi->region_count; i++)
+    {
+        struct multiboot_mem_region *region = &direct_map_mbi->regions[i];
+
+        // direct_map_range only maps the whole pages of a region
+        uint64_t start = (region->base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        uint64_t end = (region->base + region->len) & ~(PAGE_SIZE - 1);
 
-    pt[pt_idx] = 0;
+        if (end > DIRECT_MAP_SIZE)
+        {
+            end = DIRECT_MAP_SIZE;
+        }
 
-    paging_invalidate(virt);
+        if (direct_map_wanted(region->type) && phys >= start && phys + len <= end)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 /*
- * Get's physical address from virtual
+ * Get's the end of the direct map
  */
-uint64_t paging_get_phys(uint64_t virt)
+uint64_t paging_direct_map_end(void)
 {
-    uint64_t *pml4 = &p4_table;
+    return direct_map_end;
+}
 
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx = (virt >> 12) & 0x1FF;
+/*
+ * Get's the table an entry points to
+ * NOTE: A missing table is allocated zeroed when the walk may create,
+ * tables in the user half are user accessible so the leaf alone decides
+ */
+static uint64_t *pt_next(uint64_t *entry, uint64_t virt, unsigned int flags)
+{
+    if (!(*entry & PAGING_PRESENT))
+    {
+        if (!(flags & PT_WALK_CREATE))
+        {
+            return NULL;
+        }
 
-    if (!(pml4[pml4_idx] & PAGING_PRESENT))
+        void *page = pmm_alloc_flags(PMM_ZERO);
+
+        if (!page)
+        {
+            return NULL;
+        }
+
+        *entry = (uint64_t)page | PAGING_PRESENT | PAGING_WRITE | (is_user_addr(virt) ? PAGING_USER : 0);
+    }
+
+    return (uint64_t *)phys_to_virt(*entry & PAGING_ADDR_MASK);
+}
+
+/*
+ * Split's a huge leaf into a table of 512 entries one level down
+ * NOTE: The frames stay where they are and the translations are the same,
+ * so a stale huge TLB entry is still correct until flushed
+ */
+static int pt_split(uint64_t *entry, uint64_t virt, int level)
+{
+    uint64_t *phys = pmm_alloc_flags(PMM_ZERO);
+
+    if (!phys)
     {
-        return 0;
+        return -1;
     }
 
-    uint64_t *pdpt = (uint64_t *)((pml4[pml4_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    uint64_t *table = (uint64_t *)phys_to_virt((uint64_t)phys);
+    uint64_t step = pt_level_size(level - 1);
+    uint64_t base = *entry & PAGING_ADDR_MASK & ~(pt_level_size(level) - 1);
+    uint64_t flags = *entry & (0xFFF | PAGING_NX);
 
-    if (!(pdpt[pdpt_idx] & PAGING_PRESENT))
+    // a 1GB leaf becomes 2MB leaves, a 2MB leaf becomes plain PTEs
+    if (level - 1 == PT_LEVEL_PTE)
     {
-        return 0;
+        flags &= ~PAGING_HUGE;
     }
 
-    // check for 1GB page
-    if (pdpt[pdpt_idx] & PAGING_HUGE)
+    for (int i = 0; i < 512; i++)
     {
-        return (pdpt[pdpt_idx] & ~0x3FFFFFFF) | (virt & 0x3FFFFFFF);
+        table[i] = (base + i * step) | flags;
     }
 
-    uint64_t *pd = (uint64_t *)((pdpt[pdpt_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    *entry = (uint64_t)phys | PAGING_PRESENT | PAGING_WRITE | (is_user_addr(virt) ? PAGING_USER : 0);
+    return 0;
+}
 
-    if (!(pd[pd_idx] & PAGING_PRESENT))
+/*
+ * Report's the level a walk stopped at
+ */
+static inline uint64_t *pt_leaf(uint64_t *entry, int level, int *leaf)
+{
+    if (leaf)
     {
-        return 0;
+        *leaf = level;
     }
 
-    // check for 2MB page (like our boot mapping)
-    if (pd[pd_idx] & PAGING_HUGE)
+    return entry;
+}
+
+/*
+ * Start's a walk of the tables under a PML4
+ */
+void pt_walk_init(struct pt_walk *walk, uint64_t *pml4)
+{
+    walk->pml4 = pml4;
+    walk->pdpt = NULL;
+    walk->pdpt_base = 0;
+    walk->pd = NULL;
+    walk->pd_base = 0;
+}
+
+/*
+ * Get's the entry mapping virt at a level
+ * NOTE: A huge leaf above the level is returned as is unless the walk may
+ * split, leaf says which level the entry is at. NULL means a table is
+ * missing (and wasn't created) or couldn't be allocated. Callers serialise
+ * changes to the tables themselves.
+ */
+uint64_t *pt_walk(struct pt_walk *walk, uint64_t virt, int level, unsigned int flags, int *leaf)
+{
+    uint64_t pdpt_base = virt & ~((1ULL << 39) - 1);
+    uint64_t pd_base = virt & ~((1ULL << 30) - 1);
+
+    if (!walk->pdpt || walk->pdpt_base != pdpt_base)
     {
-        return (pd[pd_idx] & ~0x1FFFFF) | (virt & 0x1FFFFF);
+        walk->pd = NULL;
+        walk->pdpt = pt_next(&walk->pml4[(virt >> 39) & 0x1FF], virt, flags);
+
+        if (!walk->pdpt)
+        {
+            return NULL;
+        }
+
+        walk->pdpt_base = pdpt_base;
     }
 
-    uint64_t *pt = (uint64_t *)((pd[pd_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    uint64_t *entry = &walk->pdpt[(virt >> 30) & 0x1FF];
 
-    if (!(pt[pt_idx] & PAGING_PRESENT))
+    if (level == PT_LEVEL_PDPTE)
+    {
+        return pt_leaf(entry, level, leaf);
+    }
+
+    if (!walk->pd || walk->pd_base != pd_base)
+    {
+        walk->pd = NULL;
+
+        if ((*entry & PAGING_PRESENT) && (*entry & PAGING_HUGE))
+        {
+            if (!(flags & PT_WALK_SPLIT))
+            {
+                return pt_leaf(entry, PT_LEVEL_PDPTE, leaf);
+            }
+
+            if (pt_split(entry, virt, PT_LEVEL_PDPTE) < 0)
+            {
+                return NULL;
+            }
+        }
+
+        walk->pd = pt_next(entry, virt, flags);
+
+        if (!walk->pd)
+        {
+            return NULL;
+        }
+
+        walk->pd_base = pd_base;
+    }
+
+    entry = &walk->pd[(virt >> 21) & 0x1FF];
+
+    if (level == PT_LEVEL_PDE)
+    {
+        return pt_leaf(entry, level, leaf);
+    }
+
+    if ((*entry & PAGING_PRESENT) && (*entry & PAGING_HUGE))
+    {
+        if (!(flags & PT_WALK_SPLIT))
+        {
+            return pt_leaf(entry, PT_LEVEL_PDE, leaf);
+        }
+
+        if (pt_split(entry, virt, PT_LEVEL_PDE) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    uint64_t *pt = pt_next(entry, virt, flags);
+
+    if (!pt)
+    {
+        return NULL;
+    }
+
+    return pt_leaf(&pt[(virt >> 12) & 0x1FF], PT_LEVEL_PTE, leaf);
+}
+
+/*
+ * Get's the PML4 loaded in CR3
+ */
+static inline uint64_t *current_pml4(void)
+{
+    uint64_t cr3;
+
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return (uint64_t *)phys_to_virt(cr3 & PAGING_ADDR_MASK);
+}
+
+/*
+ * Map's a virtual page to physical page
+ * NOTE: Missing tables are allocated and a huge page in the way is split
+ */
+void paging_map(uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    struct pt_walk walk;
+
+    pt_walk_init(&walk, current_pml4());
+
+    uint64_t *pte = pt_walk(&walk, virt, PT_LEVEL_PTE, PT_WALK_CREATE | PT_WALK_SPLIT, NULL);
+
+    if (!pte)
+    {
+        printf("[PAGING] Failed to map 0x%llx\n", virt);
+        return;
+    }
+
+    pte[0] = (phys & PAGING_ADDR_MASK) | flags | PAGING_PRESENT;
+
+    paging_invalidate(virt);
+}
+
+/*
+ * Unmap's a virtual page
+ */
+void paging_unmap(uint64_t virt)
+{
+    struct pt_walk walk;
+
+    pt_walk_init(&walk, current_pml4());
+
+    uint64_t *pte = pt_walk(&walk, virt, PT_LEVEL_PTE, PT_WALK_SPLIT, NULL);
+
+    if (!pte)
+    {
+        return;
+    }
+
+    pte[0] = 0;
+
+    paging_invalidate(virt);
+}
+
+/*
+ * Get's physical address from virtual
+ */
+uint64_t paging_get_phys(uint64_t virt)
+{
+    struct pt_walk walk;
+    int leaf;
+
+    pt_walk_init(&walk, current_pml4());
+
+    uint64_t *entry = pt_walk(&walk, virt, PT_LEVEL_PTE, 0, &leaf);
+
+    if (!entry || !(*entry & PAGING_PRESENT))
     {
         return 0;
     }
 
-    return (pt[pt_idx] & ~0xFFF) | (virt & 0xFFF);
+    uint64_t mask = pt_level_size(leaf) - 1;
+
+    return (*entry & PAGING_ADDR_MASK & ~mask) | (virt & mask);
 }
 
 /*
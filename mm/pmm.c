@@ -1,17 +1,79 @@
 /*
  * Copyright (c) 2026 Trollycat
  * Physical Memory Manager implementation
- * Uses bitmap-based allocation
+ * Uses a binary buddy allocator with per-order free lists
  */
 
 #include <thuban/pmm.h>
+#include <thuban/page.h>
+#include <thuban/multiboot.h>
 #include <thuban/stdio.h>
 #include <thuban/string.h>
 #include <thuban/spinlock.h>
+#include <thuban/interrupts.h>
+#include <thuban/smp.h>
+#include <thuban/paging.h>
 
-#define BITMAP_SIZE 32768 // supports up to 128MB with 4KB pages
+#define PMM_NONE 0xFFFFFFFFU // end of free list marker
 
-static uint32_t bitmap[BITMAP_SIZE];
+#define PCP_HIGH 64  // a per-CPU list drains once it holds this many frames
+#define PCP_BATCH 16 // frames moved per refill or drain
+
+#define ZERO_POOL_SIZE 64 // pre-zeroed frames kept ready for PMM_ZERO
+#define ZERO_IDLE_BATCH 8 // frames zeroed per idle wakeup
+
+/*
+ * Zones split frames by whether boot.s maps them at KERNEL_VIRT_BASE
+ * The boundary is aligned to the largest block so buddies never straddle it.
+ */
+#define ZONE_LOW 0
+#define ZONE_HIGH 1
+#define PMM_NR_ZONES 2
+
+#define LOW_LIMIT_PFN (PMM_LOW_LIMIT / PAGE_SIZE)
+
+/* Physical range that must never reach the free lists */
+struct pmm_reserved
+{
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+};
+
+#define PMM_MAX_RESERVED 4
+
+/*
+ * Per-CPU list of single frames for one zone
+ * A ring used as a deque: recently freed (cache-hot) frames sit at the head,
+ * refilled and cold frames at the tail, and drains take from the tail.
+ */
+struct pcp_list
+{
+    uint32_t pfns[PCP_HIGH];
+    uint32_t head;
+    uint32_t count;
+};
+
+struct pcp_cache
+{
+    struct pcp_list lists[PMM_NR_ZONES];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+};
+
+struct page *page_map = NULL;
+static uint32_t free_lists[PMM_NR_ZONES][PMM_MAX_ORDER + 1];
+static uint64_t free_blocks[PMM_NR_ZONES][PMM_MAX_ORDER + 1];
+static struct pmm_reserved reserved[PMM_MAX_RESERVED];
+static int reserved_count = 0;
+static uint64_t zone_pages[PMM_NR_ZONES];
+static struct pcp_cache pcp_caches[MAX_CPUS];
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_count = 0;
+static uint64_t zero_hits = 0;
+static uint64_t zero_misses = 0;
+static uint64_t max_pfn = 0;
 static uint64_t total_pages = 0;
 static uint64_t used_pages = 0;
 
@@ -20,76 +82,461 @@ extern uint64_t _kernel_end;
 /* Spinlock to protect PMM operations */
 static spinlock_t pmm_lock = SPINLOCK_INIT_NAMED("pmm");
 
+/* Spinlock to protect the pre-zeroed pool */
+static spinlock_t zero_lock = SPINLOCK_INIT_NAMED("pmm_zero");
+
 /*
- * Set's a bit in the bitmap
+ * Get's the zone a frame belongs to
+ */
+static inline int pfn_zone(uint64_t pfn)
+{
+    return pfn < LOW_LIMIT_PFN ? ZONE_LOW : ZONE_HIGH;
+}
+
+/*
+ * Push's a free block onto its order list
  * NOTE: Must be called with pmm_lock held
  */
-static inline void bitmap_set(uint64_t bit)
+static inline void free_list_add(uint64_t pfn, unsigned int order)
 {
-    bitmap[bit / 32] |= (1 << (bit % 32));
+    struct page *page = pfn_to_page(pfn);
+    int zone = pfn_zone(pfn);
+
+    page->order = order;
+    page->flags |= PG_BUDDY;
+    page->prev = PMM_NONE;
+    page->next = free_lists[zone][order];
+
+    if (free_lists[zone][order] != PMM_NONE)
+    {
+        pfn_to_page(free_lists[zone][order])->prev = (uint32_t)pfn;
+    }
+
+    free_lists[zone][order] = (uint32_t)pfn;
+    free_blocks[zone][order]++;
 }
 
 /*
- * Clear's a bit in the bitmap
+ * Unlink's a free block from its order list
  * NOTE: Must be called with pmm_lock held
  */
-static inline void bitmap_clear(uint64_t bit)
+static inline void free_list_del(uint64_t pfn, unsigned int order)
 {
-    bitmap[bit / 32] &= ~(1 << (bit % 32));
+    struct page *page = pfn_to_page(pfn);
+    int zone = pfn_zone(pfn);
+
+    if (page->prev != PMM_NONE)
+    {
+        pfn_to_page(page->prev)->next = page->next;
+    }
+    else
+    {
+        free_lists[zone][order] = page->next;
+    }
+
+    if (page->next != PMM_NONE)
+    {
+        pfn_to_page(page->next)->prev = page->prev;
+    }
+
+    page->flags &= ~PG_BUDDY;
+    free_blocks[zone][order]--;
+}
+
+/*
+ * Get's the smallest order whose block holds count pages
+ */
+static inline unsigned int count_to_order(size_t count)
+{
+    unsigned int order = 0;
+
+    while (((size_t)1 << order) < count)
+    {
+        order++;
+    }
+
+    return order;
 }
 
 /*
- * Test's if a bit is set
+ * Take's a block of the given order from one zone, splitting larger blocks as needed
  * NOTE: Must be called with pmm_lock held
  */
-static inline int bitmap_test(uint64_t bit)
+static uint64_t buddy_alloc_zone(int zone, unsigned int order)
 {
-    return bitmap[bit / 32] & (1 << (bit % 32));
+    unsigned int current = order;
+
+    while (current <= PMM_MAX_ORDER && free_lists[zone][current] == PMM_NONE)
+    {
+        current++;
+    }
+
+    if (current > PMM_MAX_ORDER)
+    {
+        return (uint64_t)-1;
+    }
+
+    uint64_t pfn = free_lists[zone][current];
+    free_list_del(pfn, current);
+
+    // hand the upper halves back until the block is the requested size
+    while (current > order)
+    {
+        current--;
+        free_list_add(pfn + (1ULL << current), current);
+    }
+
+    return pfn;
 }
 
 /*
- * Find's first free page
+ * Take's a block of the given order from the zones allowed by flags
+ * NOTE: High frames are preferred so the boot-mapped low zone is kept for
+ * callers that must reach the frame through KERNEL_VIRT_BASE, which is
+ * only paging_init building the direct map.
  * NOTE: Must be called with pmm_lock held
  */
-static uint64_t find_free_page(void)
+static uint64_t buddy_alloc(unsigned int order, unsigned int flags)
 {
-    for (uint64_t i = 0; i < total_pages; i++)
+    if (!(flags & PMM_LOW))
     {
-        if (!bitmap_test(i))
+        uint64_t pfn = buddy_alloc_zone(ZONE_HIGH, order);
+
+        if (pfn != (uint64_t)-1)
         {
-            return i;
+            return pfn;
         }
     }
-    return (uint64_t)-1;
+
+    return buddy_alloc_zone(ZONE_LOW, order);
 }
 
 /*
- * Find's n contiguous free pages
+ * Return's a block to the free lists, merging with free buddies
  * NOTE: Must be called with pmm_lock held
  */
-static uint64_t find_free_pages(size_t count)
+static void buddy_free(uint64_t pfn, unsigned int order)
 {
-    uint64_t found = 0;
-    uint64_t start = 0;
+    while (order < PMM_MAX_ORDER)
+    {
+        uint64_t buddy = pfn ^ (1ULL << order);
+
+        if (buddy + (1ULL << order) > max_pfn)
+        {
+            break;
+        }
+
+        struct page *page = pfn_to_page(buddy);
+
+        if (!(page->flags & PG_BUDDY) || page->order != order)
+        {
+            break;
+        }
+
+        free_list_del(buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
 
-    for (uint64_t i = 0; i < total_pages; i++)
+    free_list_add(pfn, order);
+}
+
+/*
+ * Free's an arbitrary run of pages as maximal aligned buddy blocks
+ * NOTE: Must be called with pmm_lock held
+ */
+static void buddy_free_range(uint64_t pfn, uint64_t count)
+{
+    while (count)
     {
-        if (!bitmap_test(i))
+        unsigned int order = 0;
+
+        // grow the block while it stays aligned and inside the run
+        while (order < PMM_MAX_ORDER &&
+               !(pfn & ((1ULL << (order + 1)) - 1)) &&
+               (1ULL << (order + 1)) <= count)
         {
-            if (found == 0)
-            {
-                start = i;
-            }
-            found++;
+            order++;
+        }
+
+        buddy_free(pfn, order);
+        pfn += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+/*
+ * Pop's the most recently freed frame from a per-CPU list
+ * NOTE: Must be called with interrupts disabled
+ */
+static inline uint32_t pcp_pop_hot(struct pcp_list *list)
+{
+    uint32_t pfn = list->pfns[list->head];
+
+    list->head = (list->head + 1) % PCP_HIGH;
+    list->count--;
+    return pfn;
+}
+
+/*
+ * Pop's the coldest frame from a per-CPU list
+ * NOTE: Must be called with interrupts disabled
+ */
+static inline uint32_t pcp_pop_cold(struct pcp_list *list)
+{
+    list->count--;
+    return list->pfns[(list->head + list->count) % PCP_HIGH];
+}
+
+/*
+ * Push's a frame at the hot end of a per-CPU list
+ * NOTE: Must be called with interrupts disabled
+ */
+static inline void pcp_push_hot(struct pcp_list *list, uint32_t pfn)
+{
+    list->head = (list->head + PCP_HIGH - 1) % PCP_HIGH;
+    list->pfns[list->head] = pfn;
+    list->count++;
+}
+
+/*
+ * Push's a frame at the cold end of a per-CPU list
+ * NOTE: Must be called with interrupts disabled
+ */
+static inline void pcp_push_cold(struct pcp_list *list, uint32_t pfn)
+{
+    list->pfns[(list->head + list->count) % PCP_HIGH] = pfn;
+    list->count++;
+}
+
+/*
+ * Refill's a per-CPU list with a batch of frames from the buddy allocator
+ * NOTE: Must be called with interrupts disabled
+ */
+static void pcp_refill(struct pcp_cache *pcp, int zone)
+{
+    struct pcp_list *list = &pcp->lists[zone];
+
+    spin_lock(&pmm_lock);
+
+    while (list->count < PCP_BATCH)
+    {
+        uint64_t pfn = buddy_alloc_zone(zone, 0);
+
+        if (pfn == (uint64_t)-1)
+        {
+            break;
+        }
+
+        pfn_to_page(pfn)->flags |= PG_PCP;
+        pcp_push_cold(list, (uint32_t)pfn);
+        used_pages++;
+    }
+
+    spin_unlock(&pmm_lock);
+    pcp->refills++;
+}
+
+/*
+ * Drain's the coldest batch of a per-CPU list back to the buddy allocator
+ * NOTE: Must be called with interrupts disabled
+ */
+static void pcp_drain(struct pcp_cache *pcp, int zone)
+{
+    struct pcp_list *list = &pcp->lists[zone];
+
+    spin_lock(&pmm_lock);
+
+    for (int i = 0; i < PCP_BATCH && list->count; i++)
+    {
+        uint32_t pfn = pcp_pop_cold(list);
+
+        pfn_to_page(pfn)->flags &= ~PG_PCP;
+        buddy_free(pfn, 0);
+        used_pages--;
+    }
+
+    spin_unlock(&pmm_lock);
+    pcp->drains++;
+}
+
+/*
+ * Allocate's a single frame through the executing CPU's page cache
+ */
+static void *pcp_alloc(unsigned int flags)
+{
+    static const int high_first[] = {ZONE_HIGH, ZONE_LOW};
+    const int *zones = (flags & PMM_LOW) ? &high_first[1] : high_first;
+    int nr_zones = (flags & PMM_LOW) ? 1 : 2;
+
+    uint64_t irq = interrupts_save();
+    struct pcp_cache *pcp = &pcp_caches[smp_processor_id()];
+
+    for (int i = 0; i < nr_zones; i++)
+    {
+        int zone = zones[i];
+        struct pcp_list *list = &pcp->lists[zone];
+
+        if (!zone_pages[zone])
+        {
+            continue;
+        }
+
+        if (list->count)
+        {
+            pcp->hits++;
+        }
+        else
+        {
+            pcp->misses++;
+            pcp_refill(pcp, zone);
 
-            if (found == count)
+            if (!list->count)
             {
-                return start;
+                continue;
             }
         }
-        else
+
+        uint32_t pfn = (flags & PMM_COLD) ? pcp_pop_cold(list) : pcp_pop_hot(list);
+        struct page *page = pfn_to_page(pfn);
+
+        page->flags &= ~PG_PCP;
+        page->refcount = 1;
+
+        interrupts_restore(irq);
+        return (void *)((uint64_t)pfn * PAGE_SIZE);
+    }
+
+    interrupts_restore(irq);
+    return NULL;
+}
+
+/*
+ * Free's a single frame into the executing CPU's page cache
+ */
+static void pcp_free(uint64_t pfn)
+{
+    int zone = pfn_zone(pfn);
+
+    uint64_t irq = interrupts_save();
+    struct pcp_cache *pcp = &pcp_caches[smp_processor_id()];
+    struct pcp_list *list = &pcp->lists[zone];
+
+    pfn_to_page(pfn)->flags |= PG_PCP;
+    pcp_push_hot(list, (uint32_t)pfn);
+
+    if (list->count >= PCP_HIGH)
+    {
+        pcp_drain(pcp, zone);
+    }
+
+    interrupts_restore(irq);
+}
+
+/*
+ * Zero's a frame through the direct map
+ */
+static inline void zero_frame(uint64_t phys)
+{
+    void *virt = phys_to_virt(phys);
+    uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+
+    asm volatile("rep stosq"
+                 : "+D"(virt), "+c"(count)
+                 : "a"(0ULL)
+                 : "memory");
+}
+
+/*
+ * Take's a frame from the pre-zeroed pool
+ * Return's NULL if the pool is empty
+ */
+static void *zero_pool_take(void)
+{
+    void *page = NULL;
+
+    spin_lock(&zero_lock);
+
+    if (zero_count)
+    {
+        page = (void *)((uint64_t)zero_pool[--zero_count] * PAGE_SIZE);
+        zero_hits++;
+    }
+    else
+    {
+        zero_misses++;
+    }
+
+    spin_unlock(&zero_lock);
+    return page;
+}
+
+/*
+ * Add's a range to the reserved list
+ */
+static void reserve_range(uint64_t start, uint64_t end)
+{
+    if (reserved_count >= PMM_MAX_RESERVED || end <= start)
+    {
+        return;
+    }
+
+    reserved[reserved_count].start_pfn = start / PAGE_SIZE;
+    reserved[reserved_count].end_pfn = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+    reserved_count++;
+}
+
+/*
+ * Check's if a physical range is available RAM clear of reserved ranges
+ */
+static int range_is_usable(struct multiboot_info *mbi, uint64_t start, uint64_t end)
+{
+    for (int i = 0; i < reserved_count; i++)
+    {
+        if (start < reserved[i].end_pfn * PAGE_SIZE && end > reserved[i].start_pfn * PAGE_SIZE)
         {
-            found = 0;
+            return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < mbi->region_count; i++)
+    {
+        struct multiboot_mem_region *region = &mbi->regions[i];
+
+        if (region->type == MULTIBOOT_MEMORY_AVAILABLE &&
+            start >= region->base && end <= region->base + region->len)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Find's low memory for the frame metadata
+ * Tries right after the kernel, then after the boot info, then each region.
+ */
+static uint64_t find_metadata_home(struct multiboot_info *mbi, uint64_t size)
+{
+    uint64_t candidates[2 + MULTIBOOT_MAX_REGIONS];
+    uint32_t count = 0;
+
+    candidates[count++] = reserved[0].end_pfn * PAGE_SIZE;
+    candidates[count++] = mbi->mbi_end;
+
+    for (uint32_t i = 0; i < mbi->region_count; i++)
+    {
+        candidates[count++] = mbi->regions[i].base;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t start = (candidates[i] + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+        if (start + size <= PMM_LOW_LIMIT && range_is_usable(mbi, start, start + size))
+        {
+            return start;
         }
     }
 
@@ -97,38 +544,160 @@ static uint64_t find_free_pages(size_t count)
 }
 
 /*
- * Initialize's the physical memory manager
+ * Free's the part of a pfn range that isn't reserved
+ * Return's the number of pages handed to the buddy allocator
+ */
+static uint64_t release_range(uint64_t start, uint64_t end)
+{
+    if (start >= end)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < reserved_count; i++)
+    {
+        if (start < reserved[i].end_pfn && end > reserved[i].start_pfn)
+        {
+            uint64_t released = 0;
+
+            if (start < reserved[i].start_pfn)
+            {
+                released += release_range(start, reserved[i].start_pfn);
+            }
+
+            if (end > reserved[i].end_pfn)
+            {
+                released += release_range(reserved[i].end_pfn, end);
+            }
+
+            return released;
+        }
+    }
+
+    buddy_free_range(start, end - start);
+
+    for (uint64_t pfn = start; pfn < end;)
+    {
+        uint64_t stop = (pfn < LOW_LIMIT_PFN && end > LOW_LIMIT_PFN) ? LOW_LIMIT_PFN : end;
+        zone_pages[pfn_zone(pfn)] += stop - pfn;
+        pfn = stop;
+    }
+
+    return end - start;
+}
+
+/*
+ * Initialize's the physical memory manager from the bootloader memory map
+ * NOTE: Only MULTIBOOT_MEMORY_AVAILABLE ranges are ever handed out
  */
-void pmm_init(uint64_t mem_size)
+void pmm_init(struct multiboot_info *mbi)
 {
-    total_pages = mem_size / PAGE_SIZE;
+    spin_lock_init(&pmm_lock, "pmm");
+    spin_lock_init(&zero_lock, "pmm_zero");
 
-    if (total_pages > BITMAP_SIZE * 32)
+    // no memory map (bad magic) so trust the fallback size as one region
+    if (mbi->region_count == 0)
     {
-        total_pages = BITMAP_SIZE * 32;
+        mbi->regions[0].base = 0;
+        mbi->regions[0].len = mbi->total_mem;
+        mbi->regions[0].type = MULTIBOOT_MEMORY_AVAILABLE;
+        mbi->region_count = 1;
     }
 
-    // clear bitmap (all free)
-    memset(bitmap, 0, sizeof(bitmap));
+    max_pfn = 0;
+    total_pages = 0;
     used_pages = 0;
+    reserved_count = 0;
+
+    for (uint32_t i = 0; i < mbi->region_count; i++)
+    {
+        struct multiboot_mem_region *region = &mbi->regions[i];
+
+        if (region->type != MULTIBOOT_MEMORY_AVAILABLE)
+        {
+            continue;
+        }
+
+        uint64_t start = (region->base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t end = (region->base + region->len) / PAGE_SIZE;
+
+        if (end > start)
+        {
+            total_pages += end - start;
+
+            if (end > max_pfn)
+            {
+                max_pfn = end;
+            }
+        }
+    }
+
+    for (int zone = 0; zone < PMM_NR_ZONES; zone++)
+    {
+        zone_pages[zone] = 0;
+
+        for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++)
+        {
+            free_lists[zone][order] = PMM_NONE;
+            free_blocks[zone][order] = 0;
+        }
+    }
+
+    memset(pcp_caches, 0, sizeof(pcp_caches));
+
+    zero_count = 0;
+    zero_hits = 0;
+    zero_misses = 0;
+
+    // first MB (BIOS, real mode structures) and the kernel image
+    uint64_t kernel_end_phys = (uint64_t)&_kernel_end - KERNEL_VIRT_BASE;
+    reserve_range(0, kernel_end_phys > 0x100000 ? kernel_end_phys : 0x100000);
+
+    // the boot info still backs cmdline and bootloader name strings
+    reserve_range(mbi->mbi_start, mbi->mbi_end);
 
-    // mark first 1MB + kernel as used
-    uint64_t kernel_end_phys = (uint64_t)&_kernel_end - 0xFFFFFFFF80000000ULL;
-    uint64_t kernel_pages = (kernel_end_phys + PAGE_SIZE - 1) / PAGE_SIZE;
+    // the page database lives in low memory so it's reachable through the boot mapping
+    uint64_t meta_size = max_pfn * sizeof(struct page);
+    uint64_t meta_phys = find_metadata_home(mbi, meta_size);
 
-    // reserve at least first MB plus kernel
-    if (kernel_pages < 256) // minimum 1MB
+    if (meta_phys == (uint64_t)-1)
     {
-        kernel_pages = 256;
+        printf("[PMM] No room for %llu KB of page descriptors\n", meta_size / 1024);
+        max_pfn = 0;
+        total_pages = 0;
+        return;
     }
 
-    for (uint64_t i = 0; i < kernel_pages; i++)
+    reserve_range(meta_phys, meta_phys + meta_size);
+
+    page_map = (struct page *)(meta_phys + KERNEL_VIRT_BASE);
+    memset(page_map, 0, meta_size);
+
+    for (int i = 0; i < reserved_count; i++)
     {
-        bitmap_set(i);
-        used_pages++;
+        for (uint64_t pfn = reserved[i].start_pfn; pfn < reserved[i].end_pfn && pfn < max_pfn; pfn++)
+        {
+            page_map[pfn].flags = PG_RESERVED;
+            page_map[pfn].refcount = 1;
+        }
     }
 
-    spin_lock_init(&pmm_lock, "pmm");
+    uint64_t released = 0;
+
+    for (uint32_t i = 0; i < mbi->region_count; i++)
+    {
+        struct multiboot_mem_region *region = &mbi->regions[i];
+
+        if (region->type != MULTIBOOT_MEMORY_AVAILABLE)
+        {
+            continue;
+        }
+
+        released += release_range((region->base + PAGE_SIZE - 1) / PAGE_SIZE,
+                                  (region->base + region->len) / PAGE_SIZE);
+    }
+
+    used_pages = total_pages - released;
 }
 
 /*
@@ -136,28 +705,51 @@ void pmm_init(uint64_t mem_size)
  */
 void *pmm_alloc(void)
 {
-    spin_lock(&pmm_lock);
+    return pmm_alloc_flags(0);
+}
+
+/*
+ * Allocate's a single physical page with PMM_* flags
+ * NOTE: The zero pool is filled from any zone, so PMM_LOW passes it by
+ */
+void *pmm_alloc_flags(unsigned int flags)
+{
+    if (!(flags & PMM_ZERO))
+    {
+        return pcp_alloc(flags);
+    }
 
-    uint64_t page = find_free_page();
+    void *page = (flags & PMM_LOW) ? NULL : zero_pool_take();
 
-    if (page == (uint64_t)-1)
+    if (page)
     {
-        spin_unlock(&pmm_lock);
-        return NULL;
+        return page;
     }
 
-    bitmap_set(page);
-    used_pages++;
+    // pool ran dry, so pay for the clear here
+    page = pcp_alloc(flags);
 
-    void *addr = (void *)(page * PAGE_SIZE);
-    spin_unlock(&pmm_lock);
-    return addr;
+    if (page)
+    {
+        zero_frame((uint64_t)page);
+    }
+
+    return page;
 }
 
 /*
  * Allocate's multiple contiguous pages
  */
 void *pmm_alloc_pages(size_t count)
+{
+    return pmm_alloc_pages_flags(count, 0);
+}
+
+/*
+ * Allocate's multiple contiguous pages with PMM_* flags
+ * NOTE: The block is rounded up to a power of two and the tail given back
+ */
+void *pmm_alloc_pages_flags(size_t count, unsigned int flags)
 {
     if (count == 0)
     {
@@ -166,12 +758,19 @@ void *pmm_alloc_pages(size_t count)
 
     if (count == 1)
     {
-        return pmm_alloc();
+        return pmm_alloc_flags(flags);
+    }
+
+    unsigned int order = count_to_order(count);
+
+    if (order > PMM_MAX_ORDER)
+    {
+        return NULL;
     }
 
     spin_lock(&pmm_lock);
 
-    uint64_t start_page = find_free_pages(count);
+    uint64_t start_page = buddy_alloc(order, flags);
 
     if (start_page == (uint64_t)-1)
     {
@@ -179,58 +778,186 @@ void *pmm_alloc_pages(size_t count)
         return NULL;
     }
 
-    for (size_t i = 0; i < count; i++)
+    buddy_free_range(start_page + count, (1ULL << order) - count);
+    used_pages += count;
+
+    for (uint64_t pfn = start_page; pfn < start_page + count; pfn++)
     {
-        bitmap_set(start_page + i);
-        used_pages++;
+        pfn_to_page(pfn)->refcount = 1;
     }
 
     void *addr = (void *)(start_page * PAGE_SIZE);
     spin_unlock(&pmm_lock);
+
+    if (flags & PMM_ZERO)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            zero_frame((uint64_t)addr + i * PAGE_SIZE);
+        }
+    }
+
     return addr;
 }
 
 /*
  * Free's a physical page
+ * NOTE: Shared frames only return to the allocator with their last reference
  */
 void pmm_free(void *page)
 {
-    if (!page)
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+
+    if (!page || !pfn_valid(pfn))
     {
         return;
     }
 
-    spin_lock(&pmm_lock);
+    put_page(pfn_to_page(pfn));
+}
+
+/*
+ * Free's multiple pages
+ * NOTE: A run whose every frame holds just the caller's reference goes
+ * back to the buddy lists in one piece. Otherwise each frame only drops
+ * its reference, so a shared or already free frame isn't released twice
+ */
+void pmm_free_pages(void *page, size_t count)
+{
+    if (!page || count == 0)
+    {
+        return;
+    }
 
     uint64_t page_num = (uint64_t)page / PAGE_SIZE;
 
-    if (page_num >= total_pages)
+    if (count == 1)
     {
-        spin_unlock(&pmm_lock);
+        pmm_free(page);
         return;
     }
 
-    if (!bitmap_test(page_num))
+    if (page_num + count > max_pfn)
     {
-        spin_unlock(&pmm_lock);
         return;
     }
 
-    bitmap_clear(page_num);
-    used_pages--;
+    for (uint64_t pfn = page_num; pfn < page_num + count; pfn++)
+    {
+        struct page *desc = pfn_to_page(pfn);
+
+        if ((desc->flags & (PG_RESERVED | PG_BUDDY | PG_PCP)) || desc->refcount != 1)
+        {
+            if ((desc->flags & (PG_RESERVED | PG_BUDDY | PG_PCP)) || desc->refcount <= 0)
+            {
+                printf("[PMM] Freeing %llu pages at 0x%llx that aren't all allocated\n", (uint64_t)count,
+                       page_num * PAGE_SIZE);
+            }
+
+            for (pfn = page_num; pfn < page_num + count; pfn++)
+            {
+                put_page(pfn_to_page(pfn));
+            }
+
+            return;
+        }
+    }
+
+    for (uint64_t pfn = page_num; pfn < page_num + count; pfn++)
+    {
+        struct page *desc = pfn_to_page(pfn);
+
+        desc->refcount = 0;
+        desc->mapcount = 0;
+        desc->owner = NULL;
+        desc->flags &= ~(PG_SLAB | PG_DIRTY | PG_LOCKED);
+    }
+
+    spin_lock(&pmm_lock);
+
+    buddy_free_range(page_num, count);
+    used_pages -= count;
 
     spin_unlock(&pmm_lock);
 }
 
 /*
- * Free's multiple pages
+ * Top's up the pre-zeroed pool a few frames at a time
+ * NOTE: Called from idle loops, the batch bounds how long an interrupt waits on hlt
  */
-void pmm_free_pages(void *page, size_t count)
+void pmm_zero_idle(void)
 {
-    for (size_t i = 0; i < count; i++)
+    for (int i = 0; i < ZERO_IDLE_BATCH; i++)
     {
-        pmm_free((void *)((uint64_t)page + (i * PAGE_SIZE)));
+        if (__atomic_load_n(&zero_count, __ATOMIC_RELAXED) >= ZERO_POOL_SIZE)
+        {
+            return;
+        }
+
+        // cold frames, nothing is gained by evicting cache for a frame we overwrite
+        void *page = pcp_alloc(PMM_COLD);
+
+        if (!page)
+        {
+            return;
+        }
+
+        zero_frame((uint64_t)page);
+
+        spin_lock(&zero_lock);
+
+        if (zero_count < ZERO_POOL_SIZE)
+        {
+            zero_pool[zero_count++] = (uint32_t)((uint64_t)page / PAGE_SIZE);
+            page = NULL;
+        }
+
+        spin_unlock(&zero_lock);
+
+        if (page)
+        {
+            pmm_free(page);
+            return;
+        }
+    }
+}
+
+/*
+ * Check's if a page frame number has a descriptor
+ */
+int pfn_valid(uint64_t pfn)
+{
+    return page_map && pfn < max_pfn;
+}
+
+/*
+ * Take's an extra reference on an allocated frame
+ */
+void get_page(struct page *page)
+{
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop's a reference, returning the frame to the allocator on the last one
+ */
+void put_page(struct page *page)
+{
+    if ((page->flags & (PG_BUDDY | PG_PCP | PG_RESERVED)) || page->refcount <= 0)
+    {
+        return;
     }
+
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    page->mapcount = 0;
+    page->owner = NULL;
+    page->flags &= ~(PG_SLAB | PG_DIRTY | PG_LOCKED);
+
+    pcp_free(page_to_pfn(page));
 }
 
 /*
@@ -244,6 +971,14 @@ uint64_t pmm_get_total_memory(void)
     return total;
 }
 
+/*
+ * Get's the end of RAM, the highest usable physical address plus one
+ */
+uint64_t pmm_get_max_phys(void)
+{
+    return max_pfn * PAGE_SIZE;
+}
+
 /*
  * Get's used memory in bytes
  */
@@ -252,7 +987,14 @@ uint64_t pmm_get_used_memory(void)
     spin_lock(&pmm_lock);
     uint64_t used = used_pages * PAGE_SIZE;
     spin_unlock(&pmm_lock);
-    return used;
+
+    struct pmm_pcp_stats stats;
+    pmm_get_pcp_stats(&stats);
+
+    struct pmm_zero_stats zero;
+    pmm_get_zero_stats(&zero);
+
+    return used - (stats.cached + zero.pooled) * PAGE_SIZE;
 }
 
 /*
@@ -263,5 +1005,44 @@ uint64_t pmm_get_free_memory(void)
     spin_lock(&pmm_lock);
     uint64_t free = (total_pages - used_pages) * PAGE_SIZE;
     spin_unlock(&pmm_lock);
-    return free;
-}
\ No newline at end of file
+
+    // frames parked in per-CPU caches or the zero pool are free, just not in the buddy lists
+    struct pmm_pcp_stats stats;
+    pmm_get_pcp_stats(&stats);
+
+    struct pmm_zero_stats zero;
+    pmm_get_zero_stats(&zero);
+
+    return free + (stats.cached + zero.pooled) * PAGE_SIZE;
+}
+
+/*
+ * Get's pre-zeroed pool counters
+ */
+void pmm_get_zero_stats(struct pmm_zero_stats *stats)
+{
+    spin_lock(&zero_lock);
+    stats->pooled = zero_count;
+    stats->hits = zero_hits;
+    stats->misses = zero_misses;
+    spin_unlock(&zero_lock);
+}
+
+/*
+ * Get's per-CPU page cache counters summed over all CPUs
+ */
+void pmm_get_pcp_stats(struct pmm_pcp_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        struct pcp_cache *pcp = &pcp_caches[cpu];
+
+        stats->hits += pcp->hits;
+        stats->misses += pcp->misses;
+        stats->refills += pcp->refills;
+        stats->drains += pcp->drains;
+        stats->cached += pcp->lists[ZONE_LOW].count + pcp->lists[ZONE_HIGH].count;
+    }
+}
@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Slab allocator implementation
+ * Caches carve power-of-two page blocks into equal objects and keep
+ * a per-CPU magazine of recently freed objects in front of the slabs.
+ */
+
+#include <thuban/slab.h>
+#include <thuban/pmm.h>
+#include <thuban/page.h>
+#include <thuban/stdio.h>
+#include <thuban/string.h>
+#include <thuban/spinlock.h>
+#include <thuban/interrupts.h>
+#include <thuban/smp.h>
+#include <thuban/paging.h>
+
+#define CACHE_LINE_SIZE 64
+#define KMEM_MIN_ALIGN 8
+#define KMEM_NAME_MAX 24
+#define KMEM_MAX_ORDER 5  // largest slab is 32 pages
+#define KMEM_MAG_SIZE 16  // objects held per CPU magazine
+#define KMEM_MAX_EMPTY 1  // fully free slabs kept per cache before returning pages
+
+/*
+ * Slab header, at the start of the slab's first page
+ * Free objects are tracked by index so a constructed object is never
+ * overwritten by allocator bookkeeping.
+ */
+struct slab
+{
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    uint8_t *objects;
+    uint16_t inuse;
+    uint16_t nfree;
+    uint16_t free_idx[]; // stack of free object indices
+};
+
+struct kmem_magazine
+{
+    uint32_t count;
+    void *objs[KMEM_MAG_SIZE];
+};
+
+struct kmem_cache
+{
+    char name[KMEM_NAME_MAX];
+    size_t object_size;
+    size_t size;        // object stride
+    size_t align;
+    size_t header_size; // slab header rounded up to align
+    unsigned int order;
+    unsigned int objects_per_slab;
+    unsigned int colour_count; // distinct colour offsets that fit in the leftover
+    unsigned int colour_next;
+    size_t colour_step;
+    void (*ctor)(void *obj);
+    spinlock_t lock;
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+    uint64_t nr_slabs;
+    uint64_t nr_empty;
+    uint64_t total_objects;
+    uint64_t active_objects; // out of the slabs, magazines included
+    struct kmem_magazine mags[MAX_CPUS];
+    struct kmem_cache *next;
+};
+
+static struct kmem_cache cache_cache;
+static struct kmem_cache *cache_list = NULL;
+
+/* Spinlock to protect the cache list */
+static spinlock_t slab_lock = SPINLOCK_INIT_NAMED("slab");
+
+/*
+ * Get's the number of objects and leftover bytes for a slab order
+ */
+static unsigned int slab_estimate(size_t size, size_t align, unsigned int order,
+                                  size_t *header_size, size_t *leftover)
+{
+    size_t slab_bytes = (size_t)PAGE_SIZE << order;
+    unsigned int count = (slab_bytes - sizeof(struct slab)) / (size + sizeof(uint16_t));
+
+    while (count)
+    {
+        size_t header = sizeof(struct slab) + count * sizeof(uint16_t);
+        header = (header + align - 1) & ~(align - 1);
+
+        if (header + count * size <= slab_bytes)
+        {
+            *header_size = header;
+            *leftover = slab_bytes - header - count * size;
+            return count > 0xFFFF ? 0xFFFF : count;
+        }
+
+        count--;
+    }
+
+    return 0;
+}
+
+/*
+ * Get's the list a slab belongs on for its fill level
+ */
+static inline struct slab **slab_list(struct kmem_cache *cache, struct slab *slab)
+{
+    if (slab->inuse == 0)
+    {
+        return &cache->empty;
+    }
+
+    return slab->nfree ? &cache->partial : &cache->full;
+}
+
+/*
+ * Push's a slab onto a list
+ * NOTE: Must be called with cache->lock held
+ */
+static inline void slab_list_add(struct slab **head, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+
+    if (*head)
+    {
+        (*head)->prev = slab;
+    }
+
+    *head = slab;
+}
+
+/*
+ * Unlink's a slab from a list
+ * NOTE: Must be called with cache->lock held
+ */
+static inline void slab_list_del(struct slab **head, struct slab *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *head = slab->next;
+    }
+
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/*
+ * Build's a new slab and constructs its objects
+ * NOTE: Must be called with cache->lock held
+ */
+static struct slab *slab_grow(struct kmem_cache *cache)
+{
+    size_t pages = (size_t)1 << cache->order;
+
+    // slabs are reached through the direct map, and a 2^order block is naturally aligned
+    void *phys = pmm_alloc_pages(pages);
+
+    if (!phys)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < pages; i++)
+    {
+        struct page *page = phys_to_page((uint64_t)phys + i * PAGE_SIZE);
+
+        page->flags |= PG_SLAB;
+        page->owner = cache;
+    }
+
+    struct slab *slab = (struct slab *)phys_to_virt((uint64_t)phys);
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->nfree = cache->objects_per_slab;
+    slab->objects = (uint8_t *)slab + cache->header_size + cache->colour_next * cache->colour_step;
+
+    // stagger consecutive slabs so equal offsets don't all land in the same cache sets
+    cache->colour_next = (cache->colour_next + 1) % cache->colour_count;
+
+    for (unsigned int i = 0; i < cache->objects_per_slab; i++)
+    {
+        slab->free_idx[i] = cache->objects_per_slab - 1 - i;
+
+        if (cache->ctor)
+        {
+            cache->ctor(slab->objects + i * cache->size);
+        }
+    }
+
+    slab_list_add(&cache->empty, slab);
+    cache->nr_slabs++;
+    cache->nr_empty++;
+    cache->total_objects += cache->objects_per_slab;
+
+    return slab;
+}
+
+/*
+ * Return's an empty slab's pages to the PMM
+ * NOTE: Must be called with cache->lock held
+ */
+static void slab_release(struct kmem_cache *cache, struct slab *slab)
+{
+    size_t pages = (size_t)1 << cache->order;
+    uint64_t phys = virt_to_phys(slab);
+
+    slab_list_del(&cache->empty, slab);
+    cache->nr_slabs--;
+    cache->nr_empty--;
+    cache->total_objects -= cache->objects_per_slab;
+
+    pmm_free_pages((void *)phys, pages);
+}
+
+/*
+ * Take's one object out of the slabs
+ * NOTE: Must be called with cache->lock held
+ */
+static void *slab_alloc_one(struct kmem_cache *cache)
+{
+    struct slab *slab = cache->partial ? cache->partial : cache->empty;
+
+    if (!slab)
+    {
+        slab = slab_grow(cache);
+
+        if (!slab)
+        {
+            return NULL;
+        }
+    }
+
+    if (slab->inuse == 0)
+    {
+        cache->nr_empty--;
+    }
+
+    slab_list_del(slab_list(cache, slab), slab);
+
+    uint16_t idx = slab->free_idx[--slab->nfree];
+    slab->inuse++;
+
+    slab_list_add(slab_list(cache, slab), slab);
+    cache->active_objects++;
+
+    return slab->objects + idx * cache->size;
+}
+
+/*
+ * Put's one object back into its slab
+ * NOTE: Must be called with cache->lock held
+ */
+static void slab_free_one(struct kmem_cache *cache, void *obj)
+{
+    uint64_t slab_mask = ((uint64_t)PAGE_SIZE << cache->order) - 1;
+    struct slab *slab = (struct slab *)((uint64_t)obj & ~slab_mask);
+    uint64_t offset = (uint8_t *)obj - slab->objects;
+
+    if (slab->cache != cache || offset % cache->size ||
+        offset / cache->size >= cache->objects_per_slab || slab->inuse == 0)
+    {
+        printf("[SLAB] Invalid free of 0x%llx to %s\n", (uint64_t)obj, cache->name);
+        return;
+    }
+
+    slab_list_del(slab_list(cache, slab), slab);
+
+    slab->free_idx[slab->nfree++] = (uint16_t)(offset / cache->size);
+    slab->inuse--;
+
+    slab_list_add(slab_list(cache, slab), slab);
+    cache->active_objects--;
+
+    if (slab->inuse == 0)
+    {
+        cache->nr_empty++;
+
+        if (cache->nr_empty > KMEM_MAX_EMPTY)
+        {
+            slab_release(cache, slab);
+        }
+    }
+}
+
+/*
+ * Fill's in a cache descriptor
+ * Return's -1 if no slab order can hold an object
+ */
+static int kmem_cache_setup(struct kmem_cache *cache, const char *name, size_t size,
+                            size_t align, unsigned int flags, void (*ctor)(void *obj))
+{
+    memset(cache, 0, sizeof(*cache));
+
+    if (align < KMEM_MIN_ALIGN)
+    {
+        align = KMEM_MIN_ALIGN;
+    }
+
+    if ((flags & KMEM_HWCACHE_ALIGN) && align < CACHE_LINE_SIZE)
+    {
+        align = CACHE_LINE_SIZE;
+    }
+
+    if (align & (align - 1))
+    {
+        return -1;
+    }
+
+    strncpy(cache->name, name, KMEM_NAME_MAX - 1);
+    cache->object_size = size;
+    cache->size = (size + align - 1) & ~(align - 1);
+    cache->align = align;
+    cache->ctor = ctor;
+
+    // smallest order that wastes at most an eighth of the slab
+    size_t leftover = 0;
+    unsigned int order;
+
+    for (order = 0; order <= KMEM_MAX_ORDER; order++)
+    {
+        cache->objects_per_slab = slab_estimate(cache->size, align, order, &cache->header_size, &leftover);
+
+        if (cache->objects_per_slab && leftover * 8 <= ((size_t)PAGE_SIZE << order))
+        {
+            break;
+        }
+    }
+
+    if (order > KMEM_MAX_ORDER)
+    {
+        order = KMEM_MAX_ORDER;
+    }
+
+    if (!cache->objects_per_slab)
+    {
+        return -1;
+    }
+
+    cache->order = order;
+    cache->colour_step = align > CACHE_LINE_SIZE ? align : CACHE_LINE_SIZE;
+    cache->colour_count = leftover / cache->colour_step + 1;
+
+    spin_lock_init(&cache->lock, cache->name);
+
+    spin_lock(&slab_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spin_unlock(&slab_lock);
+
+    return 0;
+}
+
+/*
+ * Initialize's the slab allocator
+ */
+void slab_init(void)
+{
+    spin_lock_init(&slab_lock, "slab");
+    cache_list = NULL;
+
+    kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache),
+                     CACHE_LINE_SIZE, 0, NULL);
+}
+
+/*
+ * Create's an object cache
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     unsigned int flags, void (*ctor)(void *obj))
+{
+    if (!name || size == 0)
+    {
+        return NULL;
+    }
+
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+
+    if (!cache)
+    {
+        return NULL;
+    }
+
+    if (kmem_cache_setup(cache, name, size, align, flags, ctor) != 0)
+    {
+        printf("[SLAB] Can't create cache %s for %llu byte objects\n", name, (uint64_t)size);
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/*
+ * Destroy's a cache, its objects must all have been freed
+ */
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    if (!cache || cache == &cache_cache)
+    {
+        return;
+    }
+
+    spin_lock(&cache->lock);
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        struct kmem_magazine *mag = &cache->mags[cpu];
+
+        while (mag->count)
+        {
+            slab_free_one(cache, mag->objs[--mag->count]);
+        }
+    }
+
+    if (cache->active_objects)
+    {
+        spin_unlock(&cache->lock);
+        printf("[SLAB] Cache %s destroyed with %llu objects in use\n",
+               cache->name, cache->active_objects);
+        return;
+    }
+
+    while (cache->empty)
+    {
+        slab_release(cache, cache->empty);
+    }
+
+    spin_unlock(&cache->lock);
+
+    spin_lock(&slab_lock);
+
+    struct kmem_cache **curr = &cache_list;
+    while (*curr)
+    {
+        if (*curr == cache)
+        {
+            *curr = cache->next;
+            break;
+        }
+        curr = &(*curr)->next;
+    }
+
+    spin_unlock(&slab_lock);
+
+    kmem_cache_free(&cache_cache, cache);
+}
+
+/*
+ * Allocate's an object, from the CPU's magazine when it has one
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    if (!cache)
+    {
+        return NULL;
+    }
+
+    uint64_t irq = interrupts_save();
+    struct kmem_magazine *mag = &cache->mags[smp_processor_id()];
+
+    if (!mag->count)
+    {
+        spin_lock(&cache->lock);
+
+        // only half fill so an immediate free doesn't have to flush
+        while (mag->count < KMEM_MAG_SIZE / 2)
+        {
+            void *obj = slab_alloc_one(cache);
+
+            if (!obj)
+            {
+                break;
+            }
+
+            mag->objs[mag->count++] = obj;
+        }
+
+        spin_unlock(&cache->lock);
+    }
+
+    void *obj = mag->count ? mag->objs[--mag->count] : NULL;
+
+    interrupts_restore(irq);
+    return obj;
+}
+
+/*
+ * Free's an object into the CPU's magazine
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    if (!cache || !obj)
+    {
+        return;
+    }
+
+    uint64_t irq = interrupts_save();
+    struct kmem_magazine *mag = &cache->mags[smp_processor_id()];
+
+    if (mag->count == KMEM_MAG_SIZE)
+    {
+        spin_lock(&cache->lock);
+
+        // the older half goes back, the recently freed (cache-hot) half stays
+        for (int i = 0; i < KMEM_MAG_SIZE / 2; i++)
+        {
+            slab_free_one(cache, mag->objs[i]);
+        }
+
+        memmove(mag->objs, mag->objs + KMEM_MAG_SIZE / 2, (KMEM_MAG_SIZE / 2) * sizeof(void *));
+        mag->count = KMEM_MAG_SIZE / 2;
+
+        spin_unlock(&cache->lock);
+    }
+
+    mag->objs[mag->count++] = obj;
+
+    interrupts_restore(irq);
+}
+
+/*
+ * Get's the cache owning a pointer through its page descriptor
+ */
+struct kmem_cache *kmem_cache_of(const void *ptr)
+{
+    uint64_t addr = (uint64_t)ptr;
+
+    if (addr < DIRECT_MAP_BASE || addr >= DIRECT_MAP_BASE + DIRECT_MAP_SIZE)
+    {
+        return NULL;
+    }
+
+    uint64_t pfn = (addr - DIRECT_MAP_BASE) / PAGE_SIZE;
+
+    if (!pfn_valid(pfn))
+    {
+        return NULL;
+    }
+
+    struct page *page = pfn_to_page(pfn);
+
+    return (page->flags & PG_SLAB) ? (struct kmem_cache *)page->owner : NULL;
+}
+
+/*
+ * Get's the object size of a cache
+ */
+size_t kmem_cache_size(struct kmem_cache *cache)
+{
+    return cache->object_size;
+}
+
+/*
+ * Print's per-cache usage
+ */
+void kmem_cache_list(void)
+{
+    spin_lock(&slab_lock);
+
+    printf("%-20s %-8s %-8s %-8s %-6s %s\n",
+           "Name", "ObjSize", "Active", "Total", "Slabs", "Pages");
+    printf("-------------------------------------------------------------\n");
+
+    struct kmem_cache *cache = cache_list;
+    while (cache)
+    {
+        uint64_t cached = 0;
+
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        {
+            cached += cache->mags[cpu].count;
+        }
+
+        printf("%-20s %-8llu %-8llu %-8llu %-6llu %u\n",
+               cache->name,
+               (uint64_t)cache->object_size,
+               cache->active_objects - cached,
+               cache->total_objects,
+               cache->nr_slabs,
+               1U << cache->order);
+
+        cache = cache->next;
+    }
+
+    spin_unlock(&slab_lock);
+}
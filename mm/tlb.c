@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Batched TLB invalidation implementation
+ * Unmaps record what they tore down in a tlb_gather and the TLB is
+ * flushed once for the whole range before any frame goes back to the PMM.
+ */
+
+#include <thuban/tlb.h>
+#include <thuban/pmm.h>
+#include <thuban/aspace.h>
+
+/*
+ * Initialize's an empty gather
+ */
+void tlb_gather_init(struct tlb_gather *tlb)
+{
+    tlb->start = (uint64_t)-1;
+    tlb->end = 0;
+    tlb->nr_frames = 0;
+}
+
+/*
+ * Record's an unmapped page
+ */
+void tlb_remove_page(struct tlb_gather *tlb, uint64_t virt, uint64_t phys, unsigned int order)
+{
+    uint64_t end = virt + ((uint64_t)PAGE_SIZE << order);
+
+    if (phys && tlb->nr_frames == TLB_BATCH)
+    {
+        tlb_finish(tlb);
+    }
+
+    if (virt < tlb->start)
+    {
+        tlb->start = virt;
+    }
+
+    if (end > tlb->end)
+    {
+        tlb->end = end;
+    }
+
+    if (phys)
+    {
+        tlb->frames[tlb->nr_frames++] = phys | order;
+    }
+}
+
+/*
+ * Flush's the gathered range then free's its frames
+ */
+void tlb_finish(struct tlb_gather *tlb)
+{
+    if (tlb->end > tlb->start)
+    {
+        flush_tlb_range(tlb->start, tlb->end);
+    }
+
+    for (size_t i = 0; i < tlb->nr_frames; i++)
+    {
+        uint64_t phys = tlb->frames[i] & ~(uint64_t)(PAGE_SIZE - 1);
+        unsigned int order = tlb->frames[i] & (PAGE_SIZE - 1);
+
+        if (order)
+        {
+            pmm_free_pages((void *)phys, (size_t)1 << order);
+        }
+        else
+        {
+            pmm_free((void *)phys);
+        }
+    }
+
+    tlb_gather_init(tlb);
+}
+
+/*
+ * Invalidate's a range of translations
+ * NOTE: Only the calling CPU is flushed, this is where a shootdown IPI to
+ * the other CPUs goes once they run
+ */
+void flush_tlb_range(uint64_t start, uint64_t end)
+{
+    uint64_t pages = (end - start) / PAGE_SIZE;
+
+    if (pages > TLB_FLUSH_CEILING)
+    {
+        flush_tlb_all();
+        return;
+    }
+
+    for (uint64_t addr = start; addr < end; addr += PAGE_SIZE)
+    {
+        asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+    }
+}
+
+/*
+ * Invalidate's every translation
+ * NOTE: Kernel pages are global once CR4.PGE is on, toggling it drops them
+ * along with every PCID's entries. Without it reloading CR3 is enough.
+ */
+void flush_tlb_all(void)
+{
+    uint64_t cr4;
+
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+    if (cr4 & CR4_PGE)
+    {
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+        return;
+    }
+
+    uint64_t cr3;
+
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" : : "r"(cr3 & ~CR3_NOFLUSH) : "memory");
+}
@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2026 Trollycat
+ * Virtual address range allocator implementation
+ * Free ranges sit in two AVL trees at once, one ordered by address to find
+ * neighbours when merging and one ordered by size for best-fit lookup.
+ */
+
+#include <thuban/vmarea.h>
+#include <thuban/slab.h>
+#include <thuban/stdio.h>
+
+#define PAGE_SIZE 4096
+
+#define VA_ADDR 0 // tree ordered by start
+#define VA_SIZE 1 // tree ordered by size, ties by start
+
+struct va_link
+{
+    struct va_node *left;
+    struct va_node *right;
+    int height;
+};
+
+struct va_node
+{
+    uint64_t start;
+    uint64_t size;
+    struct va_link link[2];
+};
+
+static struct kmem_cache *va_node_cache = NULL;
+
+/*
+ * Compare's two nodes in one tree's order
+ */
+static inline int va_cmp(struct va_node *a, struct va_node *b, int tree)
+{
+    if (tree == VA_SIZE && a->size != b->size)
+    {
+        return a->size < b->size ? -1 : 1;
+    }
+
+    if (a->start != b->start)
+    {
+        return a->start < b->start ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Get's a subtree height
+ */
+static inline int va_height(struct va_node *node, int tree)
+{
+    return node ? node->link[tree].height : 0;
+}
+
+/*
+ * Recompute's a node's height from its children
+ */
+static inline void va_update(struct va_node *node, int tree)
+{
+    int l = va_height(node->link[tree].left, tree);
+    int r = va_height(node->link[tree].right, tree);
+
+    node->link[tree].height = (l > r ? l : r) + 1;
+}
+
+/*
+ * Rotate's a subtree left or right and returns its new root
+ */
+static struct va_node *va_rotate(struct va_node *node, int tree, int left)
+{
+    struct va_link *link = &node->link[tree];
+    struct va_node *pivot;
+
+    if (left)
+    {
+        pivot = link->right;
+        link->right = pivot->link[tree].left;
+        pivot->link[tree].left = node;
+    }
+    else
+    {
+        pivot = link->left;
+        link->left = pivot->link[tree].right;
+        pivot->link[tree].right = node;
+    }
+
+    va_update(node, tree);
+    va_update(pivot, tree);
+    return pivot;
+}
+
+/*
+ * Rebalance's a subtree after an insert or remove below it
+ */
+static struct va_node *va_balance(struct va_node *node, int tree)
+{
+    struct va_link *link = &node->link[tree];
+
+    va_update(node, tree);
+
+    int balance = va_height(link->left, tree) - va_height(link->right, tree);
+
+    if (balance > 1)
+    {
+        struct va_link *child = &link->left->link[tree];
+
+        if (va_height(child->left, tree) < va_height(child->right, tree))
+        {
+            link->left = va_rotate(link->left, tree, 1);
+        }
+
+        return va_rotate(node, tree, 0);
+    }
+
+    if (balance < -1)
+    {
+        struct va_link *child = &link->right->link[tree];
+
+        if (va_height(child->right, tree) < va_height(child->left, tree))
+        {
+            link->right = va_rotate(link->right, tree, 0);
+        }
+
+        return va_rotate(node, tree, 1);
+    }
+
+    return node;
+}
+
+/*
+ * Insert's a node into one tree and returns the new root
+ */
+static struct va_node *va_insert(struct va_node *root, struct va_node *node, int tree)
+{
+    if (!root)
+    {
+        node->link[tree].left = NULL;
+        node->link[tree].right = NULL;
+        node->link[tree].height = 1;
+        return node;
+    }
+
+    struct va_link *link = &root->link[tree];
+
+    if (va_cmp(node, root, tree) < 0)
+    {
+        link->left = va_insert(link->left, node, tree);
+    }
+    else
+    {
+        link->right = va_insert(link->right, node, tree);
+    }
+
+    return va_balance(root, tree);
+}
+
+/*
+ * Unlink's the leftmost node of a subtree, stored in *min
+ */
+static struct va_node *va_remove_min(struct va_node *root, struct va_node **min, int tree)
+{
+    struct va_link *link = &root->link[tree];
+
+    if (!link->left)
+    {
+        *min = root;
+        return link->right;
+    }
+
+    link->left = va_remove_min(link->left, min, tree);
+    return va_balance(root, tree);
+}
+
+/*
+ * Remove's a node from one tree and returns the new root
+ */
+static struct va_node *va_remove(struct va_node *root, struct va_node *node, int tree)
+{
+    if (!root)
+    {
+        return NULL;
+    }
+
+    struct va_link *link = &root->link[tree];
+    int cmp = va_cmp(node, root, tree);
+
+    if (cmp < 0)
+    {
+        link->left = va_remove(link->left, node, tree);
+        return va_balance(root, tree);
+    }
+
+    if (cmp > 0)
+    {
+        link->right = va_remove(link->right, node, tree);
+        return va_balance(root, tree);
+    }
+
+    if (!link->left)
+    {
+        return link->right;
+    }
+
+    if (!link->right)
+    {
+        return link->left;
+    }
+
+    // replace the node with its successor
+    struct va_node *next;
+    struct va_node *right = va_remove_min(link->right, &next, tree);
+
+    next->link[tree].left = link->left;
+    next->link[tree].right = right;
+    return va_balance(next, tree);
+}
+
+/*
+ * Link's a free range into both trees
+ * NOTE: Must be called with space->lock held
+ */
+static void va_link_range(struct va_space *space, struct va_node *node)
+{
+    space->by_addr = va_insert(space->by_addr, node, VA_ADDR);
+    space->by_size = va_insert(space->by_size, node, VA_SIZE);
+    space->ranges++;
+}
+
+/*
+ * Unlink's a free range from both trees
+ * NOTE: Must be called with space->lock held
+ */
+static void va_unlink_range(struct va_space *space, struct va_node *node)
+{
+    space->by_addr = va_remove(space->by_addr, node, VA_ADDR);
+    space->by_size = va_remove(space->by_size, node, VA_SIZE);
+    space->ranges--;
+}
+
+/*
+ * Resize's a free range in place, its address order can't change
+ * NOTE: Must be called with space->lock held
+ */
+static void va_resize_range(struct va_space *space, struct va_node *node,
+                            uint64_t start, uint64_t size)
+{
+    space->by_size = va_remove(space->by_size, node, VA_SIZE);
+    node->start = start;
+    node->size = size;
+    space->by_size = va_insert(space->by_size, node, VA_SIZE);
+}
+
+/*
+ * Find's the smallest free range of at least size bytes
+ * NOTE: Must be called with space->lock held
+ */
+static struct va_node *va_best_fit(struct va_space *space, uint64_t size)
+{
+    struct va_node *best = NULL;
+    struct va_node *node = space->by_size;
+
+    while (node)
+    {
+        if (node->size >= size)
+        {
+            best = node;
+            node = node->link[VA_SIZE].left;
+        }
+        else
+        {
+            node = node->link[VA_SIZE].right;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Find's the free ranges either side of an address
+ * NOTE: Must be called with space->lock held
+ */
+static void va_neighbours(struct va_space *space, uint64_t addr,
+                          struct va_node **prev, struct va_node **next)
+{
+    struct va_node *node = space->by_addr;
+
+    *prev = NULL;
+    *next = NULL;
+
+    while (node)
+    {
+        if (node->start < addr)
+        {
+            *prev = node;
+            node = node->link[VA_ADDR].right;
+        }
+        else
+        {
+            *next = node;
+            node = node->link[VA_ADDR].left;
+        }
+    }
+}
+
+/*
+ * Initialize's an address space window
+ */
+int va_space_init(struct va_space *space, const char *name, uint64_t start, uint64_t end)
+{
+    if (!va_node_cache)
+    {
+        va_node_cache = kmem_cache_create("va_node", sizeof(struct va_node), 0, 0, NULL);
+
+        if (!va_node_cache)
+        {
+            return -1;
+        }
+    }
+
+    spin_lock_init(&space->lock, name);
+    space->by_addr = NULL;
+    space->by_size = NULL;
+    space->start = start;
+    space->end = end;
+    space->free_bytes = 0;
+    space->ranges = 0;
+
+    return va_free(space, start, end - start);
+}
+
+/*
+ * Free's every node under a subtree of the address tree
+ */
+static void va_free_tree(struct va_node *node)
+{
+    while (node)
+    {
+        struct va_node *right = node->link[VA_ADDR].right;
+
+        va_free_tree(node->link[VA_ADDR].left);
+        kmem_cache_free(va_node_cache, node);
+        node = right;
+    }
+}
+
+/*
+ * Tear's down an address space window
+ */
+void va_space_destroy(struct va_space *space)
+{
+    spin_lock(&space->lock);
+
+    va_free_tree(space->by_addr);
+    space->by_addr = NULL;
+    space->by_size = NULL;
+    space->free_bytes = 0;
+    space->ranges = 0;
+
+    spin_unlock(&space->lock);
+}
+
+/*
+ * Add's the free ranges under a subtree to another space
+ */
+static int va_copy_tree(struct va_space *dst, struct va_node *node)
+{
+    while (node)
+    {
+        if (va_copy_tree(dst, node->link[VA_ADDR].left) != 0 ||
+            va_free(dst, node->start, node->size) != 0)
+        {
+            return -1;
+        }
+
+        node = node->link[VA_ADDR].right;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy's the free ranges of one space into another covering the same window
+ */
+int va_space_copy(struct va_space *dst, struct va_space *src)
+{
+    if (dst->start != src->start || dst->end != src->end)
+    {
+        return -1;
+    }
+
+    va_space_destroy(dst);
+
+    spin_lock(&src->lock);
+    int ret = va_copy_tree(dst, src->by_addr);
+    spin_unlock(&src->lock);
+
+    return ret;
+}
+
+/*
+ * Allocate's an aligned range by best fit
+ */
+uint64_t va_alloc(struct va_space *space, size_t size, size_t align)
+{
+    if (size == 0 || (size & (PAGE_SIZE - 1)))
+    {
+        return 0;
+    }
+
+    if (align < PAGE_SIZE)
+    {
+        align = PAGE_SIZE;
+    }
+
+    // any range this big holds an aligned block wherever it starts
+    uint64_t need = size + align - PAGE_SIZE;
+
+    spin_lock(&space->lock);
+
+    struct va_node *node = va_best_fit(space, need);
+
+    if (!node)
+    {
+        spin_unlock(&space->lock);
+        return 0;
+    }
+
+    uint64_t addr = (node->start + align - 1) & ~(uint64_t)(align - 1);
+    uint64_t front = addr - node->start;
+    uint64_t back = node->start + node->size - (addr + size);
+
+    if (front && back)
+    {
+        // the node keeps the front, the back needs a node of its own
+        struct va_node *tail = kmem_cache_alloc(va_node_cache);
+
+        if (!tail)
+        {
+            spin_unlock(&space->lock);
+            return 0;
+        }
+
+        va_resize_range(space, node, node->start, front);
+
+        tail->start = addr + size;
+        tail->size = back;
+        va_link_range(space, tail);
+    }
+    else if (front || back)
+    {
+        va_resize_range(space, node, front ? node->start : addr + size, front ? front : back);
+    }
+    else
+    {
+        va_unlink_range(space, node);
+        kmem_cache_free(va_node_cache, node);
+    }
+
+    space->free_bytes -= size;
+
+    spin_unlock(&space->lock);
+    return addr;
+}
+
+/*
+ * Free's a range, merging it with the ranges either side
+ */
+int va_free(struct va_space *space, uint64_t start, size_t size)
+{
+    uint64_t end = start + size;
+
+    if (size == 0 || start < space->start || end > space->end || end < start)
+    {
+        printf("[VMM] Bad range free 0x%llx+0x%llx\n", start, (uint64_t)size);
+        return -1;
+    }
+
+    spin_lock(&space->lock);
+
+    struct va_node *prev;
+    struct va_node *next;
+
+    va_neighbours(space, start, &prev, &next);
+
+    if ((prev && prev->start + prev->size > start) || (next && next->start < end))
+    {
+        spin_unlock(&space->lock);
+        printf("[VMM] Range 0x%llx+0x%llx is already free\n", start, (uint64_t)size);
+        return -1;
+    }
+
+    int merge_prev = prev && prev->start + prev->size == start;
+    int merge_next = next && next->start == end;
+
+    if (merge_prev && merge_next)
+    {
+        uint64_t next_size = next->size;
+
+        va_unlink_range(space, next);
+        kmem_cache_free(va_node_cache, next);
+        va_resize_range(space, prev, prev->start, prev->size + size + next_size);
+    }
+    else if (merge_prev)
+    {
+        va_resize_range(space, prev, prev->start, prev->size + size);
+    }
+    else if (merge_next)
+    {
+        va_resize_range(space, next, start, next->size + size);
+    }
+    else
+    {
+        struct va_node *node = kmem_cache_alloc(va_node_cache);
+
+        if (!node)
+        {
+            spin_unlock(&space->lock);
+            printf("[VMM] Out of range nodes, leaking 0x%llx+0x%llx\n", start, (uint64_t)size);
+            return -1;
+        }
+
+        node->start = start;
+        node->size = size;
+        va_link_range(space, node);
+    }
+
+    space->free_bytes += size;
+
+    spin_unlock(&space->lock);
+    return 0;
+}
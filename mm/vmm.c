@@ -8,76 +8,236 @@
 #include <thuban/stdio.h>
 #include <thuban/string.h>
 #include <thuban/spinlock.h>
+#include <thuban/vmarea.h>
+#include <thuban/paging.h>
+#include <thuban/tlb.h>
+#include <thuban/slab.h>
+#include <thuban/aspace.h>
+#include <thuban/page.h>
+#include <thuban/filemap.h>
 
-#define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
-#define PAGE_SIZE 4096
+#define VMM_ALLOC_START 0xFFFFFFFFC0000000ULL
+#define VMM_ALLOC_END 0xFFFFFFFFFFFFF000ULL // last page left out so ranges never wrap
 
-extern uint64_t p4_table;
+static struct va_space vmm_space;
+static struct va_space vmalloc_space;
 
-static uint64_t next_virt_addr = 0xFFFFFFFFC0000000ULL;
+#define VMALLOC_MAGIC 0x564D414C // "VMAL"
+
+/*
+ * Header at the start of every vmalloc mapping, padded so the
+ * returned pointer keeps the heap's 16 byte alignment
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t pages; // mapped pages, guards not included
+    uint64_t reserved;
+} vmalloc_hdr_t;
+
+/*
+ * Range reserved with VMM_DEMAND, backed a frame at a time
+ * by the page fault handler as it is touched. A file region
+ * is backed from the file's page cache instead of zeroes.
+ */
+struct vmm_region
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;       // page flags every frame is mapped with
+    struct vm_file *file; // page cache backing the region, NULL for zeroes
+    uint64_t pgoff;       // file page mapped at start
+    int shared;           // writes reach the file rather than a private copy
+    int guard;            // an unreserved page below start is held with it
+    struct vmm_region *next;
+};
+
+static struct kmem_cache *vmm_region_cache = NULL;
+
+// frame of zeroes mapped read-only for reads of untouched demand pages
+static uint64_t zero_page = 0;
 
 /* Spinlock to protect VMM operations */
 static spinlock_t vmm_lock = SPINLOCK_INIT_NAMED("vmm");
 
 /*
- * Get's page table entry
- * NOTE: Must be called with vmm_lock held
+ * Claim's a page directory entry for a 2MB mapping
+ * NOTE: Must be called with vmm_lock held, a leftover page table with
+ * nothing mapped in it is freed, anything else means no
  */
-static uint64_t *get_pte(uint64_t virt, int create)
+static int claim_huge_pde(uint64_t *pde)
 {
-    uint64_t *pml4 = &p4_table;
+    if (!(*pde & PAGE_PRESENT))
+        return 1;
+
+    if (*pde & PAGE_HUGE)
+        return 0;
 
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx = (virt >> 12) & 0x1FF;
+    uint64_t *pt = (uint64_t *)phys_to_virt(*pde & PAGING_ADDR_MASK);
 
-    if (!(pml4[pml4_idx] & PAGE_PRESENT))
+    for (int i = 0; i < 512; i++)
     {
-        if (!create)
-            return NULL;
+        if (pt[i] & PAGE_PRESENT)
+            return 0;
+    }
 
-        void *page = pmm_alloc();
-        if (!page)
-            return NULL;
+    pmm_free((void *)(*pde & PAGING_ADDR_MASK));
+    *pde = 0;
+    return 1;
+}
+
+/*
+ * Get's the top level table that maps an address
+ * NOTE: The kernel half is the same in every space
+ */
+static inline uint64_t *vmm_root(uint64_t virt)
+{
+    return is_user_addr(virt) ? aspace_current()->pml4 : kernel_space.pml4;
+}
+
+/*
+ * Find's the demand region holding an address
+ * NOTE: Must be called with vmm_lock held
+ */
+static struct vmm_region *region_find(struct address_space *as, uint64_t virt)
+{
+    for (struct vmm_region *region = as->regions; region && region->start <= virt; region = region->next)
+    {
+        if (virt < region->end)
+        {
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Record's a demand region
+ * NOTE: Must be called with vmm_lock held, a file region takes a
+ * reference on the page cache of its own
+ */
+static struct vmm_region *region_insert(struct address_space *as, uint64_t start, uint64_t end, uint64_t flags,
+                                        struct vm_file *file, uint64_t pgoff, int shared)
+{
+    struct vmm_region *region = kmem_cache_alloc(vmm_region_cache);
 
-        memset((void *)((uint64_t)page + KERNEL_VIRT_BASE), 0, PAGE_SIZE);
-        pml4[pml4_idx] = (uint64_t)page | PAGE_PRESENT | PAGE_WRITE;
+    if (!region)
+    {
+        return NULL;
     }
 
-    uint64_t *pdpt = (uint64_t *)((pml4[pml4_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->file = file;
+    region->pgoff = pgoff;
+    region->shared = shared;
+    region->guard = 0;
 
-    if (!(pdpt[pdpt_idx] & PAGE_PRESENT))
+    if (file)
     {
-        if (!create)
-            return NULL;
+        filemap_get(file);
+    }
 
-        void *page = pmm_alloc();
-        if (!page)
-            return NULL;
+    struct vmm_region **link = &as->regions;
 
-        memset((void *)((uint64_t)page + KERNEL_VIRT_BASE), 0, PAGE_SIZE);
-        pdpt[pdpt_idx] = (uint64_t)page | PAGE_PRESENT | PAGE_WRITE;
+    while (*link && (*link)->start < start)
+    {
+        link = &(*link)->next;
     }
 
-    uint64_t *pd = (uint64_t *)((pdpt[pdpt_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+    region->next = *link;
+    *link = region;
+    return region;
+}
+
+/*
+ * Drop's [start, end) from the demand regions
+ * NOTE: Must be called with vmm_lock held, a region straddling the hole
+ * is split in two and loses its tail when no node can be had. Regions
+ * dropped whole go on dead for region_free once the lock is released.
+ */
+static void region_remove(struct address_space *as, uint64_t start, uint64_t end, struct vmm_region **dead)
+{
+    struct vmm_region **link = &as->regions;
 
-    if (!(pd[pd_idx] & PAGE_PRESENT))
+    while (*link && (*link)->start < end)
     {
-        if (!create)
-            return NULL;
+        struct vmm_region *region = *link;
 
-        void *page = pmm_alloc();
-        if (!page)
-            return NULL;
+        if (region->end <= start)
+        {
+            link = &region->next;
+            continue;
+        }
+
+        if (region->start >= start && region->end <= end)
+        {
+            *link = region->next;
+            region->next = *dead;
+            *dead = region;
+            continue;
+        }
+
+        if (region->start < start && region->end > end)
+        {
+            struct vmm_region *tail = kmem_cache_alloc(vmm_region_cache);
+
+            if (tail)
+            {
+                *tail = *region;
+                tail->start = end;
+                tail->guard = 0;
+                tail->pgoff = region->pgoff + (end - region->start) / PAGE_SIZE;
+                region->next = tail;
+
+                if (tail->file)
+                {
+                    filemap_get(tail->file);
+                }
+            }
+
+            region->end = start;
+            return;
+        }
+
+        if (region->start < start)
+        {
+            region->end = start;
+        }
+        else
+        {
+            // the guard went with the head, the caller gave it back
+            region->pgoff += (end - region->start) / PAGE_SIZE;
+            region->start = end;
+            region->guard = 0;
+        }
 
-        memset((void *)((uint64_t)page + KERNEL_VIRT_BASE), 0, PAGE_SIZE);
-        pd[pd_idx] = (uint64_t)page | PAGE_PRESENT | PAGE_WRITE;
+        link = &region->next;
     }
+}
+
+/*
+ * Free's regions dropped by region_remove
+ * NOTE: Must be called without vmm_lock held, the last reference on
+ * a page cache writes its dirty pages back
+ */
+static void region_free(struct vmm_region *dead)
+{
+    while (dead)
+    {
+        struct vmm_region *region = dead;
 
-    uint64_t *pt = (uint64_t *)((pd[pd_idx] & ~0xFFF) + KERNEL_VIRT_BASE);
+        dead = region->next;
 
-    return &pt[pt_idx];
+        if (region->file)
+        {
+            filemap_put(region->file);
+        }
+
+        kmem_cache_free(vmm_region_cache, region);
+    }
 }
 
 /*
@@ -86,6 +246,17 @@ static uint64_t *get_pte(uint64_t virt, int create)
 void vmm_init(void)
 {
     spin_lock_init(&vmm_lock, "vmm");
+
+    vmm_region_cache = kmem_cache_create("vmm_region", sizeof(struct vmm_region), 0, 0, NULL);
+
+    // the VMM's own reference keeps the frame from ever being freed
+    zero_page = (uint64_t)pmm_alloc_flags(PMM_ZERO);
+
+    if (va_space_init(&vmm_space, "vmm_space", VMM_ALLOC_START, VMM_ALLOC_END) != 0 ||
+        va_space_init(&vmalloc_space, "vmalloc_space", VMALLOC_START, VMALLOC_END) != 0)
+    {
+        printf("[VMM] Failed to set up virtual address spaces\n");
+    }
 }
 
 /*
@@ -93,9 +264,19 @@ void vmm_init(void)
  */
 void vmm_map(uint64_t virt, uint64_t phys, uint64_t flags)
 {
+    struct pt_walk walk;
+
+    pt_walk_init(&walk, vmm_root(virt));
+
+    // kernel mappings are global so a CR3 switch keeps them
+    if (!is_user_addr(virt))
+    {
+        flags |= PAGING_GLOBAL;
+    }
+
     spin_lock(&vmm_lock);
 
-    uint64_t *pte = get_pte(virt, 1);
+    uint64_t *pte = pt_walk(&walk, virt, PT_LEVEL_PTE, PT_WALK_CREATE | PT_WALK_SPLIT, NULL);
 
     if (!pte)
     {
@@ -104,7 +285,7 @@ void vmm_map(uint64_t virt, uint64_t phys, uint64_t flags)
         return;
     }
 
-    *pte = (phys & ~0xFFF) | flags | PAGE_PRESENT;
+    *pte = (phys & PAGING_ADDR_MASK) | flags | PAGE_PRESENT;
 
     asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
 
@@ -116,9 +297,13 @@ void vmm_map(uint64_t virt, uint64_t phys, uint64_t flags)
  */
 void vmm_unmap(uint64_t virt)
 {
+    struct pt_walk walk;
+
+    pt_walk_init(&walk, vmm_root(virt));
+
     spin_lock(&vmm_lock);
 
-    uint64_t *pte = get_pte(virt, 0);
+    uint64_t *pte = pt_walk(&walk, virt, PT_LEVEL_PTE, PT_WALK_SPLIT, NULL);
 
     if (!pte)
     {
@@ -133,40 +318,166 @@ void vmm_unmap(uint64_t virt)
     spin_unlock(&vmm_lock);
 }
 
+/*
+ * Unmap's pages, gathering their frames to free once the TLB is flushed
+ * NOTE: Must be called with vmm_lock held, a 2MB mapping only partly
+ * covered by the range is split first. One walk serves the whole range
+ * and a missing table skips the 2MB it would have covered.
+ */
+static void unmap_pages(struct address_space *as, struct tlb_gather *tlb, uint64_t virt, size_t pages)
+{
+    struct pt_walk walk;
+    size_t i = 0;
+
+    pt_walk_init(&walk, as->pml4);
+
+    while (i < pages)
+    {
+        uint64_t virt_addr = virt + (i * PAGE_SIZE);
+        int leaf;
+        uint64_t *entry = pt_walk(&walk, virt_addr, PT_LEVEL_PTE, 0, &leaf);
+
+        if (!entry)
+        {
+            i += (HUGE_PAGE_SIZE - (virt_addr & (HUGE_PAGE_SIZE - 1))) / PAGE_SIZE;
+            continue;
+        }
+
+        if (leaf == PT_LEVEL_PDE && !(virt_addr & (HUGE_PAGE_SIZE - 1)) && pages - i >= HUGE_PAGE_PAGES)
+        {
+            uint64_t phys = *entry & PAGING_ADDR_MASK & ~(HUGE_PAGE_SIZE - 1);
+            *entry = 0;
+
+            tlb_remove_page(tlb, virt_addr, phys, 9);
+            i += HUGE_PAGE_PAGES;
+            continue;
+        }
+
+        if (leaf != PT_LEVEL_PTE)
+        {
+            entry = pt_walk(&walk, virt_addr, PT_LEVEL_PTE, PT_WALK_SPLIT, NULL);
+        }
+
+        if (entry && (*entry & PAGE_PRESENT))
+        {
+            filemap_dirty_pte(*entry);
+            tlb_remove_page(tlb, virt_addr, *entry & PAGING_ADDR_MASK, 0);
+            *entry = 0;
+        }
+
+        i++;
+    }
+}
+
+/*
+ * Map's freshly allocated frames
+ * NOTE: Must be called with vmm_lock held. Every 2MB aligned stretch is
+ * backed by one order-9 run behind a PDE when the PMM has one, the rest
+ * one frame at a time from any zone so fragmentation never fails it.
+ * Entries only go from not present to present, which needs no invlpg.
+ */
+static int map_pages(uint64_t virt, size_t pages, uint64_t flags)
+{
+    struct pt_walk walk;
+    size_t i = 0;
+
+    pt_walk_init(&walk, kernel_space.pml4);
+
+    while (i < pages)
+    {
+        uint64_t virt_addr = virt + (i * PAGE_SIZE);
+
+        if (!(virt_addr & (HUGE_PAGE_SIZE - 1)) && pages - i >= HUGE_PAGE_PAGES)
+        {
+            int leaf;
+            uint64_t *pde = pt_walk(&walk, virt_addr, PT_LEVEL_PDE, PT_WALK_CREATE, &leaf);
+
+            if (pde && leaf == PT_LEVEL_PDE && claim_huge_pde(pde))
+            {
+                void *run = pmm_alloc_pages(HUGE_PAGE_PAGES);
+
+                if (run)
+                {
+                    // the PDE may have pointed at a page table the CPU still caches
+                    *pde = (uint64_t)run | flags | PAGE_PRESENT | PAGE_HUGE;
+                    asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+
+                    i += HUGE_PAGE_PAGES;
+                    continue;
+                }
+            }
+        }
+
+        void *phys = pmm_alloc();
+        uint64_t *pte = phys ? pt_walk(&walk, virt_addr, PT_LEVEL_PTE, PT_WALK_CREATE | PT_WALK_SPLIT, NULL) : NULL;
+
+        if (!pte)
+        {
+            struct tlb_gather tlb;
+
+            if (phys)
+            {
+                pmm_free(phys);
+            }
+
+            tlb_gather_init(&tlb);
+            unmap_pages(&kernel_space, &tlb, virt, i);
+            tlb_finish(&tlb);
+            return -1;
+        }
+
+        *pte = ((uint64_t)phys & PAGING_ADDR_MASK) | flags | PAGE_PRESENT;
+
+        i++;
+    }
+
+    return 0;
+}
+
 /*
  * Allocate's virtual pages
+ * NOTE: With VMM_DEMAND only the range is reserved, each page is backed
+ * by a zeroed frame when it is first touched
  */
 void *vmm_alloc(size_t pages, uint64_t flags)
 {
-    void *phys = pmm_alloc_pages(pages);
-    if (!phys)
+    int demand = (flags & VMM_DEMAND) != 0;
+
+    flags = (flags & ~VMM_DEMAND) | PAGING_GLOBAL;
+
+    // 2MB alignment lets map_pages use huge pages for the bulk of the range
+    size_t align = pages >= HUGE_PAGE_PAGES && !demand ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    uint64_t virt_start = va_alloc(&vmm_space, pages * PAGE_SIZE, align);
+
+    if (!virt_start)
     {
+        printf("[VMM] Out of virtual address space\n");
         return NULL;
     }
 
     spin_lock(&vmm_lock);
 
-    uint64_t virt_start = next_virt_addr;
-
-    for (size_t i = 0; i < pages; i++)
+    if (demand)
     {
-        uint64_t virt = next_virt_addr + (i * PAGE_SIZE);
-        uint64_t phys_addr = (uint64_t)phys + (i * PAGE_SIZE);
-
-        uint64_t *pte = get_pte(virt, 1);
-        if (!pte)
+        if (!region_insert(&kernel_space, virt_start, virt_start + pages * PAGE_SIZE, flags, NULL, 0, 0))
         {
             spin_unlock(&vmm_lock);
-            printf("[VMM] Failed to allocate virtual pages\n");
-            pmm_free_pages(phys, pages);
+            va_free(&vmm_space, virt_start, pages * PAGE_SIZE);
+            printf("[VMM] Failed to reserve virtual pages\n");
             return NULL;
         }
 
-        *pte = (phys_addr & ~0xFFF) | flags | PAGE_PRESENT;
-        asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+        spin_unlock(&vmm_lock);
+        return (void *)virt_start;
     }
 
-    next_virt_addr += pages * PAGE_SIZE;
+    if (map_pages(virt_start, pages, flags) < 0)
+    {
+        spin_unlock(&vmm_lock);
+        va_free(&vmm_space, virt_start, pages * PAGE_SIZE);
+        printf("[VMM] Failed to allocate virtual pages\n");
+        return NULL;
+    }
 
     spin_unlock(&vmm_lock);
     return (void *)virt_start;
@@ -177,41 +488,750 @@ void *vmm_alloc(size_t pages, uint64_t flags)
  */
 void vmm_free(void *virt, size_t pages)
 {
+    struct tlb_gather tlb;
+    struct vmm_region *dead = NULL;
+
+    tlb_gather_init(&tlb);
+
     spin_lock(&vmm_lock);
+    unmap_pages(&kernel_space, &tlb, (uint64_t)virt, pages);
+    region_remove(&kernel_space, (uint64_t)virt, (uint64_t)virt + pages * PAGE_SIZE, &dead);
+    spin_unlock(&vmm_lock);
+
+    // the range isn't reusable until va_free so the flush can wait for the unlock
+    tlb_finish(&tlb);
+    region_free(dead);
+
+    va_free(&vmm_space, (uint64_t)virt, pages * PAGE_SIZE);
+}
+
+/*
+ * Map's a physical range into kernel space
+ * NOTE: The frames aren't the PMM's, vmm_iounmap drops the mapping but
+ * never frees them. Device registers want PAGING_CACHE_DISABLE in flags
+ */
+void *vmm_ioremap(uint64_t phys, size_t size, uint64_t flags)
+{
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    size_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t virt = va_alloc(&vmm_space, pages * PAGE_SIZE, PAGE_SIZE);
+
+    if (!virt)
+    {
+        printf("[VMM] Out of virtual address space\n");
+        return NULL;
+    }
 
     for (size_t i = 0; i < pages; i++)
     {
-        uint64_t virt_addr = (uint64_t)virt + (i * PAGE_SIZE);
-        uint64_t *pte = get_pte(virt_addr, 0);
+        vmm_map(virt + i * PAGE_SIZE, phys - offset + i * PAGE_SIZE, flags | PAGE_WRITE);
+    }
 
-        if (pte && (*pte & PAGE_PRESENT))
-        {
-            uint64_t phys = (*pte & ~0xFFF);
-            pmm_free((void *)phys);
-            *pte = 0;
-            asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
-        }
+    return (void *)(virt + offset);
+}
+
+/*
+ * Unmap's a range from vmm_ioremap
+ */
+void vmm_iounmap(void *virt, size_t size)
+{
+    uint64_t offset = (uint64_t)virt & (PAGE_SIZE - 1);
+    uint64_t base = (uint64_t)virt - offset;
+    size_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    for (size_t i = 0; i < pages; i++)
+    {
+        vmm_unmap(base + i * PAGE_SIZE);
     }
 
-    spin_unlock(&vmm_lock);
+    va_free(&vmm_space, base, pages * PAGE_SIZE);
 }
 
 /*
- * Get's physical address from virtual
+ * Reserve's a demand region of user pages
+ * NOTE: With guard an unreserved page is left below the range
  */
-uint64_t vmm_get_phys(uint64_t virt)
+static uint64_t user_reserve(struct address_space *as, size_t pages, uint64_t flags, int guard,
+                             struct vm_file *file, uint64_t pgoff, int shared)
 {
+    size_t span = (pages + (guard ? 1 : 0)) * PAGE_SIZE;
+    uint64_t base = va_alloc(&as->user_va, span, PAGE_SIZE);
+
+    if (!base)
+    {
+        return 0;
+    }
+
+    uint64_t virt = base + (guard ? PAGE_SIZE : 0);
+
     spin_lock(&vmm_lock);
 
-    uint64_t *pte = get_pte(virt, 0);
+    struct vmm_region *region = region_insert(as, virt, virt + pages * PAGE_SIZE, (flags & ~VMM_DEMAND) | PAGE_USER,
+                                              file, pgoff, shared);
 
-    if (!pte || !(*pte & PAGE_PRESENT))
+    if (!region)
     {
         spin_unlock(&vmm_lock);
+        va_free(&as->user_va, base, span);
         return 0;
     }
 
-    uint64_t phys = (*pte & ~0xFFF) | (virt & 0xFFF);
+    region->guard = guard;
+
     spin_unlock(&vmm_lock);
-    return phys;
-}
\ No newline at end of file
+    return virt;
+}
+
+/*
+ * Allocate's user pages in an address space
+ * NOTE: Pages are always backed on first touch and an unreserved guard
+ * page sits below the range so a stack running off its end faults
+ */
+void *vmm_alloc_user(struct address_space *as, size_t pages, uint64_t flags)
+{
+    return (void *)user_reserve(as, pages, flags, 1, NULL, 0, 0);
+}
+
+/*
+ * Free's user pages from vmm_alloc_user
+ */
+void vmm_free_user(struct address_space *as, void *virt, size_t pages)
+{
+    struct tlb_gather tlb;
+    struct vmm_region *dead = NULL;
+
+    tlb_gather_init(&tlb);
+
+    spin_lock(&vmm_lock);
+    unmap_pages(as, &tlb, (uint64_t)virt, pages);
+    region_remove(as, (uint64_t)virt, (uint64_t)virt + pages * PAGE_SIZE, &dead);
+    spin_unlock(&vmm_lock);
+
+    // another space's PCID keeps its translations until it is next loaded
+    if (as != aspace_current())
+    {
+        as->stale = 1;
+    }
+
+    tlb_finish(&tlb);
+    region_free(dead);
+
+    va_free(&as->user_va, (uint64_t)virt - PAGE_SIZE, (pages + 1) * PAGE_SIZE);
+}
+
+/*
+ * Map's pages of a file into an address space
+ * NOTE: Pages are read into the file's page cache on first touch. A shared
+ * mapping maps the cached frames themselves, a private one maps them
+ * copy-on-write. Without a file this is anonymous memory with no guard.
+ */
+void *vmm_mmap(struct address_space *as, size_t pages, uint64_t flags, struct vm_file *file, uint64_t pgoff,
+               int shared)
+{
+    return (void *)user_reserve(as, pages, flags, 0, file, pgoff, file ? shared : 0);
+}
+
+/*
+ * Unmap's a range of user pages
+ * NOTE: Only the parts of the range inside regions are unmapped and
+ * returned to the address space, the rest was never handed out or is
+ * someone's guard. A guard goes back once the page above it does.
+ */
+int vmm_munmap(struct address_space *as, uint64_t virt, size_t pages)
+{
+    uint64_t end = virt + pages * PAGE_SIZE;
+    struct tlb_gather tlb;
+    struct vmm_region *dead = NULL;
+
+    // ring 3 runs in the kernel's PML4 too, so anything below the
+    // allocation window may be the kernel's own mappings
+    if ((virt & (PAGE_SIZE - 1)) || pages == 0 || end < virt || virt < USER_ALLOC_START || end > USER_ALLOC_END)
+    {
+        return -1;
+    }
+
+    tlb_gather_init(&tlb);
+
+    spin_lock(&vmm_lock);
+
+    // only page tables under a region belong to this space's allocations
+    for (struct vmm_region *region = as->regions; region && region->start < end; region = region->next)
+    {
+        uint64_t lo = region->start > virt ? region->start : virt;
+        uint64_t hi = region->end < end ? region->end : end;
+
+        if (lo < hi)
+        {
+            unmap_pages(as, &tlb, lo, (hi - lo) / PAGE_SIZE);
+
+            // the guard below a region leaves along with its first page
+            if (region->guard && lo == region->start)
+            {
+                lo -= PAGE_SIZE;
+            }
+
+            va_free(&as->user_va, lo, hi - lo);
+        }
+    }
+
+    region_remove(as, virt, end, &dead);
+
+    spin_unlock(&vmm_lock);
+
+    if (as != aspace_current())
+    {
+        as->stale = 1;
+    }
+
+    tlb_finish(&tlb);
+    region_free(dead);
+    return 0;
+}
+
+/*
+ * Write's back the dirty file pages in a range of user pages
+ * NOTE: Dirty bits move from the page tables to the cached frames so a
+ * page only goes to disk again once it is written again
+ */
+int vmm_msync(struct address_space *as, uint64_t virt, size_t pages)
+{
+    uint64_t end = virt + pages * PAGE_SIZE;
+    struct pt_walk walk;
+    int ret = 0;
+
+    if ((virt & (PAGE_SIZE - 1)) || end < virt || !is_user_addr(end - 1))
+    {
+        return -1;
+    }
+
+    pt_walk_init(&walk, as->pml4);
+
+    spin_lock(&vmm_lock);
+
+    for (struct vmm_region *region = as->regions; region && region->start < end; region = region->next)
+    {
+        if (!region->file || !region->shared || region->end <= virt)
+        {
+            continue;
+        }
+
+        uint64_t lo = region->start > virt ? region->start : virt;
+        uint64_t hi = region->end < end ? region->end : end;
+
+        for (uint64_t addr = lo; addr < hi; addr += PAGE_SIZE)
+        {
+            uint64_t *pte = pt_walk(&walk, addr, PT_LEVEL_PTE, 0, NULL);
+
+            if (pte && (*pte & PAGE_PRESENT) && (*pte & PAGING_DIRTY))
+            {
+                filemap_dirty_pte(*pte);
+                *pte &= ~PAGING_DIRTY;
+                asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+            }
+        }
+    }
+
+    spin_unlock(&vmm_lock);
+
+    // regions can't be held across the writes, so look each one up again
+    for (uint64_t addr = virt; addr < end;)
+    {
+        spin_lock(&vmm_lock);
+
+        struct vmm_region *region = as->regions;
+
+        while (region && region->end <= addr)
+        {
+            region = region->next;
+        }
+
+        if (!region || region->start >= end)
+        {
+            spin_unlock(&vmm_lock);
+            break;
+        }
+
+        uint64_t lo = region->start > addr ? region->start : addr;
+        uint64_t hi = region->end < end ? region->end : end;
+        struct vm_file *file = region->shared ? region->file : NULL;
+        uint64_t first = region->pgoff + (lo - region->start) / PAGE_SIZE;
+
+        if (file)
+        {
+            filemap_get(file);
+        }
+
+        spin_unlock(&vmm_lock);
+
+        if (file)
+        {
+            if (filemap_sync(file, first, first + (hi - lo) / PAGE_SIZE - 1) < 0)
+            {
+                ret = -1;
+            }
+
+            filemap_put(file);
+        }
+
+        addr = hi;
+    }
+
+    return ret;
+}
+
+/*
+ * Share's a range of src's pages with dst copy-on-write
+ * NOTE: Must be called with vmm_lock held. Writable pages lose write access
+ * on both sides and get PAGE_COW, every shared frame gains a reference and
+ * no frame is copied. Pages dst already maps are left alone. Without cow
+ * the pages are shared as they are, writes and all.
+ */
+static int share_range(struct address_space *dst, struct address_space *src, struct tlb_gather *tlb,
+                       uint64_t start, size_t pages, int cow)
+{
+    struct pt_walk src_walk;
+    struct pt_walk dst_walk;
+    size_t i = 0;
+
+    pt_walk_init(&src_walk, src->pml4);
+    pt_walk_init(&dst_walk, dst->pml4);
+
+    while (i < pages)
+    {
+        uint64_t virt = start + (i * PAGE_SIZE);
+        uint64_t *spte = pt_walk(&src_walk, virt, PT_LEVEL_PTE, PT_WALK_SPLIT, NULL);
+
+        if (!spte)
+        {
+            i += (HUGE_PAGE_SIZE - (virt & (HUGE_PAGE_SIZE - 1))) / PAGE_SIZE;
+            continue;
+        }
+
+        if (!(*spte & PAGE_PRESENT))
+        {
+            i++;
+            continue;
+        }
+
+        uint64_t *dpte = pt_walk(&dst_walk, virt, PT_LEVEL_PTE, PT_WALK_CREATE | PT_WALK_SPLIT, NULL);
+
+        if (!dpte)
+        {
+            return -1;
+        }
+
+        if (!(*dpte & PAGE_PRESENT))
+        {
+            uint64_t pfn = (*spte & PAGING_ADDR_MASK) / PAGE_SIZE;
+
+            if (cow && (*spte & PAGE_WRITE))
+            {
+                *spte = (*spte & ~PAGE_WRITE) | PAGE_COW;
+                tlb_remove_page(tlb, virt, 0, 0);
+            }
+
+            if (pfn_valid(pfn))
+            {
+                get_page(pfn_to_page(pfn));
+            }
+
+            *dpte = *spte;
+        }
+
+        i++;
+    }
+
+    return 0;
+}
+
+/*
+ * Share's src's pages in a user range with dst copy-on-write
+ */
+int vmm_share_cow(struct address_space *dst, struct address_space *src, uint64_t start, size_t pages)
+{
+    struct tlb_gather tlb;
+
+    if (!is_user_addr(start + pages * PAGE_SIZE - 1))
+    {
+        return -1;
+    }
+
+    tlb_gather_init(&tlb);
+
+    spin_lock(&vmm_lock);
+    int ret = share_range(dst, src, &tlb, start, pages, 1);
+    spin_unlock(&vmm_lock);
+
+    // src may still hold writable translations for the pages it just shared
+    if (src != aspace_current())
+    {
+        src->stale = 1;
+    }
+
+    tlb_finish(&tlb);
+    return ret;
+}
+
+/*
+ * Give's dst src's demand regions and share's all their pages copy-on-write
+ * NOTE: This is the VMM half of fork, dst must be fresh from aspace_create.
+ * Pages of shared file regions are shared outright.
+ */
+int vmm_clone_user(struct address_space *dst, struct address_space *src)
+{
+    struct tlb_gather tlb;
+    int ret = 0;
+
+    tlb_gather_init(&tlb);
+
+    spin_lock(&vmm_lock);
+
+    for (struct vmm_region *region = src->regions; region; region = region->next)
+    {
+        // a shared file mapping stays shared in the child
+        int cow = !(region->file && region->shared);
+
+        struct vmm_region *copy = region_insert(dst, region->start, region->end, region->flags, region->file,
+                                                region->pgoff, region->shared);
+
+        if (!copy ||
+            share_range(dst, src, &tlb, region->start, (region->end - region->start) / PAGE_SIZE, cow) < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        copy->guard = region->guard;
+    }
+
+    spin_unlock(&vmm_lock);
+
+    if (src != aspace_current())
+    {
+        src->stale = 1;
+    }
+
+    tlb_finish(&tlb);
+    return ret;
+}
+
+/*
+ * Break's copy-on-write sharing of a page on a write fault
+ * NOTE: Must be called with vmm_lock held. The last sharer just gets write
+ * access back, anyone else gets a private copy of the frame. A copy of the
+ * zero page is just a zeroed frame, usually straight from the pool.
+ */
+static int break_cow(uint64_t *pte, uint64_t virt)
+{
+    uint64_t phys = *pte & PAGING_ADDR_MASK;
+    uint64_t flags = (*pte & ~PAGING_ADDR_MASK & ~PAGE_COW) | PAGE_WRITE;
+    uint64_t pfn = phys / PAGE_SIZE;
+
+    if (pfn_valid(pfn) && pfn_to_page(pfn)->refcount == 1)
+    {
+        *pte = phys | flags;
+    }
+    else
+    {
+        void *copy = pmm_alloc_flags(phys == zero_page ? PMM_ZERO : 0);
+
+        if (!copy)
+        {
+            printf("[VMM] Out of memory breaking sharing at 0x%llx\n", virt);
+            return -1;
+        }
+
+        if (phys != zero_page)
+        {
+            memcpy(phys_to_virt((uint64_t)copy), phys_to_virt(phys), PAGE_SIZE);
+        }
+        *pte = (uint64_t)copy | flags;
+
+        if (pfn_valid(pfn))
+        {
+            put_page(pfn_to_page(pfn));
+        }
+    }
+
+    // the read-only translation may be cached
+    asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    return 0;
+}
+
+/*
+ * Drop's every demand region of an address space
+ * NOTE: Its pages must be unmapped first so their dirty bits reach the
+ * page caches before the caches are written back
+ */
+void vmm_drop_regions(struct address_space *as)
+{
+    spin_lock(&vmm_lock);
+
+    struct vmm_region *dead = as->regions;
+    as->regions = NULL;
+
+    spin_unlock(&vmm_lock);
+
+    region_free(dead);
+}
+
+/*
+ * Allocate's a large block in the vmalloc range
+ * NOTE: One unmapped guard page sits either side of every mapping so
+ * an overrun faults instead of corrupting the neighbour
+ */
+void *vmalloc(size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    size_t pages = (size + sizeof(vmalloc_hdr_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t span = (pages + 2) * PAGE_SIZE;
+
+    uint64_t base = va_alloc(&vmalloc_space, span, PAGE_SIZE);
+
+    if (!base)
+    {
+        return NULL;
+    }
+
+    uint64_t virt = base + PAGE_SIZE;
+
+    spin_lock(&vmm_lock);
+
+    if (map_pages(virt, pages, PAGE_WRITE | PAGING_GLOBAL) < 0)
+    {
+        spin_unlock(&vmm_lock);
+        va_free(&vmalloc_space, base, span);
+        return NULL;
+    }
+
+    spin_unlock(&vmm_lock);
+
+    vmalloc_hdr_t *hdr = (vmalloc_hdr_t *)virt;
+    hdr->magic = VMALLOC_MAGIC;
+    hdr->pages = (uint32_t)pages;
+    hdr->reserved = 0;
+
+    return hdr + 1;
+}
+
+/*
+ * Free's a block from vmalloc
+ */
+void vfree(void *ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    vmalloc_hdr_t *hdr = (vmalloc_hdr_t *)ptr - 1;
+
+    if (!is_vmalloc_addr(ptr) || ((uint64_t)hdr & (PAGE_SIZE - 1)) || hdr->magic != VMALLOC_MAGIC)
+    {
+        printf("[VMM] Invalid vfree at 0x%llx\n", (uint64_t)ptr);
+        return;
+    }
+
+    size_t pages = hdr->pages;
+    hdr->magic = 0;
+
+    struct tlb_gather tlb;
+
+    tlb_gather_init(&tlb);
+
+    spin_lock(&vmm_lock);
+    unmap_pages(&kernel_space, &tlb, (uint64_t)hdr, pages);
+    spin_unlock(&vmm_lock);
+
+    tlb_finish(&tlb);
+
+    va_free(&vmalloc_space, (uint64_t)hdr - PAGE_SIZE, (pages + 2) * PAGE_SIZE);
+}
+
+/*
+ * Get's the usable size of a vmalloc block
+ */
+size_t vmalloc_size(const void *ptr)
+{
+    const vmalloc_hdr_t *hdr = (const vmalloc_hdr_t *)ptr - 1;
+
+    if (hdr->magic != VMALLOC_MAGIC)
+    {
+        return 0;
+    }
+
+    return (size_t)hdr->pages * PAGE_SIZE - sizeof(vmalloc_hdr_t);
+}
+
+/*
+ * Get's physical address from virtual
+ */
+uint64_t vmm_get_phys(uint64_t virt)
+{
+    spin_lock(&vmm_lock);
+    uint64_t phys = paging_get_phys(virt);
+    spin_unlock(&vmm_lock);
+
+    return phys;
+}
+
+/*
+ * Back's a page of a file region from the page cache
+ * NOTE: Must be called with vmm_lock held and returns with it released.
+ * The lock is dropped while the page is read, so the region is looked up
+ * again after and whoever maps the page first wins.
+ */
+static int file_fault(struct address_space *as, struct vmm_region *region, uint64_t virt, uint64_t error)
+{
+    struct vm_file *file = region->file;
+    uint64_t index = region->pgoff + (virt - region->start) / PAGE_SIZE;
+    struct pt_walk walk;
+    int ret = -1;
+
+    filemap_get(file);
+    spin_unlock(&vmm_lock);
+
+    uint64_t phys = filemap_get_page(file, index);
+
+    if (!phys)
+    {
+        filemap_put(file);
+        return -1;
+    }
+
+    pt_walk_init(&walk, as->pml4);
+
+    spin_lock(&vmm_lock);
+
+    region = region_find(as, virt);
+
+    uint64_t *pte = NULL;
+
+    if (region && region->file == file && region->pgoff + (virt - region->start) / PAGE_SIZE == index)
+    {
+        pte = pt_walk(&walk, virt, PT_LEVEL_PTE, PT_WALK_CREATE | PT_WALK_SPLIT, NULL);
+        ret = pte ? 0 : -1;
+    }
+
+    if (pte && !(*pte & PAGE_PRESENT))
+    {
+        if (region->shared)
+        {
+            *pte = phys | region->flags | PAGE_PRESENT;
+        }
+        else
+        {
+            // a private mapping only gets its own copy when it writes
+            *pte = phys | (region->flags & ~PAGE_WRITE) | PAGE_PRESENT |
+                   ((region->flags & PAGE_WRITE) ? PAGE_COW : 0);
+
+            if (error & PF_WRITE)
+            {
+                ret = break_cow(pte, virt);
+            }
+        }
+
+        phys = 0;
+    }
+
+    spin_unlock(&vmm_lock);
+
+    // the page went unused, someone else mapped it or the region went away
+    if (phys)
+    {
+        put_page(phys_to_page(phys));
+    }
+
+    filemap_put(file);
+    return ret;
+}
+
+/*
+ * Handle's a page fault
+ * NOTE: A write to a copy-on-write page and a not-present access inside a
+ * demand region that its flags allow are resolved, everything else is
+ * left for the caller to report. Reads of a demand page map the shared
+ * zero page, so sparse buffers cost no frames until written.
+ * File regions are backed from the page cache.
+ */
+int vmm_handle_fault(uint64_t addr, uint64_t error)
+{
+    if (error & PF_RESERVED)
+    {
+        return -1;
+    }
+
+    struct address_space *as = is_user_addr(addr) ? aspace_current() : &kernel_space;
+    struct pt_walk walk;
+    uint64_t virt = addr & ~0xFFFULL;
+
+    pt_walk_init(&walk, as->pml4);
+
+    spin_lock(&vmm_lock);
+
+    if (error & PF_PRESENT)
+    {
+        uint64_t *pte = pt_walk(&walk, virt, PT_LEVEL_PTE, 0, NULL);
+        int ret = -1;
+
+        if (pte && (error & PF_WRITE) && (*pte & PAGE_COW) && (!(error & PF_USER) || (*pte & PAGE_USER)))
+        {
+            ret = break_cow(pte, virt);
+        }
+
+        spin_unlock(&vmm_lock);
+        return ret;
+    }
+
+    struct vmm_region *region = region_find(as, addr);
+
+    if (!region || ((error & PF_WRITE) && !(region->flags & PAGE_WRITE)) ||
+        ((error & PF_USER) && !(region->flags & PAGE_USER)))
+    {
+        spin_unlock(&vmm_lock);
+        return -1;
+    }
+
+    if (region->file)
+    {
+        return file_fault(as, region, virt, error);
+    }
+
+    uint64_t *pte = pt_walk(&walk, virt, PT_LEVEL_PTE, PT_WALK_CREATE | PT_WALK_SPLIT, NULL);
+
+    if (!pte)
+    {
+        spin_unlock(&vmm_lock);
+        return -1;
+    }
+
+    // a read only needs zeroes, the frame of its own waits for the first write
+    if (!(*pte & PAGE_PRESENT) && !(error & PF_WRITE) && zero_page)
+    {
+        get_page(phys_to_page(zero_page));
+        *pte = zero_page | (region->flags & ~PAGE_WRITE) | PAGE_PRESENT |
+               ((region->flags & PAGE_WRITE) ? PAGE_COW : 0);
+    }
+
+    // someone else may have backed the page since the fault was taken
+    if (!(*pte & PAGE_PRESENT))
+    {
+        void *phys = pmm_alloc_flags(PMM_ZERO);
+
+        if (!phys)
+        {
+            spin_unlock(&vmm_lock);
+            printf("[VMM] Out of memory backing 0x%llx\n", virt);
+            return -1;
+        }
+
+        *pte = (uint64_t)phys | region->flags | PAGE_PRESENT;
+    }
+
+    spin_unlock(&vmm_lock);
+    return 0;
+}